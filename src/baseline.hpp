@@ -0,0 +1,309 @@
+#ifndef SPBAU_RECOMMENDER_BASELINE_HPP_
+#define SPBAU_RECOMMENDER_BASELINE_HPP_
+
+/// 5.2.1 Baseline predictors
+/// Recommender Systems Handbook By Francesco Ricci, Lior Rokach, Paul B. Kantor, p.149
+/// Rating statistics of the users and the products: means, counts and the
+/// regularised biases of the baseline estimate b_ui = mu + b_u + b_i.
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "sparse_ratings.hpp"
+#include "parallel.hpp"
+
+/// Sufficient statistics of the ratings
+/// Sums and counts of the users and the products are gathered in one
+/// parallel pass over the stored ratings: a worker owns a block of rows
+/// (users) and keeps partial products' sums, merged in order afterwards.
+/// Products' biases follow from the sums, users' biases take one more pass
+/// over the rows as they depend on the products' biases:
+///   b_i = sum(r_ui - mu)/(product_regularization + n_i)
+///   b_u = sum(r_ui - mu - b_i)/(user_regularization + n_u)
+class rating_statistics_t
+{
+public:
+	/// \param[in] user_regularization,product_regularization Biases' damping
+	///   towards 0 (in ratings)
+	rating_statistics_t(float user_regularization = 5, float product_regularization = 5)
+		:m_user_regularization(user_regularization),
+		m_product_regularization(product_regularization), m_avg_rating(0)
+	{}
+
+	/// Statistics of the sparse ratings
+	void compute(const sparse_ratings_t &ratings)
+	{
+		size_t users = ratings.rows();
+		size_t products = ratings.cols();
+		reset(users, products);
+
+		size_t blocks = std::max<size_t>(std::min<size_t>(parallel_threads(), users), 1);
+		std::vector<std::vector<double> > block_sum(blocks);
+		std::vector<std::vector<uint32_t> > block_count(blocks);
+		parallel_for(0, blocks, [&](size_t b) {
+			block_sum[b].assign(products, 0);
+			block_count[b].assign(products, 0);
+			for (size_t i = users*b/blocks; i < users*(b+1)/blocks; ++i)
+			{
+				sparse_vector_view_t rated = ratings.get_row(i);
+				double sum = 0;
+				for (size_t k = 0; k < rated.nonzeros(); ++k)
+				{
+					sum += rated.value(k);
+					block_sum[b][rated.index(k)] += rated.value(k);
+					++block_count[b][rated.index(k)];
+				}
+				m_users_sum[i] = sum;
+				m_users_count[i] = rated.nonzeros();
+			}
+		});
+		merge(m_products_sum, block_sum);
+		merge(m_products_count, block_count);
+
+		finish_means();
+		finish_products_bias();
+		parallel_for(0, users, [&](size_t i) {
+			sparse_vector_view_t rated = ratings.get_row(i);
+			double products_bias = 0;
+			for (size_t k = 0; k < rated.nonzeros(); ++k)
+			{
+				products_bias += m_products_bias[rated.index(k)];
+			}
+			finish_user_bias(i, products_bias);
+		});
+	}
+
+	/// Statistics of the sparse ratings (the mask adds nothing)
+	void compute(const sparse_ratings_t &ratings, const sparse_ratings_mask_t &/*ratings_mask*/)
+	{
+		compute(ratings);
+	}
+
+	/// Statistics of the dense ratings, set cells are given by the mask
+	/// Dense matrices are column-major (itpp::mat), so the roles are swapped:
+	/// a worker owns a block of columns (products) and keeps partial users' sums.
+	template <class M, class B>
+	void compute(const M &ratings, const B &ratings_mask)
+	{
+		size_t users = ratings.rows();
+		size_t products = ratings.cols();
+		reset(users, products);
+
+		size_t blocks = std::max<size_t>(std::min<size_t>(parallel_threads(), products), 1);
+		std::vector<std::vector<double> > block_sum(blocks);
+		std::vector<std::vector<uint32_t> > block_count(blocks);
+		parallel_for(0, blocks, [&](size_t b) {
+			block_sum[b].assign(users, 0);
+			block_count[b].assign(users, 0);
+			for (size_t j = products*b/blocks; j < products*(b+1)/blocks; ++j)
+			{
+				double sum = 0;
+				size_t count = 0;
+				for (size_t i = 0; i < users; ++i)
+				{
+					if (bool(ratings_mask(i,j)) == true)
+					{
+						sum += ratings(i,j);
+						++count;
+						block_sum[b][i] += ratings(i,j);
+						++block_count[b][i];
+					}
+				}
+				m_products_sum[j] = sum;
+				m_products_count[j] = count;
+			}
+		});
+		merge(m_users_sum, block_sum);
+		merge(m_users_count, block_count);
+
+		finish_means();
+		finish_products_bias();
+		parallel_for(0, blocks, [&](size_t b) {
+			block_sum[b].assign(users, 0);
+			for (size_t j = products*b/blocks; j < products*(b+1)/blocks; ++j)
+			{
+				for (size_t i = 0; i < users; ++i)
+				{
+					if (bool(ratings_mask(i,j)) == true)
+					{
+						block_sum[b][i] += m_products_bias[j];
+					}
+				}
+			}
+		});
+		std::vector<double> products_bias(users, 0);
+		merge(products_bias, block_sum);
+		parallel_for(0, users, [&](size_t i) {
+			finish_user_bias(i, products_bias[i]);
+		});
+	}
+
+	/// Baseline estimate of the rating
+	float baseline(size_t user, size_t product) const
+	{
+		return m_avg_rating + m_users_bias[user] + m_products_bias[product];
+	}
+
+	/// Predict the cells stored in 'prediction' by the baseline estimate,
+	/// rated cells are left untouched
+	void predict(sparse_ratings_t &prediction, const sparse_ratings_mask_t &ratings_mask) const
+	{
+		parallel_for(0, prediction.rows(), [&](size_t i) {
+			sparse_vector_view_t predicted = prediction.get_row(i);
+			for (size_t k = 0; k < predicted.nonzeros(); ++k)
+			{
+				size_t j = predicted.index(k);
+				if (ratings_mask(i,j) == false)
+				{
+					prediction.set(i, j, baseline(i, j));
+				}
+			}
+		});
+	}
+
+	/// Replace the non-finite predictions of the cells stored in 'prediction'
+	/// by the baseline estimate, rated cells are left untouched
+	/// A user unknown to the statistics gets the product's baseline mu + b_i.
+	/// \return Number of the replaced predictions
+	size_t fill_undefined(sparse_ratings_t &prediction, 
+						  const sparse_ratings_mask_t &ratings_mask) const
+	{
+		return parallel_reduce(0, prediction.rows(), size_t(0), [&](size_t i) {
+			sparse_vector_view_t predicted = prediction.get_row(i);
+			size_t replaced = 0;
+			for (size_t k = 0; k < predicted.nonzeros(); ++k)
+			{
+				size_t j = predicted.index(k);
+				if (!std::isfinite(predicted.value(k)) && ratings_mask(i,j) == false)
+				{
+					prediction.set(i, j, baseline(i, j));
+					++replaced;
+				}
+			}
+			return replaced;
+		}, [](size_t a, size_t b) {
+			return a + b;
+		});
+	}
+
+	/// Copy the means to the average ratings vectors (avg_ratings())
+	template <class V>
+	void means(V &avg_users_rating, V &avg_products_rating) const
+	{
+		for (size_t i = 0; i < m_users_mean.size(); ++i)
+		{
+			avg_users_rating[i] = m_users_mean[i];
+		}
+		for (size_t j = 0; j < m_products_mean.size(); ++j)
+		{
+			avg_products_rating[j] = m_products_mean[j];
+		}
+	}
+
+	/// Average of all the ratings
+	float avg_rating() const
+	{
+		return m_avg_rating;
+	}
+	const std::vector<float> &users_mean() const
+	{
+		return m_users_mean;
+	}
+	const std::vector<float> &products_mean() const
+	{
+		return m_products_mean;
+	}
+	const std::vector<uint32_t> &users_count() const
+	{
+		return m_users_count;
+	}
+	const std::vector<uint32_t> &products_count() const
+	{
+		return m_products_count;
+	}
+	const std::vector<float> &users_bias() const
+	{
+		return m_users_bias;
+	}
+	const std::vector<float> &products_bias() const
+	{
+		return m_products_bias;
+	}
+
+private:
+	void reset(size_t users, size_t products)
+	{
+		m_users_sum.assign(users, 0);
+		m_users_count.assign(users, 0);
+		m_products_sum.assign(products, 0);
+		m_products_count.assign(products, 0);
+		m_users_mean.assign(users, 0);
+		m_products_mean.assign(products, 0);
+		m_users_bias.assign(users, 0);
+		m_products_bias.assign(products, 0);
+		m_avg_rating = 0;
+	}
+
+	void finish_means()
+	{
+		double sum = 0;
+		size_t count = 0;
+		for (size_t i = 0; i < m_users_sum.size(); ++i)
+		{
+			sum += m_users_sum[i];
+			count += m_users_count[i];
+			m_users_mean[i] = m_users_count[i] > 0 ? m_users_sum[i]/m_users_count[i] : 0;
+		}
+		for (size_t j = 0; j < m_products_sum.size(); ++j)
+		{
+			m_products_mean[j] = m_products_count[j] > 0
+									? m_products_sum[j]/m_products_count[j] : 0;
+		}
+		m_avg_rating = count > 0 ? sum/count : 0;
+	}
+
+	void finish_products_bias()
+	{
+		for (size_t j = 0; j < m_products_sum.size(); ++j)
+		{
+			m_products_bias[j] = (m_products_sum[j] - m_products_count[j]*m_avg_rating)
+									/(m_product_regularization + m_products_count[j]);
+		}
+	}
+
+	/// Add the blocks' partial sums to 'total', in the blocks' order
+	template <class T, class P>
+	static void merge(std::vector<T> &total, const std::vector<std::vector<P> > &partial)
+	{
+		parallel_for(0, total.size(), [&](size_t k) {
+			for (size_t b = 0; b < partial.size(); ++b)
+			{
+				total[k] += partial[b][k];
+			}
+		});
+	}
+
+	/// \param[in] products_bias Sum of the biases of the products rated by the user
+	void finish_user_bias(size_t user, double products_bias)
+	{
+		m_users_bias[user] = (m_users_sum[user] - m_users_count[user]*m_avg_rating - products_bias)
+							/(m_user_regularization + m_users_count[user]);
+	}
+
+	float m_user_regularization;	///< Users' biases damping
+	float m_product_regularization;	///< Products' biases damping
+	float m_avg_rating;	///< Average of all the ratings
+	std::vector<double> m_users_sum;	///< Sum of the user's ratings
+	std::vector<uint32_t> m_users_count;	///< Number of the user's ratings
+	std::vector<double> m_products_sum;	///< Sum of the product's ratings
+	std::vector<uint32_t> m_products_count;	///< Number of the product's ratings
+	std::vector<float> m_users_mean;	///< User's mean rating, 0 if none
+	std::vector<float> m_products_mean;	///< Product's mean rating, 0 if none
+	std::vector<float> m_users_bias;	///< User's bias
+	std::vector<float> m_products_bias;	///< Product's bias
+};
+
+#endif	// SPBAU_RECOMMENDER_BASELINE_HPP_
@@ -0,0 +1,406 @@
+#include <cstddef>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+
+#include <tclap/CmdLine.h>
+
+#include <itpp/base/vec.h>
+#include <itpp/base/mat.h>
+
+#include "dataset_io.hpp"
+#include "sparse_ratings.hpp"
+#include "user_resemblance.hpp"
+#include "similarity_cache.hpp"
+#include "neighbour_index.hpp"
+#include "grouplens.hpp"
+#include "knn.hpp"
+#include "item_based.hpp"
+#include "matrix_factorization.hpp"
+#include "baseline.hpp"
+#include "error.hpp"
+#include "cross_validation.hpp"
+#include "parallel.hpp"
+#include "simd_kernels.hpp"
+#include "online_model.hpp"
+#include "benchmark.hpp"
+
+/// Product weight of correlation_coeff_idf_corated (all products are equal)
+class benchmark_product_weight_t
+{
+public:
+	float operator()(size_t /*product*/) const
+	{
+		return 1;
+	}
+};
+
+int main(int argc, char **argv)
+{
+	size_t users = 2000;
+	size_t products = 1000;
+	double density = 0.02;
+	size_t seed = 1;
+	double min_time = 0.5;
+	size_t neighbours = 30;
+	size_t threads = 0;
+	std::string output_filename("benchmark.json");
+	std::string data_filename("benchmark.data");
+
+	try
+	{
+		TCLAP::CmdLine cmd("Recommender benchmarks", ' ', "0.0");
+
+		TCLAP::ValueArg<size_t> users_arg("u", "users",
+										"Number of users of the synthetic dataset",
+										false, users, "unsigned integer", cmd);
+		TCLAP::ValueArg<size_t> products_arg("p", "products",
+										"Number of products of the synthetic dataset",
+										false, products, "unsigned integer", cmd);
+		TCLAP::ValueArg<double> density_arg("e", "density",
+										"Part of the products rated by a user",
+										false, density, "real", cmd);
+		TCLAP::ValueArg<size_t> seed_arg("s", "seed",
+										"Synthetic dataset random seed",
+										false, seed, "unsigned integer", cmd);
+		TCLAP::ValueArg<double> min_time_arg("t", "min-time",
+										"Minimal time of a benchmark (seconds)",
+										false, min_time, "real", cmd);
+		TCLAP::ValueArg<size_t> neighbours_arg("b", "neighbours",
+										"Number of neighbours of k-NN",
+										false, neighbours, "unsigned integer", cmd);
+		TCLAP::ValueArg<size_t> threads_arg("j", "threads",
+										"Number of worker threads (0 for every hardware thread)",
+										false, threads, "unsigned integer", cmd);
+		TCLAP::ValueArg<std::string> output_filename_arg("o", "output-filename",
+										"JSON results filename (\"-\" for stdout)",
+										false, output_filename, "string", cmd);
+		TCLAP::ValueArg<std::string> data_filename_arg("f", "data-filename",
+										"Temporary dataset filename",
+										false, data_filename, "string", cmd);
+
+		cmd.parse(argc, argv);
+
+		users = users_arg.getValue();
+		products = products_arg.getValue();
+		density = density_arg.getValue();
+		seed = seed_arg.getValue();
+		min_time = min_time_arg.getValue();
+		neighbours = neighbours_arg.getValue();
+		threads = threads_arg.getValue();
+		output_filename = output_filename_arg.getValue();
+		data_filename = data_filename_arg.getValue();
+	}
+	catch(TCLAP::ArgException &excp)
+	{
+		std::cerr << "TCLAP Error: " << excp.error();
+		return 1;
+	}
+
+	parallel_set_threads(threads);
+
+	typedef std::vector<dataset_triplet_t> triplets_type;
+	triplets_type triplets;
+	dataset_triplet_t max_triplet_values = {0, 0, 0};
+	synthetic_dataset(users, products, density, seed, triplets, max_triplet_values);
+	{
+		std::ofstream data_file(data_filename.c_str());
+		if (!data_file.is_open())
+		{
+			std::cerr << "Can't write file: \"" << data_filename << "\"" << std::endl;
+			return 1;
+		}
+		for (size_t i = 0; i < triplets.size(); ++i)
+		{
+			data_file << triplets[i].user << ";" << triplets[i].product << ";"
+					  << triplets[i].rating << "\n";
+		}
+	}
+
+	benchmark_t benchmark(min_time);
+	benchmark.context("users", users);
+	benchmark.context("products", products);
+	benchmark.context("density", density);
+	benchmark.context("ratings", triplets.size());
+	benchmark.context("seed", seed);
+	benchmark.context("neighbours", neighbours);
+	benchmark.context("threads", parallel_threads());
+	benchmark.context("simd", benchmark_t::json_string(simd_kernels().name));
+
+	// Dataset input
+	benchmark.run("read_dataset", triplets.size(), [&]() {
+		std::ifstream file(data_filename.c_str());
+		triplets_type read_triplets;
+		dataset_triplet_t read_max = {0, 0, 0};
+		read_dataset(file, read_triplets, read_max);
+		return read_triplets.size();
+	});
+	benchmark.run("read_dataset_file", triplets.size(), [&]() {
+		triplets_type read_triplets;
+		dataset_triplet_t read_max = {0, 0, 0};
+		read_dataset_file(data_filename, read_triplets, read_max);
+		return read_triplets.size();
+	});
+	std::remove(data_filename.c_str());
+
+	// Learning and validation sets as cross-validation uses them
+	triplets_type validation_triplets;
+	triplets_type learning_triplets;
+	cross_validation_get_sets(triplets, validation_triplets, learning_triplets, 0.1);
+
+	benchmark.run("convert_triplets_to_matrix", learning_triplets.size(), [&]() {
+		id_dictionary_t users_converter;
+		id_dictionary_t products_converter;
+		sparse_ratings_t ratings;
+		sparse_ratings_mask_t ratings_mask;
+		convert_triplets_to_matrix(ratings, ratings_mask, learning_triplets,
+								   max_triplet_values,
+								   users_converter, products_converter);
+		return ratings.nonzeros();
+	});
+
+	id_dictionary_t users_converter;
+	id_dictionary_t products_converter;
+	sparse_ratings_t learning;
+	sparse_ratings_mask_t learning_mask;
+	sparse_ratings_t validation;
+	sparse_ratings_mask_t validation_mask;
+	convert_triplets_to_matrix(learning, learning_mask, learning_triplets,
+							   max_triplet_values, users_converter, products_converter);
+	convert_triplets_to_matrix(validation, validation_mask, validation_triplets,
+							   max_triplet_values, users_converter, products_converter);
+	learning.resize(users_converter.used_idxs(), products_converter.used_idxs());
+	validation.resize(users_converter.used_idxs(), products_converter.used_idxs());
+
+	itpp::vec avg_users_rating(learning.rows());
+	itpp::vec avg_products_rating(learning.cols());
+	benchmark.run("avg_ratings", learning.nonzeros(), [&]() {
+		avg_users_rating.zeros();
+		avg_products_rating.zeros();
+		avg_ratings(learning, learning_mask, avg_users_rating, avg_products_rating);
+		return avg_users_rating[0];
+	});
+	rating_statistics_t statistics;
+	benchmark.run("rating_statistics", learning.nonzeros(), [&]() {
+		statistics.compute(learning);
+		return statistics.avg_rating();
+	});
+
+	// Similarity metrics, every user with the next one
+	size_t pairs = learning.rows() > 0 ? learning.rows() - 1 : 0;
+	benchmark.run("correlation_coeff", pairs, [&]() {
+		float total = 0;
+		for (size_t i = 0; i < pairs; ++i)
+		{
+			total += correlation_coeff(learning.get_row(i), learning.get_row(i+1));
+		}
+		return total;
+	});
+	benchmark.run("cosine_angle", pairs, [&]() {
+		float total = 0;
+		for (size_t i = 0; i < pairs; ++i)
+		{
+			total += cosine_angle(learning.get_row(i), learning.get_row(i+1));
+		}
+		return total;
+	});
+	benchmark.run("correlation_coeff_corated", pairs, [&]() {
+		float total = 0;
+		for (size_t i = 0; i < pairs; ++i)
+		{
+			total += correlation_coeff_corated(learning.get_row(i), learning.get_row(i+1));
+		}
+		return total;
+	});
+	benchmark.run("cosine_angle_corated", pairs, [&]() {
+		float total = 0;
+		for (size_t i = 0; i < pairs; ++i)
+		{
+			total += cosine_angle_corated(learning.get_row(i), learning.get_row(i+1));
+		}
+		return total;
+	});
+	benchmark.run("correlation_coeff_idf_corated", pairs, [&]() {
+		float total = 0;
+		for (size_t i = 0; i < pairs; ++i)
+		{
+			total += correlation_coeff_idf_corated(learning.get_row(i), learning.get_row(i+1),
+												   benchmark_product_weight_t());
+		}
+		return total;
+	});
+
+	// All-pairs users' resemblance
+	user_resemblance_sparse_t::resemblance_type user_resemblance(learning.rows(), learning.rows());
+	user_resemblance_sparse_t::resemblance_mask_type user_resemblance_mask(learning.rows(), 
+																		   learning.rows());
+	size_t all_pairs = learning.rows()*(learning.rows()+1)/2;
+	benchmark.run("user_resembl cosine", all_pairs, [&]() {
+		user_resemblance_mask.zeros();
+		return user_resembl(learning, user_resemblance, user_resemblance_mask,
+							cosine_angle_resembl_metric_t());
+	});
+	benchmark.run("user_resembl pearson", all_pairs, [&]() {
+		user_resemblance_mask.zeros();
+		return user_resembl(learning, user_resemblance, user_resemblance_mask,
+							correlation_coeff_resembl_metric_t());
+	});
+	user_resemblance_sparse_t u_resemblance(learning, user_resemblance, user_resemblance_mask);
+
+	// Neighbours
+	neighbour_index_t neighbour_index;
+	benchmark.run("neighbour_index exact", learning.rows(), [&]() {
+		knn_neighbours(neighbour_index, neighbours, learning, u_resemblance,
+					   NEIGHBOUR_SEARCH_EXACT);
+		return neighbour_index.neighbours(0);
+	});
+	benchmark.run("neighbour_index approximate", learning.rows(), [&]() {
+		knn_neighbours(neighbour_index, neighbours, learning, u_resemblance,
+					   NEIGHBOUR_SEARCH_APPROXIMATE);
+		return neighbour_index.neighbours(0);
+	});
+
+	// Resemblance computed on demand, the cache holds a quarter of the pairs
+	user_resemblance_sparse_t::resemblance_type no_resemblance;
+	user_resemblance_sparse_t::resemblance_mask_type no_resemblance_mask;
+	user_resemblance_sparse_t cached_resemblance(learning, no_resemblance, no_resemblance_mask);
+	benchmark.run("neighbour_index exact similarity_cache", learning.rows(), [&]() {
+		similarity_cache_t cache(all_pairs/4);
+		cached_resemblance.use_cache(cache);
+		knn_neighbours(neighbour_index, neighbours, learning, cached_resemblance,
+					   NEIGHBOUR_SEARCH_EXACT);
+		return neighbour_index.neighbours(0);
+	});
+
+	neighbour_index_t product_neighbours;
+	benchmark.run("item_neighbours", learning.cols(), [&]() {
+		item_neighbours(product_neighbours, neighbours, learning, avg_users_rating);
+		return product_neighbours.neighbours(0);
+	});
+
+	// Predictions of the validation cells
+	sparse_ratings_t prediction(validation);
+	benchmark.run("knn", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		knn(prediction, neighbours, learning, learning_mask, u_resemblance,
+			avg_users_rating, avg_products_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("grouplens cell", validation.nonzeros(), [&]() {
+		float total = 0;
+		validation.for_each([&](int i, int j, float) {
+			total += grouplens(avg_products_rating, learning, avg_users_rating,
+							   i, j, u_resemblance);
+		});
+		return total;
+	});
+	benchmark.run("grouplens_reference", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		grouplens_reference(prediction, learning, learning_mask, u_resemblance,
+							avg_users_rating, avg_products_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("grouplens", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		grouplens(prediction, learning, learning_mask, u_resemblance,
+				  avg_users_rating, avg_products_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("grouplens_raters", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		grouplens_raters(prediction, learning, learning_mask, u_resemblance,
+						 avg_users_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("grouplens_raters similarity_cache", validation.nonzeros(), [&]() {
+		similarity_cache_t cache(all_pairs/4);
+		cached_resemblance.use_cache(cache);
+		prediction.zeros();
+		grouplens_raters(prediction, learning, learning_mask, cached_resemblance,
+						 avg_users_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("knn_raters", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		knn_raters(prediction, neighbour_index, learning, learning_mask, 
+				   avg_users_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("item_based", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		item_based(prediction, product_neighbours, learning, learning_mask, 
+				   avg_products_rating);
+		return prediction.nonzeros();
+	});
+	benchmark.run("baseline predict", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		statistics.predict(prediction, learning_mask);
+		return prediction.nonzeros();
+	});
+	matrix_factorization_t factorization;
+	benchmark.run("matrix_factorization train", learning.nonzeros(), [&]() {
+		factorization.train(learning);
+		return factorization.predict(0, 0);
+	});
+	benchmark.run("matrix_factorization predict", validation.nonzeros(), [&]() {
+		prediction.zeros();
+		factorization.predict(prediction, learning_mask);
+		return prediction.nonzeros();
+	});
+	benchmark.run("rmse", validation.nonzeros(), [&]() {
+		return rmse(validation, prediction);
+	});
+	benchmark.run("mae", validation.nonzeros(), [&]() {
+		return mae(validation, validation_mask, prediction, validation_mask);
+	});
+	benchmark.run("ranking_error", validation.nonzeros(), [&]() {
+		return ranking_error(validation, prediction, 10, 4).ndcg();
+	});
+
+	// Incremental model: every rating ingested, then the validation cells predicted
+	online_model_t online_model(neighbours);
+	benchmark.run("online_model add", learning_triplets.size(), [&]() {
+		online_model_t model(neighbours);
+		model.add(learning_triplets);
+		return model.ratings();
+	});
+	online_model.add(learning_triplets);
+	benchmark.run("online_model predict", validation_triplets.size(), [&]() {
+		float total = 0;
+		for (size_t i = 0; i < validation_triplets.size(); ++i)
+		{
+			total += online_model.predict(validation_triplets[i].user, 
+										  validation_triplets[i].product);
+		}
+		return total;
+	});
+
+	// End-to-end 5-fold, the cross-validation report is discarded
+	benchmark.run("cross_validation", triplets.size(), [&]() {
+		std::ostringstream discarded;
+		std::streambuf *cout_buffer = std::cout.rdbuf(discarded.rdbuf());
+		cross_validation(triplets, max_triplet_values, 5, 0, seed, std::string());
+		std::cout.rdbuf(cout_buffer);
+		return discarded.str().size();
+	});
+
+	if (output_filename == "-")
+	{
+		benchmark.write_json(std::cout);
+	}
+	else
+	{
+		std::ofstream output_file(output_filename.c_str());
+		if (!output_file.is_open())
+		{
+			std::cerr << "Can't write file: \"" << output_filename << "\"" << std::endl;
+			return 1;
+		}
+		benchmark.write_json(output_file);
+	}
+
+	return 0;
+}
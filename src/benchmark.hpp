@@ -0,0 +1,187 @@
+#ifndef SPBAU_RECOMMENDER_BENCHMARK_HPP_
+#define SPBAU_RECOMMENDER_BENCHMARK_HPP_
+
+/// Benchmark harness
+/// A benchmark is a functor run repeatedly until both the minimal time and
+/// the minimal number of iterations are reached (after one warm-up run);
+/// results are written as JSON.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <iostream>
+
+struct benchmark_result_t
+{
+	std::string name;	///< Benchmark name
+	size_t items;	///< Items processed by an iteration
+	size_t iterations;	///< Number of timed iterations
+	double min_seconds;	///< Fastest iteration
+	double mean_seconds;	///< Mean iteration time
+	double max_seconds;	///< Slowest iteration
+};
+
+class benchmark_t
+{
+public:
+	/// \param[in] min_time Minimal total time of a benchmark (seconds)
+	/// \param[in] min_iterations Minimal number of timed iterations
+	benchmark_t(double min_time, size_t min_iterations = 3)
+		:m_min_time(min_time), m_min_iterations(min_iterations), m_sink(0)
+	{}
+
+	/// Describe the run (dataset parameters, threads, etc.)
+	/// \param[in] value JSON value
+	void context(const std::string &key, const std::string &value)
+	{
+		m_context.push_back(std::make_pair(key, value));
+	}
+	template <class T>
+	void context(const std::string &key, const T &value)
+	{
+		std::ostringstream json_value;
+		json_value << value;
+		context(key, json_value.str());
+	}
+
+	/// Time the functor
+	/// \param[in] name Benchmark name
+	/// \param[in] items Items processed by a call (for the throughput)
+	/// \param[in] f Functor, its result is consumed so the work can't be optimised away
+	template <class F>
+	const benchmark_result_t &run(const std::string &name, size_t items, F f)
+	{
+		benchmark_result_t result = {name, items, 0, 0, 0, 0};
+		m_sink += f();
+
+		double total = 0;
+		while (total < m_min_time || result.iterations < m_min_iterations)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			m_sink += f();
+			double seconds = std::chrono::duration<double>(
+								std::chrono::steady_clock::now() - start).count();
+			result.min_seconds = result.iterations == 0
+									? seconds : std::min(result.min_seconds, seconds);
+			result.max_seconds = std::max(result.max_seconds, seconds);
+			total += seconds;
+			++result.iterations;
+		}
+		result.mean_seconds = total/result.iterations;
+		m_results.push_back(result);
+
+		std::clog << name << ": " << result.mean_seconds*1e3 << " ms";
+		if (items > 0)
+		{
+			std::clog << " (" << items/result.mean_seconds << " items/sec)";
+		}
+		std::clog << std::endl;
+		return m_results.back();
+	}
+
+	const std::vector<benchmark_result_t> &results() const
+	{
+		return m_results;
+	}
+
+	void write_json(std::ostream &out) const
+	{
+		out << "{\n\t\"context\": {";
+		for (size_t i = 0; i < m_context.size(); ++i)
+		{
+			out << (i > 0 ? ",\n\t\t" : "\n\t\t")
+				<< json_string(m_context[i].first) << ": " << m_context[i].second;
+		}
+		out << "\n\t},\n\t\"benchmarks\": [";
+		for (size_t i = 0; i < m_results.size(); ++i)
+		{
+			const benchmark_result_t &result = m_results[i];
+			out << (i > 0 ? ",\n\t\t{" : "\n\t\t{")
+				<< "\"name\": " << json_string(result.name)
+				<< ", \"items\": " << result.items
+				<< ", \"iterations\": " << result.iterations
+				<< ", \"min_sec\": " << result.min_seconds
+				<< ", \"mean_sec\": " << result.mean_seconds
+				<< ", \"max_sec\": " << result.max_seconds
+				<< ", \"items_per_sec\": "
+				<< (result.items > 0 ? result.items/result.mean_seconds : 0)
+				<< "}";
+		}
+		out << "\n\t]\n}" << std::endl;
+	}
+
+	static std::string json_string(const std::string &s)
+	{
+		std::string quoted("\"");
+		for (size_t i = 0; i < s.size(); ++i)
+		{
+			if (s[i] == '"' || s[i] == '\\')
+			{
+				quoted += '\\';
+			}
+			quoted += s[i];
+		}
+		return quoted + "\"";
+	}
+
+private:
+	double m_min_time;	///< Minimal total time of a benchmark
+	size_t m_min_iterations;	///< Minimal number of timed iterations
+	std::vector<std::pair<std::string, std::string> > m_context;	///< Run description
+	std::vector<benchmark_result_t> m_results;	///< Results in the order of runs
+	volatile double m_sink;	///< Consumed results of the functors
+};
+
+/// Synthetic dataset
+/// Every user rates about 'density' of the products (at least one), chosen
+/// uniformly; ratings 1..5 are the sum of the user's and the product's
+/// biases and noise. Triplets are shuffled.
+/// \param[in] seed Random generator seed, the same seed gives the same dataset
+template <class T>
+void synthetic_dataset(size_t users, size_t products, double density, uint32_t seed,
+					   T &triplets, typename T::value_type &max_triplet_values)
+{
+	std::mt19937 random(seed);
+	std::normal_distribution<float> bias(0, 1);
+	std::normal_distribution<float> noise(0, 0.5);
+	std::vector<float> product_bias(products);
+	for (size_t j = 0; j < products; ++j)
+	{
+		product_bias[j] = bias(random);
+	}
+
+	size_t ratings_per_user = std::max<size_t>(1, density*products);
+	std::vector<size_t> rated(products);
+	for (size_t j = 0; j < products; ++j)
+	{
+		rated[j] = j;
+	}
+	triplets.reserve(triplets.size() + users*ratings_per_user);
+	for (size_t i = 0; i < users; ++i)
+	{
+		float user_bias = bias(random);
+		// partial Fisher-Yates shuffle: the first products are distinct random ones
+		for (size_t k = 0; k < std::min(ratings_per_user, products); ++k)
+		{
+			std::swap(rated[k], rated[k + random() % (products - k)]);
+			typename T::value_type triplet;
+			triplet.user = i;
+			triplet.product = rated[k];
+			float rating = 3 + user_bias + product_bias[rated[k]] + noise(random);
+			triplet.rating = std::min(5, std::max(1, int(rating + 0.5f)));
+			triplets.push_back(triplet);
+		}
+	}
+	std::shuffle(triplets.begin(), triplets.end(), random);
+
+	max_triplet_values.user = users > 0 ? users - 1 : 0;
+	max_triplet_values.product = products > 0 ? products - 1 : 0;
+}
+
+#endif	// SPBAU_RECOMMENDER_BENCHMARK_HPP_
@@ -2,10 +2,21 @@
 #ifndef SPBAU_RECOMMENDER_COLLABORATIVE_FILTERING_HPP_
 #define SPBAU_RECOMMENDER_COLLABORATIVE_FILTERING_HPP_
 
+#include <cstddef>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
 
 #include "grouplens.hpp"
 #include "knn.hpp"
+#include "item_based.hpp"
+#include "baseline.hpp"
+#include "matrix_factorization.hpp"
+
+// Defined in cross_validation.hpp
+template <class D, class M, class S, class A>
+class fold_model_t;
 
 template <class D, class M, class S, class A>
 class collaborative_filtering_algorithm_t
@@ -15,20 +26,22 @@ public:
 	typedef M dataset_mask_type;
 	typedef S similarity_type;
 	typedef A average_type;
+	typedef fold_model_t<D, M, S, A> model_type;
 
 	collaborative_filtering_algorithm_t(const std::string &name)
 		:m_name(name)
 	{}
+	virtual ~collaborative_filtering_algorithm_t()
+	{}
 
 	std::string name() const
 	{
 		return m_name;
 	}
 
-	virtual void operator()(D &algo_prediction, const D &data, const M &mask, 
-							S &users_similarity, 
-							const A &avg_users_rating, 
-							const A &avg_product_ratings) = 0;
+	/// Predict the cells stored in 'algo_prediction'
+	/// \param[in] model Model of the learning set, shared by the algorithms
+	virtual void operator()(D &algo_prediction, const model_type &model) = 0;
 private:
 	const std::string m_name;
 };
@@ -37,39 +50,193 @@ template <class D, class M, class S, class A>
 class grouplens_algo_t : public collaborative_filtering_algorithm_t<D, M, S, A>
 {
 public:
-	grouplens_algo_t()
-		:collaborative_filtering_algorithm_t("GroupLens")
+	/// \param[in] report_speedup Run the serial reference implementation 
+	///   on the same input as well and report the speed-up
+	grouplens_algo_t(bool report_speedup = false)
+		:collaborative_filtering_algorithm_t<D, M, S, A>("GroupLens"), 
+		m_report_speedup(report_speedup)
 	{}
-	virtual void operator()(D &algo_prediction, const D &data, const M &mask, 
-							S &users_similarity, 
-							const A &avg_users_rating, 
-							const A &avg_products_rating)
+	virtual void operator()(D &algo_prediction, const fold_model_t<D, M, S, A> &model)
 	{
+		double reference_seconds = 0;
+		if (m_report_speedup)
+		{
+			D reference_prediction(algo_prediction);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			grouplens_reference(reference_prediction, 
+								model.ratings(), model.ratings_mask(), 
+								model.user_resemblance(), 
+								model.avg_users_rating(), model.avg_products_rating());
+			reference_seconds = std::chrono::duration<double>(
+									std::chrono::steady_clock::now() - start).count();
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 		grouplens(algo_prediction, 
-				  data, mask, 
-				  users_similarity, 
-				  avg_users_rating, avg_products_rating);
+				  model.ratings(), model.ratings_mask(), 
+				  model.user_resemblance(), 
+				  model.avg_users_rating(), model.avg_products_rating());
+		if (m_report_speedup)
+		{
+			double seconds = std::chrono::duration<double>(
+								std::chrono::steady_clock::now() - start).count();
+			std::cout << "(" << reference_seconds << " sec serial, " 
+					  << seconds << " sec parallel, speed-up " 
+					  << reference_seconds/seconds << ") ";
+		}
 	}
+private:
+	bool m_report_speedup;	///< Report the speed-up over the serial implementation
 };
 
 template <class D, class M, class S, class A>
 class knn_grouplens_algo_t : public collaborative_filtering_algorithm_t<D, M, S, A>
 {
 public:
-	knn_grouplens_algo_t()
-		:collaborative_filtering_algorithm_t("k-NN-GroupLens")
+	/// \param[in] neighbours Number of neighbours
+	/// \param[in] search Neighbour search mode
+	knn_grouplens_algo_t(size_t neighbours = knn_default_neighbours, 
+						 neighbour_search_t search = NEIGHBOUR_SEARCH_EXACT)
+		:collaborative_filtering_algorithm_t<D, M, S, A>("k-NN-GroupLens"), 
+		m_neighbours(neighbours), m_search(search)
+	{}
+	/// Model's neighbour lists are used if they are the requested ones
+	virtual void operator()(D &algo_prediction, const fold_model_t<D, M, S, A> &model)
+	{
+		const neighbour_index_t *neighbours = &model.neighbours();
+		neighbour_index_t own_neighbours;
+		if (m_search != model.neighbour_search() 
+			|| model.neighbours().users() != size_t(model.ratings().rows())
+			|| model.neighbours().k() != std::min<size_t>(m_neighbours, 
+														  model.ratings().rows() - 1))
+		{
+			knn_neighbours(own_neighbours, m_neighbours, 
+						   model.ratings(), model.user_resemblance(), m_search);
+			neighbours = &own_neighbours;
+		}
+		knn(algo_prediction, *neighbours, 
+			model.ratings(), model.ratings_mask(), 
+			model.user_resemblance(), 
+			model.avg_users_rating(), model.avg_products_rating());
+	}
+private:
+	size_t m_neighbours;	///< Number of neighbours
+	neighbour_search_t m_search;	///< Neighbour search mode
+};
+
+template <class D, class M, class S, class A>
+class item_based_algo_t : public collaborative_filtering_algorithm_t<D, M, S, A>
+{
+public:
+	/// \param[in] neighbours Number of products' neighbours
+	item_based_algo_t(size_t neighbours = knn_default_neighbours)
+		:collaborative_filtering_algorithm_t<D, M, S, A>("Item-based"), 
+		m_neighbours(neighbours)
+	{}
+	/// Model's products' neighbour lists are used if they are the requested ones
+	virtual void operator()(D &algo_prediction, const fold_model_t<D, M, S, A> &model)
+	{
+		const neighbour_index_t *neighbours = &model.item_neighbours();
+		neighbour_index_t own_neighbours;
+		if (model.item_neighbours().users() != size_t(model.ratings().cols())
+			|| model.item_neighbours().k() != std::min<size_t>(m_neighbours, 
+															   model.ratings().cols() - 1))
+		{
+			item_neighbours(own_neighbours, m_neighbours, 
+							model.ratings(), model.avg_users_rating());
+			neighbours = &own_neighbours;
+		}
+		item_based(algo_prediction, *neighbours, 
+				   model.ratings(), model.ratings_mask(), 
+				   model.avg_products_rating());
+	}
+private:
+	size_t m_neighbours;	///< Number of products' neighbours
+};
+
+/// GroupLens over the raters of the product only (Resnick's estimator)
+/// Unlike grouplens_algo_t, the users who haven't rated the product don't
+/// take part in its prediction; with 'neighbours' set only the raters among
+/// the user's most resembling users do.
+template <class D, class M, class S, class A>
+class grouplens_raters_algo_t : public collaborative_filtering_algorithm_t<D, M, S, A>
+{
+public:
+	/// \param[in] neighbours Number of neighbours, 0 to visit every rater
+	/// \param[in] search Neighbour search mode
+	grouplens_raters_algo_t(size_t neighbours = 0, 
+							neighbour_search_t search = NEIGHBOUR_SEARCH_EXACT)
+		:collaborative_filtering_algorithm_t<D, M, S, A>(neighbours == 0 ? "GroupLens-raters" 
+																		  : "k-NN-GroupLens-raters"), 
+		m_neighbours(neighbours), m_search(search)
 	{}
-	virtual void operator()(D &algo_prediction, const D &data, const M &mask, 
-							S &users_similarity, 
-							const A &avg_users_rating, 
-							const A &avg_products_rating)
+	/// Model's neighbour lists are used if they are the requested ones
+	virtual void operator()(D &algo_prediction, const fold_model_t<D, M, S, A> &model)
 	{
-		knn(algo_prediction, 2, 
-			data, mask, 
-			users_similarity, 
-			avg_users_rating, avg_products_rating, 
-			0);
+		if (m_neighbours == 0)
+		{
+			grouplens_raters(algo_prediction, 
+							 model.ratings(), model.ratings_mask(), 
+							 model.user_resemblance(), model.avg_users_rating());
+			return;
+		}
+		const neighbour_index_t *neighbours = &model.neighbours();
+		neighbour_index_t own_neighbours;
+		if (m_search != model.neighbour_search() 
+			|| model.neighbours().users() != size_t(model.ratings().rows())
+			|| model.neighbours().k() != std::min<size_t>(m_neighbours, 
+														  model.ratings().rows() - 1))
+		{
+			knn_neighbours(own_neighbours, m_neighbours, 
+						   model.ratings(), model.user_resemblance(), m_search);
+			neighbours = &own_neighbours;
+		}
+		knn_raters(algo_prediction, *neighbours, 
+				   model.ratings(), model.ratings_mask(), model.avg_users_rating());
 	}
+private:
+	size_t m_neighbours;	///< Number of neighbours, 0 if every rater is visited
+	neighbour_search_t m_search;	///< Neighbour search mode
+};
+
+/// Baseline estimate mu + b_u + b_i of the model's rating statistics
+template <class D, class M, class S, class A>
+class baseline_algo_t : public collaborative_filtering_algorithm_t<D, M, S, A>
+{
+public:
+	baseline_algo_t()
+		:collaborative_filtering_algorithm_t<D, M, S, A>("Baseline")
+	{}
+	virtual void operator()(D &algo_prediction, const fold_model_t<D, M, S, A> &model)
+	{
+		model.statistics().predict(algo_prediction, model.ratings_mask());
+	}
+};
+
+template <class D, class M, class S, class A>
+class matrix_factorization_algo_t : public collaborative_filtering_algorithm_t<D, M, S, A>
+{
+public:
+	/// \param[in] factors Number of latent factors
+	/// \param[in] iterations Number of ALS sweeps
+	/// \param[in] regularization Factors' regularization
+	matrix_factorization_algo_t(size_t factors = 20, size_t iterations = 10, 
+								float regularization = 0.05f)
+		:collaborative_filtering_algorithm_t<D, M, S, A>("MF-ALS"), 
+		m_factorization(factors, iterations, regularization)
+	{}
+	/// Factors are learned from the model's ratings on every call
+	virtual void operator()(D &algo_prediction, const fold_model_t<D, M, S, A> &model)
+	{
+		m_factorization.train(model.ratings());
+		m_factorization.predict(algo_prediction, model.ratings_mask());
+	}
+	/// Learned model, e.g. to be serialised
+	const matrix_factorization_t &factorization() const
+	{
+		return m_factorization;
+	}
+private:
+	matrix_factorization_t m_factorization;	///< Latent factor model
 };
 
 #endif	// SPBAU_RECOMMENDER_COLLABORATIVE_FILTERING_HPP_
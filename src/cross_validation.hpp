@@ -2,18 +2,33 @@
 #ifndef SPBAU_RECOMMENDER_CROSS_VALIDATION_HPP_
 #define SPBAU_RECOMMENDER_CROSS_VALIDATION_HPP_
 
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
 #include <iostream>
 #include <string>
+#include <sstream>
 #include <memory>
+#include <vector>
+#include <random>
+#include <algorithm>
 
 #include <itpp/itbase.h>
 #include <itpp/base/vec.h>
 #include <itpp/base/mat.h>
 
 #include "dataset_io.hpp"
+#include "sparse_ratings.hpp"
 #include "user_resemblance.hpp"
+#include "resemblance_cache.hpp"
 #include "error.hpp"
+#include "neighbour_index.hpp"
+#include "knn.hpp"
+#include "item_based.hpp"
+#include "baseline.hpp"
 #include "collaborative_filtering.hpp"
+#include "parallel.hpp"
+#include "instrumentation.hpp"
 
 
 template <class T>
@@ -39,94 +54,464 @@ void cross_validation_get_sets(const T &triplets, T &validation, T &learning, fl
 	}
 }
 
+/// Shuffled triplet indexes grouped by user (seeded)
+/// \param[out] groups Group 'g' of one user's triplets is [groups[g], groups[g+1]) in 'order'
+template <class T>
+void cross_validation_user_groups(const T &triplets, uint32_t seed, 
+								  std::vector<size_t> &order, std::vector<size_t> &groups)
+{
+	std::mt19937 random(seed);
+	order.resize(triplets.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::shuffle(order.begin(), order.end(), random);
+	std::stable_sort(order.begin(), order.end(), 
+					 [&triplets](size_t a, size_t b) {
+						return triplets[a].user < triplets[b].user;
+					 });
+	groups.clear();
+	for (size_t k = 0; k < order.size(); ++k)
+	{
+		if (k == 0 || triplets[order[k]].user != triplets[order[k-1]].user)
+		{
+			groups.push_back(k);
+		}
+	}
+	groups.push_back(order.size());
+}
+
+/// Assign triplets to 'folds' folds of k-fold cross-validation
+/// Folds are stratified per user: every user's ratings are shuffled and 
+/// dealt to the folds in turn starting from a random fold, so each fold 
+/// gets an equal share (+-1) of every user's ratings.
+/// \param[in] seed Random generator seed, the same seed gives the same folds
+/// \param[out] fold Fold of every triplet
+template <class T>
+void cross_validation_get_folds(const T &triplets, size_t folds, uint32_t seed, 
+								std::vector<size_t> &fold)
+{
+	std::vector<size_t> order;
+	std::vector<size_t> groups;
+	cross_validation_user_groups(triplets, seed, order, groups);
+	std::mt19937 random(seed);
+	fold.assign(triplets.size(), 0);
+	for (size_t g = 0; g + 1 < groups.size(); ++g)
+	{
+		size_t first_fold = random() % folds;
+		for (size_t k = groups[g]; k < groups[g+1]; ++k)
+		{
+			fold[order[k]] = (first_fold + k - groups[g]) % folds;
+		}
+	}
+}
+
+/// Assign triplets to leave-p-out cross-validation sets
+/// 'p' random ratings of every user are left out (fold 0) for validation, 
+/// the rest are for learning (fold 1); users with no more than 'p' ratings 
+/// are left for learning entirely.
+/// \param[in] seed Random generator seed, the same seed gives the same sets
+/// \param[out] fold Fold of every triplet
+template <class T>
+void cross_validation_leave_p_out(const T &triplets, size_t p, uint32_t seed, 
+								  std::vector<size_t> &fold)
+{
+	std::vector<size_t> order;
+	std::vector<size_t> groups;
+	cross_validation_user_groups(triplets, seed, order, groups);
+	fold.assign(triplets.size(), 1);
+	for (size_t g = 0; g + 1 < groups.size(); ++g)
+	{
+		if (groups[g+1] - groups[g] > p)
+		{
+			for (size_t k = groups[g]; k < groups[g] + p; ++k)
+			{
+				fold[order[k]] = 0;
+			}
+		}
+	}
+}
+
+/// Split triplets into the validation fold and the learning rest
+template <class T>
+void cross_validation_get_sets(const T &triplets, const std::vector<size_t> &fold, 
+							   size_t validation_fold, T &validation, T &learning)
+{
+	for (size_t i = 0; i < triplets.size(); ++i)
+	{
+		if (fold[i] == validation_fold)
+		{
+			validation.push_back(triplets[i]);
+		}
+		else
+		{
+			learning.push_back(triplets[i]);
+		}
+	}
+}
+
+/// Average user's ratings and product's ratings
+/// Both are gathered in one parallel pass over the ratings 
+/// (rating_statistics_t), users without ratings and products without 
+/// ratings average 0.
 template <class M, class V, class B>
 void avg_ratings(const M &users_ratings, const B &users_ratings_mask, 
 					V &avg_users_rating, V &avg_product_ratings)
 {
-	// Average user's ratings and product's ratings
-#if defined(ALG_REF_IMPL) || !defined(ALG_REF_IMPL)
-	for (int i=0; i<users_ratings.rows(); ++i)
+	rating_statistics_t statistics;
+	statistics.compute(users_ratings, users_ratings_mask);
+	statistics.means(avg_users_rating, avg_product_ratings);
+}
+
+/// Average user's ratings and product's ratings of the sparse matrix
+/// Only the stored ratings are visited, each once (rating_statistics_t).
+template <class V>
+void avg_ratings(const sparse_ratings_t &users_ratings, 
+				 const sparse_ratings_mask_t &/*users_ratings_mask*/, 
+				 V &avg_users_rating, V &avg_product_ratings)
+{
+	rating_statistics_t statistics;
+	statistics.compute(users_ratings);
+	statistics.means(avg_users_rating, avg_product_ratings);
+}
+
+/// Model of the learning set shared by the algorithms
+/// Rating statistics, averages, users' resemblance and users' and products' neighbour lists 
+/// are built once (per fold) 
+/// and are immutable afterwards, so the algorithms can only read them and 
+/// an algorithm costs its prediction time only.
+/// \tparam D Ratings matrix type
+/// \tparam M Ratings matrix mask type
+/// \tparam S Users' resemblance store type (user_resemblance_t)
+/// \tparam A Average ratings vector type
+template <class D, class M, class S, class A>
+class fold_model_t
+{
+public:
+	typedef D dataset_type;
+	typedef M dataset_mask_type;
+	typedef S similarity_type;
+	typedef A average_type;
+
+	/// Build the model
+	/// \param[in] learning,learning_mask Learning set, must outlive the model
+	/// \param[in] neighbours Number of neighbours in the neighbour lists, 
+	///   no lists are built if 0
+	/// \param[in] resemblance_cache_prefix Persisted users' resemblance is used
+	///   (and written) in the files of this prefix (resemblance_cache_filename()), 
+	///   none if empty
+	/// \param[in] resemblance_cache_capacity Users' resemblance is computed on 
+	///   demand and kept in a similarity cache of that many pairs; if 0 it is 
+	///   precomputed for all the pairs (users^2 matrix). The neighbour lists of 
+	///   the cache mode are searched approximately, among the co-raters, so 
+	///   they don't look up every pair (the exact search would compute every 
+	///   pair, about twice with a cache smaller than the triangle).
+	/// \param[in] resemblance_top_n Persisted resemblance layout: 0 for all the
+	///   pairs (triangular), else that many most resembling users of every user. 
+	///   Nothing is precomputed and no matrix is allocated if the persisted file
+	///   has all the pairs, or top-N lists long enough to give the exact 
+	///   neighbour lists (the pairs they miss are then computed on demand, only
+	///   GroupLens over all the users needs them). Of shorter lists only the 
+	///   missing pairs are precomputed.
+	fold_model_t(const D &learning, const M &learning_mask, size_t neighbours, 
+				 const std::string &resemblance_cache_prefix = std::string(), 
+				 size_t resemblance_cache_capacity = 0, 
+				 size_t resemblance_top_n = 0, size_t verbosity = 0)
+		:m_ratings(learning), m_ratings_mask(learning_mask), 
+		m_avg_users_rating(learning.rows()), m_avg_products_rating(learning.cols()), 
+		m_resemblance(0, 0), m_resemblance_mask(0, 0), 
+		m_user_resemblance(learning, m_resemblance, m_resemblance_mask), 
+		m_neighbour_search(resemblance_cache_capacity > 0 ? NEIGHBOUR_SEARCH_APPROXIMATE 
+														  : NEIGHBOUR_SEARCH_EXACT)
 	{
-		size_t valuable = 0;
-		for (int j=0; j<users_ratings.cols(); ++j)
+		// Average user's and product's ratings
+		if (verbosity >= 1)
+		{
+			std::cout << "Average user's and product's ratings...";
+		}
 		{
-			if (bool(users_ratings_mask(i,j)) == true)
+			instrumentation_scope_t stage("averages");
+			m_statistics.compute(learning, learning_mask);
+			m_statistics.means(m_avg_users_rating, m_avg_products_rating);
+		}
+		if (verbosity >= 1)
+		{
+			std::cout << "Done." << std::endl;
+		}
+		
+		// whole vectors are dumped at verbosity 3 only, they may be huge
+		if (verbosity >= 3)
+		{
+			std::cout << "Avg. users' ratings: \n" << m_avg_users_rating << std::endl;
+			std::cout << "Avg. products' ratings: \n" << m_avg_products_rating << std::endl;
+		}
+
+		// Users' resemblance
+		// resemblance persisted by the previous runs on the same learning set
+		std::string resemblance_cache_file;
+		uint64_t learning_fingerprint = 0;
+		if (!resemblance_cache_prefix.empty())
+		{
+			learning_fingerprint = dataset_fingerprint(learning);
+			resemblance_cache_file = resemblance_cache_filename(resemblance_cache_prefix, 
+																m_user_resemblance.metric_name(), 
+																resemblance_top_n);
+			if (m_resemblance_cache.open(resemblance_cache_file, learning_fingerprint, 
+										 m_user_resemblance.metric_name()))
 			{
-				++valuable;
-				avg_users_rating[i] += users_ratings(i,j);
+				m_user_resemblance.use_persisted(m_resemblance_cache);
+				if (verbosity >= 1)
+				{
+					std::cout << "Using users' resemblance from \"" 
+							  << resemblance_cache_file << "\"" << std::endl;
+				}
 			}
 		}
-		avg_users_rating[i] = valuable > 0 ? avg_users_rating[i]/valuable : 0;
-	}
-	
-	for (int i=0; i<users_ratings.cols(); ++i)
-	{
-		size_t valuable = 0;
-		for (int j=0; j<users_ratings.rows(); ++j)
+		// persisted top-N lists hold the exact neighbours
+		bool persisted_neighbours = m_resemblance_cache.is_open() && neighbours > 0 
+			&& m_resemblance_cache.top_n() >= neighbours;
+		if (resemblance_cache_capacity > 0)
+		{
+			m_similarity_cache.reset(new similarity_cache_t(resemblance_cache_capacity));
+			m_user_resemblance.use_cache(*m_similarity_cache);
+		}
+		else if (!persisted_neighbours 
+				 && (!m_resemblance_cache.is_open() || !m_resemblance_cache.complete()))
+		{
+			// every validated user needs resemblance to all the others, 
+			// only the pairs missing in the top-N layout are computed
+			if (verbosity >= 1)
+			{
+				std::cout << "Users' resemblance...";
+			}
+			instrumentation_scope_t stage("similarity");
+			m_resemblance.set_size(learning.rows(), learning.rows());
+			m_resemblance_mask.set_size(learning.rows(), learning.rows());
+			m_resemblance.zeros();
+			m_resemblance_mask.zeros();
+			if (m_resemblance_cache.is_open())
+			{
+				m_resemblance_cache.copy_to(m_resemblance, m_resemblance_mask);
+			}
+			size_t computed = user_resembl(learning, m_resemblance, m_resemblance_mask, 
+										   typename S::metric_type(), 
+										   256, verbosity);
+			static instrumentation_counter_t &precomputed_counter = 
+				instrumentation_t::instance().counter("resemblance precomputed");
+			instrumentation_count(precomputed_counter, computed);
+			bool precomputed = computed > 0;
+			if (verbosity >= 1)
+			{
+				std::cout << "Done." << std::endl;
+			}
+			if (!resemblance_cache_prefix.empty() && precomputed && !m_resemblance_cache.is_open()
+				&& !write_resemblance_cache(resemblance_cache_file, learning_fingerprint, 
+											m_user_resemblance, resemblance_top_n))
+			{
+				std::cout << "Can't write cache file: \"" 
+						  << resemblance_cache_file << "\"" << std::endl;
+			}
+		}
+
+		// Neighbour lists
+		if (neighbours > 0)
 		{
-			if (bool(users_ratings_mask(j,i)) == true)
+			if (verbosity >= 1)
+			{
+				std::cout << "Neighbours...";
+			}
+			{
+				instrumentation_scope_t stage("neighbour search");
+				if (persisted_neighbours)
+				{
+					const resemblance_cache_t &persisted = m_resemblance_cache;
+					m_neighbours.build_from_lists(learning.rows(), neighbours, [&persisted](size_t user) {
+						return std::make_pair(persisted.entries_begin(user), 
+											  persisted.entries_end(user));
+					});
+					m_neighbour_search = NEIGHBOUR_SEARCH_EXACT;
+				}
+				else
+				{
+					knn_neighbours(m_neighbours, neighbours, learning, m_user_resemblance, 
+								   m_neighbour_search);
+				}
+			}
+			if (verbosity >= 1)
+			{
+				std::cout << "Done." << std::endl;
+				std::cout << "Products' neighbours...";
+			}
+			{
+				instrumentation_scope_t stage("products' neighbour search");
+				::item_neighbours(m_item_neighbours, neighbours, learning, m_avg_users_rating);
+			}
+			if (verbosity >= 1)
 			{
-				++valuable;
-				avg_product_ratings[i] += users_ratings(j,i);
+				std::cout << "Done." << std::endl;
 			}
 		}
-		avg_product_ratings[i] = valuable > 0 ? avg_product_ratings[i]/valuable : 0;
 	}
-#else
-#error ALG_ITPP_IMPL implementation of avg_ratings is obsolete
-	for (int i=0; i<users_ratings.rows(); ++i)
+
+	const D &ratings() const
 	{
-		avg_users_rating[i] = itpp::sum(users_ratings.get_row(i));
+		return m_ratings;
 	}
-	for (int j=0; j<users_ratings.cols(); ++j)
+	const M &ratings_mask() const
 	{
-		avg_product_ratings[j] = itpp::sum(users_ratings.get_col(j));
+		return m_ratings_mask;
 	}
-	avg_users_rating /= users_ratings.cols();
-	avg_product_ratings /= users_ratings.rows();
-#endif
-}
-
-template <class D, class M, typename AlgoInputIterator>
-void validate_algorithms(const D &learning, const M &learning_mask,
-						   const D &validation, const M &validation_mask,
-						   AlgoInputIterator algo_begin, AlgoInputIterator algo_end,
-						   size_t verbosity = 0)
-{
-	// Average user's and product's ratings
-	if (verbosity >= 1)
+	const A &avg_users_rating() const
 	{
-		std::cout << "Average user's and product's ratings...";
+		return m_avg_users_rating;
 	}
-	itpp::vec avg_users_rating(learning.rows());
-	itpp::vec avg_products_rating(learning.cols());
-	avg_users_rating.zeros();
-	avg_products_rating.zeros();
-	avg_ratings(learning, learning_mask, avg_users_rating, avg_products_rating);
-	if (verbosity >= 1)
+	const A &avg_products_rating() const
 	{
-		std::cout << "Done." << std::endl;
+		return m_avg_products_rating;
 	}
-	
-	if (verbosity >= 2)
+	/// Rating statistics: counts, averages and baseline biases
+	const rating_statistics_t &statistics() const
+	{
+		return m_statistics;
+	}
+	/// Users' resemblance, read through S::resemblance()
+	const S &user_resemblance() const
+	{
+		return m_user_resemblance;
+	}
+	/// Neighbour lists, empty if the model was built without them
+	const neighbour_index_t &neighbours() const
+	{
+		return m_neighbours;
+	}
+	/// Search mode of the neighbour lists
+	neighbour_search_t neighbour_search() const
 	{
-		std::cout << "Avg. users' ratings: \n" << avg_users_rating << std::endl;
-		std::cout << "Avg. products' ratings: \n" << avg_products_rating << std::endl;
+		return m_neighbour_search;
 	}
+	/// Products' neighbour lists (item_neighbours()), empty if the model 
+	/// was built without neighbour lists
+	const neighbour_index_t &item_neighbours() const
+	{
+		return m_item_neighbours;
+	}
+
+private:
+	fold_model_t(const fold_model_t &);
+	fold_model_t &operator=(const fold_model_t &);
 
-	// Users' resemblance
-	itpp::mat user_resemblance(learning.rows(), learning.rows());
-	itpp::bmat user_resemblance_mask(user_resemblance.rows(), user_resemblance.cols());
-	user_resemblance.zeros();
-	user_resemblance_mask.zeros();
+	const D &m_ratings;	///< Learning ratings matrix
+	const M &m_ratings_mask;	///< Learning ratings matrix mask
+	A m_avg_users_rating;	///< Average user's ratings
+	A m_avg_products_rating;	///< Average product's ratings
+	rating_statistics_t m_statistics;	///< Rating statistics of the learning set
+	typename S::resemblance_type m_resemblance;	///< Users' resemblance matrix
+	typename S::resemblance_mask_type m_resemblance_mask;	///< Users' resemblance matrix mask
+	resemblance_cache_t m_resemblance_cache;	///< Persisted users' resemblance
+	std::unique_ptr<similarity_cache_t> m_similarity_cache;	///< Users' resemblance computed on demand
+	S m_user_resemblance;	///< Users' resemblance store
+	neighbour_search_t m_neighbour_search;	///< Search mode of the neighbour lists
+	neighbour_index_t m_neighbours;	///< Neighbour lists
+	neighbour_index_t m_item_neighbours;	///< Products' neighbour lists
+};
 
-	// compute users' resemblance on demand
-	user_resemblance_itpp_t u_resemblance(learning, 
-										  user_resemblance, user_resemblance_mask, 
-										  correlation_coeff_resembl_metric_t());
+/// Prediction error of an algorithm
+struct prediction_error_t
+{
+	float rmse;	///< Root mean square error
+	float mae;	///< Mean absolute error
+	float precision;	///< Mean users' precision@k of the ranked candidates
+	float ndcg;	///< Mean users' NDCG@k of the ranked candidates
+	size_t fallbacks;	///< Number of the undefined predictions replaced by the baseline estimate
+};
+
+/// Cut-off of the candidates' ranking
+const size_t cross_validation_ranking_k = 10;
+/// Minimal rating of a relevant product
+const float cross_validation_relevant_rating = 4;
+/// Products unrated by the user sampled as the ranking candidates
+const size_t cross_validation_ranking_negatives = 100;
+
+/// Ranking candidates of the validation users
+/// Every user with validation ratings gets the validation products and up 
+/// to 'negatives' sampled products of the learning set the user rated in 
+/// neither set. The sample is seeded by the user index, so it depends on 
+/// neither the number of threads nor the algorithm.
+/// \return Pattern of the candidates (the sampled cells are 0, the 
+///   validation cells keep their ratings)
+inline sparse_ratings_t cross_validation_ranking_candidates(const sparse_ratings_t &learning, 
+															const sparse_ratings_t &validation, 
+															size_t negatives)
+{
+	std::vector<uint32_t> products;
+	for (int j = 0; j < learning.cols(); ++j)
+	{
+		if (learning.get_col(j).nonzeros() > 0)
+		{
+			products.push_back(j);
+		}
+	}
+	std::vector<std::vector<uint32_t> > sampled(validation.rows());
+	parallel_for(0, validation.rows(), [&](size_t i) {
+		sparse_vector_view_t validation_row = validation.get_row(i);
+		if (validation_row.nonzeros() == 0 || products.empty())
+		{
+			return;
+		}
+		sparse_vector_view_t learning_row = learning.get_row(i);
+		std::mt19937 random(static_cast<uint32_t>(i));
+		// the attempts are bounded for the users who rated most of the products
+		for (size_t attempt = 0; attempt < 4*negatives 
+								 && sampled[i].size() < negatives; ++attempt)
+		{
+			uint32_t j = products[random() % products.size()];
+			if (!learning_row.contains(j) && !validation_row.contains(j)
+				&& std::find(sampled[i].begin(), sampled[i].end(), j) == sampled[i].end())
+			{
+				sampled[i].push_back(j);
+			}
+		}
+	});
+	std::vector<sparse_ratings_t::entry_t> entries;
+	validation.for_each([&](int i, int j, float rating) {
+		sparse_ratings_t::entry_t entry = { uint32_t(i), uint32_t(j), rating };
+		entries.push_back(entry);
+	});
+	for (size_t i = 0; i < sampled.size(); ++i)
+	{
+		for (size_t n = 0; n < sampled[i].size(); ++n)
+		{
+			sparse_ratings_t::entry_t entry = { uint32_t(i), sampled[i][n], 0.0f };
+			entries.push_back(entry);
+		}
+	}
+	sparse_ratings_t candidates;
+	candidates.assign(validation.rows(), validation.cols(), entries);
+	return candidates;
+}
 
+/// Validate algorithms on the model of the learning set
+/// Evaluation is query driven: the algorithms predict only the candidate 
+/// cells (the pattern of the prediction matrix), the errors are computed 
+/// over the cells of the validation mask. Ranking metrics rank every user's 
+/// candidates (cross_validation_ranking_candidates()) by the predicted 
+/// rating, so an algorithm has to rank the validation products above the 
+/// unrated ones. Undefined (non-finite) predictions are replaced by the
+/// model's baseline estimate and counted.
+/// \param[in] candidates Candidate cells, (at least) the validation ones
+/// \return Error of every algorithm, in the order of algorithms
+template <class F, class D, class M, typename AlgoInputIterator>
+std::vector<prediction_error_t> validate_algorithms(const F &model, 
+						   const D &validation, const M &validation_mask,
+						   const D &candidates, 
+						   AlgoInputIterator algo_begin, AlgoInputIterator algo_end,
+						   size_t verbosity = 0)
+{
 	// Validate algorithms
-	itpp::mat algo_prediction(learning.rows(), learning.cols());
+	// predictions are required for the candidate cells only
+	std::vector<prediction_error_t> algo_error;
+	D algo_prediction(candidates);
 	for (AlgoInputIterator i = algo_begin; i != algo_end; ++i)
 	{
 		algo_prediction.zeros();
@@ -134,112 +519,286 @@ void validate_algorithms(const D &learning, const M &learning_mask,
 		{
 			std::cout << (*i)->name();
 		}
-		(**i)(algo_prediction, learning, learning_mask, 
-			  u_resemblance, avg_users_rating, avg_products_rating);
+		{
+			instrumentation_scope_t stage("prediction " + (*i)->name());
+			(**i)(algo_prediction, model);
+		}
+		// cells the algorithm couldn't predict (e.g. a user without ratings in
+		// the learning set) get the baseline estimate instead of poisoning the metrics
+		size_t fallbacks = model.statistics().fill_undefined(algo_prediction, 
+															 model.ratings_mask());
 		if (verbosity >= 1)
 		{
 			std::cout << "Done." << std::endl;
 		}
 
-		// RMSE
-		float algo_rmse = rmse(validation, algo_prediction);
-		std::cout << (*i)->name() << ": \n" << algo_prediction << std::endl;
-		std::cout << (*i)->name() << " RMSE: \n" << algo_rmse << std::endl;
+		if (verbosity >= 3)
+		{
+			std::cout << (*i)->name() << ": \n" << algo_prediction << std::endl;
+		}
+
+		// RMSE, MAE, precision@k, NDCG@k
+		instrumentation_scope_t stage("error");
+		error_accumulator_t accumulated_error = 
+			prediction_error(validation, validation_mask, algo_prediction, validation_mask);
+		ranking_accumulator_t ranking = 
+			ranking_error(validation, algo_prediction, cross_validation_ranking_k, 
+						  cross_validation_relevant_rating);
+		prediction_error_t error;
+		error.rmse = accumulated_error.rmse();
+		error.mae = accumulated_error.mae();
+		error.precision = ranking.precision();
+		error.ndcg = ranking.ndcg();
+		error.fallbacks = fallbacks;
+		algo_error.push_back(error);
 	}
+	return algo_error;
+}
+
+typedef fold_model_t<sparse_ratings_t, sparse_ratings_mask_t, 
+					 user_resemblance_sparse_t, 
+					 itpp::vec> fold_model_sparse_t;
+typedef collaborative_filtering_algorithm_t<sparse_ratings_t, sparse_ratings_mask_t, 
+											user_resemblance_sparse_t, 
+											itpp::vec> cf_sparse_algo_t;
+typedef grouplens_algo_t<sparse_ratings_t, sparse_ratings_mask_t, 
+						 user_resemblance_sparse_t, 
+						 itpp::vec> grouplens_sparse_algo_t;
+typedef knn_grouplens_algo_t<sparse_ratings_t, sparse_ratings_mask_t, 
+							 user_resemblance_sparse_t, 
+							 itpp::vec> knn_grouplens_sparse_algo_t;
+typedef grouplens_raters_algo_t<sparse_ratings_t, sparse_ratings_mask_t, 
+								user_resemblance_sparse_t, 
+								itpp::vec> grouplens_raters_sparse_algo_t;
+typedef item_based_algo_t<sparse_ratings_t, sparse_ratings_mask_t, 
+						  user_resemblance_sparse_t, 
+						  itpp::vec> item_based_sparse_algo_t;
+typedef baseline_algo_t<sparse_ratings_t, sparse_ratings_mask_t, 
+						user_resemblance_sparse_t, 
+						itpp::vec> baseline_sparse_algo_t;
+typedef matrix_factorization_algo_t<sparse_ratings_t, sparse_ratings_mask_t, 
+									user_resemblance_sparse_t, 
+									itpp::vec> matrix_factorization_sparse_algo_t;
+
+/// Algorithms being cross-validated, new instances for every fold
+/// \param[in] search Neighbour search mode of the k-NN algorithms (the model's one)
+inline std::vector<std::shared_ptr<cf_sparse_algo_t> > cross_validation_algorithms(size_t verbosity, 
+										neighbour_search_t search = NEIGHBOUR_SEARCH_EXACT)
+{
+	std::vector<std::shared_ptr<cf_sparse_algo_t> > algorithms;
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new grouplens_sparse_algo_t(verbosity >= 2)));
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new knn_grouplens_sparse_algo_t(knn_default_neighbours, search)));
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new item_based_sparse_algo_t));
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new matrix_factorization_sparse_algo_t));
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new baseline_sparse_algo_t));
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new grouplens_raters_sparse_algo_t));
+	algorithms.push_back(std::shared_ptr<cf_sparse_algo_t>(new grouplens_raters_sparse_algo_t(knn_default_neighbours, search)));
+	return algorithms;
 }
 
+/// Validate algorithms on one learning/validation pair of triplets
+/// \return Error of every algorithm of cross_validation_algorithms()
 template <class T>
-void cross_validation(const T &triplets, 
-					  const typename T::value_type &max_triplet_values, 
-					  bool prefer_cached_data, size_t verbosity = 0)
+std::vector<prediction_error_t> cross_validation_fold(const T &learning_triplets, 
+										 const T &validation_triplets, 
+										 const typename T::value_type &max_triplet_values, 
+										 const std::string &resemblance_cache_prefix, 
+										 size_t resemblance_cache_capacity = 0, 
+										 size_t resemblance_top_n = 0, 
+										 size_t verbosity = 0)
 {
-	T validation_triplets;
-	T learning_triplets;
+	sparse_ratings_t learning;
+	sparse_ratings_mask_t learning_mask;
 	
+	sparse_ratings_t validation;
+	sparse_ratings_mask_t validation_mask;
+
 	if (verbosity >= 1)
 	{
-		std::cout << "Generating cross-validation data sets...";
+		std::cout << "Converting triplets to matrices...";
+	}
+	{
+		instrumentation_scope_t stage("convert");
+		id_dictionary_t users_converter;
+		id_dictionary_t products_converter;
+		convert_triplets_to_matrix(learning, learning_mask, learning_triplets, 
+								   max_triplet_values, 
+								   users_converter, products_converter);
+		convert_triplets_to_matrix(validation, validation_mask, validation_triplets, 
+								   max_triplet_values, 
+								   users_converter, products_converter);
+		// validation set may introduce new users and products, 
+		// sparse matrices are extended with empty rows/columns at no cost
+		learning.resize(users_converter.used_idxs(), products_converter.used_idxs());
+		validation.resize(users_converter.used_idxs(), products_converter.used_idxs());
 	}
-	cross_validation_get_sets(triplets, validation_triplets, learning_triplets, 0.1);
 	if (verbosity >= 1)
 	{
 		std::cout << "Done." << std::endl;
 	}
 	
-	itpp::mat learning;
-	itpp::bmat learning_mask;
-	learning.zeros();
-	learning_mask.zeros();
+	if (verbosity >= 3)
+	{
+		std::cout << "Learning dataset: \n" << learning << std::endl;
+		std::cout << "Learning dataset mask: \n" << learning_mask << std::endl;
+		std::cout << "Validation dataset: \n" << validation << std::endl;
+		std::cout << "Validation dataset mask: \n" << validation_mask << std::endl;
+	}
+
+	fold_model_sparse_t model(learning, learning_mask, knn_default_neighbours, 
+							  resemblance_cache_prefix, resemblance_cache_capacity, 
+							  resemblance_top_n, verbosity);
+	std::vector<std::shared_ptr<cf_sparse_algo_t> > algorithms = 
+		cross_validation_algorithms(verbosity, model.neighbour_search());
+	sparse_ratings_t candidates = cross_validation_ranking_candidates(learning, validation, 
+										cross_validation_ranking_negatives);
+	return validate_algorithms(model, validation, validation_mask, candidates, 
+							   algorithms.begin(), algorithms.end(),
+							   verbosity);
+}
+
+/// Mean and sample standard deviation of the folds' results
+inline void cross_validation_stats(const std::vector<float> &x, double &mean, double &stddev)
+{
+	double sum = 0;
+	for (size_t f = 0; f < x.size(); ++f)
+	{
+		sum += x[f];
+	}
+	mean = x.empty() ? 0 : sum/x.size();
+	double sq_sum = 0;
+	for (size_t f = 0; f < x.size(); ++f)
+	{
+		sq_sum += (x[f] - mean)*(x[f] - mean);
+	}
+	stddev = x.size() > 1 ? std::sqrt(sq_sum/(x.size() - 1)) : 0;
+}
+
+/// k-fold or leave-p-out cross-validation
+/// Folds are validated concurrently, each with its own matrices, averages, 
+/// resemblance and algorithms; at verbosity 2 and above they are validated 
+/// one by one with the detailed output. Mean and standard deviation of 
+/// every algorithm's RMSE and MAE over the folds are reported.
+/// \param[in] folds Number of folds (k-fold), or of random repetitions (leave-p-out)
+/// \param[in] leave_p_out Ratings of every user left out for validation, 
+///   k-fold cross-validation if 0
+/// \param[in] seed Random generator seed of the folds
+/// \param[in] resemblance_cache_capacity Pairs of the users' resemblance caches 
+///   (fold_model_t) of all the folds together, all the pairs are precomputed
+///   if 0. Every concurrently validated fold gets an equal share, so the 
+///   caches never exceed it together. GroupLens over all the users still
+///   looks up every pair of the predicted users in the cache mode.
+/// \param[in] resemblance_cache_prefix Prefix of the persisted resemblance 
+///   (the dataset filename), fold f uses "<prefix>.fold<f>"; none if empty
+/// \param[in] resemblance_top_n Layout of the persisted resemblance (fold_model_t)
+template <class T>
+void cross_validation(const T &triplets, 
+					  const typename T::value_type &max_triplet_values, 
+					  size_t folds, size_t leave_p_out, uint32_t seed, 
+					  const std::string &resemblance_cache_prefix, 
+					  size_t resemblance_cache_capacity = 0, 
+					  size_t resemblance_top_n = 0, size_t verbosity = 0)
+{
+	folds = std::max<size_t>(folds, leave_p_out > 0 ? 1 : 2);
+	std::vector<size_t> fold;
+	if (leave_p_out == 0)
+	{
+		cross_validation_get_folds(triplets, folds, seed, fold);
+	}
 	
-	itpp::mat validation;
-	itpp::bmat validation_mask;
-	validation.zeros();
-	validation_mask.zeros();
+	// a thread waiting for its fold's loops may start another fold, so any 
+	// number of the folds may be live at once unless they run one by one
+	size_t fold_cache_capacity = resemblance_cache_capacity;
+	if (resemblance_cache_capacity > 0 && verbosity < 2)
+	{
+		fold_cache_capacity = std::max<size_t>(resemblance_cache_capacity/folds, 1);
+	}
 
+	std::vector<std::vector<prediction_error_t> > folds_error(folds);
+	auto validate_fold = [&](size_t f) {
+		T validation_triplets;
+		T learning_triplets;
+		if (leave_p_out > 0)
+		{
+			std::vector<size_t> leave_p_out_fold;
+			cross_validation_leave_p_out(triplets, leave_p_out, seed + f, leave_p_out_fold);
+			cross_validation_get_sets(triplets, leave_p_out_fold, 0, 
+									  validation_triplets, learning_triplets);
+		}
+		else
+		{
+			cross_validation_get_sets(triplets, fold, f, 
+									  validation_triplets, learning_triplets);
+		}
+		std::ostringstream fold_cache_prefix;
+		if (!resemblance_cache_prefix.empty())
+		{
+			fold_cache_prefix << resemblance_cache_prefix << ".fold" << f;
+		}
+		folds_error[f] = cross_validation_fold(learning_triplets, validation_triplets, 
+											  max_triplet_values, fold_cache_prefix.str(), 
+											  fold_cache_capacity, resemblance_top_n, 
+											  verbosity >= 2 ? verbosity : 0);
+	};
 	if (verbosity >= 1)
 	{
-		std::cout << "Converting triplets to matrices...";
+		std::cout << "Validating " << folds << " folds...";
+	}
+	if (verbosity >= 2)
+	{
+		for (size_t f = 0; f < folds; ++f)
+		{
+			validate_fold(f);
+		}
+	}
+	else
+	{
+		parallel_for(0, folds, validate_fold);
 	}
-	id_to_matrix_idx_converter_t users_converter(max_triplet_values.user+1);
-	id_to_matrix_idx_converter_t products_converter(max_triplet_values.product+1);
-	convert_triplets_to_matrix(learning, learning_mask, learning_triplets, 
-							   max_triplet_values, 
-							   users_converter, products_converter);
-	convert_triplets_to_matrix(validation, validation_mask, validation_triplets, 
-							   max_triplet_values, 
-							   users_converter, products_converter);
-	validation.set_size(learning.rows(), learning.cols(), true);
-	//TODO: we should not, actually do this - this will take much time and memory
-	//allocate right amount of memory in the right place!
-	learning.set_size(users_converter.used_idxs(), 
-						 products_converter.used_idxs(), true);
-	learning_mask.set_size(users_converter.used_idxs(), 
-						 products_converter.used_idxs(), true);
-	validation.set_size(users_converter.used_idxs(), 
-						 products_converter.used_idxs(), true);
-	validation_mask.set_size(users_converter.used_idxs(), 
-						 products_converter.used_idxs(), true);
 	if (verbosity >= 1)
 	{
 		std::cout << "Done." << std::endl;
 	}
-	
-	if (verbosity >= 2)
+
+	std::vector<std::shared_ptr<cf_sparse_algo_t> > algorithms = 
+		cross_validation_algorithms(0);
+	for (size_t a = 0; a < algorithms.size(); ++a)
 	{
-		std::cout << "Learning dataset: \n" << learning << std::endl;
-		std::cout << "Learning dataset mask: \n" << learning_mask << std::endl;
-		std::cout << "Validation dataset: \n" << validation << std::endl;
-		std::cout << "Validation dataset mask: \n" << validation_mask << std::endl;
+		std::vector<float> folds_rmse(folds);
+		std::vector<float> folds_mae(folds);
+		std::vector<float> folds_precision(folds);
+		std::vector<float> folds_ndcg(folds);
+		size_t fallbacks = 0;
+		for (size_t f = 0; f < folds; ++f)
+		{
+			if (verbosity >= 1)
+			{
+				std::cout << algorithms[a]->name() << " RMSE (fold " << f << "): " 
+						  << folds_error[f][a].rmse << ", MAE: " 
+						  << folds_error[f][a].mae << std::endl;
+			}
+			folds_rmse[f] = folds_error[f][a].rmse;
+			folds_mae[f] = folds_error[f][a].mae;
+			folds_precision[f] = folds_error[f][a].precision;
+			folds_ndcg[f] = folds_error[f][a].ndcg;
+			fallbacks += folds_error[f][a].fallbacks;
+		}
+		double mean = 0;
+		double stddev = 0;
+		cross_validation_stats(folds_rmse, mean, stddev);
+		std::cout << algorithms[a]->name() << " RMSE: \n" << mean << std::endl;
+		std::cout << algorithms[a]->name() << " RMSE stddev: \n" << stddev << std::endl;
+		cross_validation_stats(folds_mae, mean, stddev);
+		std::cout << algorithms[a]->name() << " MAE: \n" << mean << std::endl;
+		std::cout << algorithms[a]->name() << " MAE stddev: \n" << stddev << std::endl;
+		cross_validation_stats(folds_precision, mean, stddev);
+		std::cout << algorithms[a]->name() << " precision@" << cross_validation_ranking_k 
+				  << ": \n" << mean << std::endl;
+		cross_validation_stats(folds_ndcg, mean, stddev);
+		std::cout << algorithms[a]->name() << " NDCG@" << cross_validation_ranking_k 
+				  << ": \n" << mean << std::endl;
+		std::cout << algorithms[a]->name() << " baseline fallbacks: \n" << fallbacks << std::endl;
 	}
-
-	// Users' resemblance
-	itpp::mat user_resemblance(learning.rows(), learning.rows());
-	itpp::bmat user_resemblance_mask(user_resemblance.rows(), user_resemblance.cols());
-	user_resemblance.zeros();
-	user_resemblance_mask.zeros();
-	
-	// compute users' resemblance on demand
-	user_resemblance_itpp_t u_resemblance(learning, 
-										  user_resemblance, user_resemblance_mask, 
-										  correlation_coeff_resembl_metric_t());
-	
-	typedef collaborative_filtering_algorithm_t<itpp::mat, itpp::bmat, 
-												user_resemblance_itpp_t, 
-												itpp::vec> cf_itpp_algo_t;
-	typedef grouplens_algo_t<itpp::mat, itpp::bmat, 
-							 user_resemblance_itpp_t, 
-							 itpp::vec> grouplens_itpp_algo_t;
-	typedef knn_grouplens_algo_t<itpp::mat, itpp::bmat, 
-								 user_resemblance_itpp_t, 
-								 itpp::vec> knn_grouplens_itpp_algo_t;
-
-	std::vector<std::shared_ptr<cf_itpp_algo_t> > algorithms;
-	algorithms.push_back(std::shared_ptr<cf_itpp_algo_t>(new grouplens_itpp_algo_t));
-	algorithms.push_back(std::shared_ptr<cf_itpp_algo_t>(new knn_grouplens_itpp_algo_t));
-
-	validate_algorithms(learning, learning_mask, validation, validation_mask,
-					 algorithms.begin(), algorithms.end(),
-					 verbosity);
 }
 
 #endif	// SPBAU_RECOMMENDER_CROSS_VALIDATION_HPP_
@@ -0,0 +1,316 @@
+#ifndef SPBAU_RECOMMENDER_DATASET_CACHE_HPP_
+#define SPBAU_RECOMMENDER_DATASET_CACHE_HPP_
+
+/// Binary dataset cache
+/// The file consists of the following sections (native byte order, every
+/// section starts at 8-byte boundary) and is used directly from the memory map:
+///  - dataset_cache_header_t;
+///  - compacted triplets, dataset_cache_triplet_t[triplets];
+///  - user IDs by matrix index, uint64_t[users];
+///  - product IDs by matrix index, uint64_t[products].
+/// The ID tables restore the users' and products' dictionaries, so a cached
+/// dataset goes to the models as the compacted triplets, no ID is hashed.
+/// Averages are not cached: every model (fold) computes them on its own
+/// learning set.
+/// Cache is valid for the source file of the same size and modification
+/// time read with the same skip_lines and input_limit.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dataset_io.hpp"
+#include "id_dictionary.hpp"
+#include "mapped_file.hpp"
+
+const uint64_t dataset_cache_version = 2;
+
+/// Identity of the data the cache was built from
+struct dataset_source_t
+{
+	uint64_t size;	///< Source file size
+	int64_t mtime;	///< Source file modification time
+	uint64_t skip_lines;	///< Lines skipped at the beginning of the file
+	uint64_t input_limit;	///< Input limit (triplets)
+};
+
+struct dataset_cache_header_t
+{
+	char magic[8];	///< "RCMDSET"
+	uint64_t version;	///< dataset_cache_version
+	dataset_source_t source;	///< Source of the cached data
+	uint64_t triplets;	///< Number of triplets
+	uint64_t users;	///< Number of distinct users
+	uint64_t products;	///< Number of distinct products
+};
+
+/// Triplet with compacted (matrix) indexes
+struct dataset_cache_triplet_t
+{
+	uint32_t user;	///< User index
+	uint32_t product;	///< Product index
+	float rating;	///< Product rating
+};
+
+inline size_t dataset_cache_align(size_t offset)
+{
+	return (offset + 7) & ~size_t(7);
+}
+
+/// Identity of the source file
+/// \return false if the file doesn't exist
+inline bool dataset_source(const std::string &filename,
+						   size_t skip_lines, size_t input_limit,
+						   dataset_source_t &source)
+{
+	struct stat file_stat;
+	if (::stat(filename.c_str(), &file_stat) != 0)
+	{
+		return false;
+	}
+	source.size = file_stat.st_size;
+	source.mtime = file_stat.st_mtime;
+	source.skip_lines = skip_lines;
+	source.input_limit = input_limit;
+	return true;
+}
+
+/// Same data is read from the sources
+inline bool same_dataset_source(const dataset_source_t &a, const dataset_source_t &b)
+{
+	return a.size == b.size && a.mtime == b.mtime 
+		&& a.skip_lines == b.skip_lines && a.input_limit == b.input_limit;
+}
+
+/// Open the model persisted next to the dataset cache by write_dataset_model()
+/// \param[out] in Model stream, positioned at the model
+/// \param[in] source Source of the dataset
+/// \return false if there is no model or it was built from another source
+inline bool open_dataset_model(std::ifstream &in, const std::string &filename, 
+							   const dataset_source_t &source)
+{
+	in.open(filename.c_str(), std::ios::in | std::ios::binary);
+	dataset_source_t persisted;
+	in.read(reinterpret_cast<char *>(&persisted), sizeof(persisted));
+	return in.is_open() && !in.fail() && same_dataset_source(persisted, source);
+}
+
+/// Write a model persisted next to the dataset cache: the source of the 
+/// dataset followed by the model's own format ('model.write(out)')
+/// The file is written under a temporary name and renamed when complete.
+/// \return false on I/O error
+template <class M>
+bool write_dataset_model(const std::string &filename, const dataset_source_t &source, 
+						 const M &model)
+{
+	std::string tmp_filename = filename + ".tmp";
+	std::ofstream file(tmp_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	file.write(reinterpret_cast<const char *>(&source), sizeof(source));
+	bool written = model.write(file);
+	file.close();
+	if (!written || file.fail())
+	{
+		std::remove(tmp_filename.c_str());
+		return false;
+	}
+	return std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+/// Read-only memory mapped dataset cache
+class dataset_cache_t
+{
+public:
+	dataset_cache_t()
+		:m_header(0)
+	{}
+
+	/// Map the cache file
+	/// \param[in] filename Cache filename
+	/// \param[in] source Expected source of the cached data
+	/// \return false if there is no cache file or it is not valid for the 'source'
+	bool open(const std::string &filename, const dataset_source_t &source)
+	{
+		m_header = 0;
+		if (!m_file.open(filename) || m_file.size() < sizeof(dataset_cache_header_t))
+		{
+			return false;
+		}
+		const dataset_cache_header_t *header =
+				reinterpret_cast<const dataset_cache_header_t *>(m_file.data());
+		if (std::memcmp(header->magic, "RCMDSET", 8) != 0
+			|| header->version != dataset_cache_version
+			|| !same_dataset_source(header->source, source)
+			|| m_file.size() != file_size(header->triplets, header->users, header->products))
+		{
+			m_file.close();
+			return false;
+		}
+		m_header = header;
+		return true;
+	}
+
+	size_t triplets_count() const
+	{
+		return m_header->triplets;
+	}
+	size_t users() const
+	{
+		return m_header->users;
+	}
+	size_t products() const
+	{
+		return m_header->products;
+	}
+	const dataset_cache_triplet_t *triplets() const
+	{
+		return reinterpret_cast<const dataset_cache_triplet_t *>(
+				m_file.data() + triplets_offset());
+	}
+	/// User IDs by matrix index
+	const uint64_t *user_ids() const
+	{
+		return reinterpret_cast<const uint64_t *>(
+				m_file.data() + user_ids_offset(m_header->triplets));
+	}
+	/// Product IDs by matrix index
+	const uint64_t *product_ids() const
+	{
+		return reinterpret_cast<const uint64_t *>(
+				m_file.data() + product_ids_offset(m_header->triplets, m_header->users));
+	}
+
+	/// Restore the users' and products' dictionaries of the compacted triplets
+	void get_dictionaries(id_dictionary_t &users_converter, 
+						  id_dictionary_t &products_converter) const
+	{
+		users_converter.assign(user_ids(), users());
+		products_converter.assign(product_ids(), products());
+	}
+
+	/// Triplets with the compacted IDs (matrix indexes), in the order of 
+	/// the source file
+	/// \param[out] max_triplet_values Maximal indexes
+	template <class L, class T>
+	void get_compacted_triplets(L &triplet_list, T &max_triplet_values) const
+	{
+		const dataset_cache_triplet_t *cached = triplets();
+		size_t first = triplet_list.size();
+		triplet_list.resize(first + triplets_count());
+		parallel_for(0, triplets_count(), [&](size_t i) {
+			typename L::value_type &triplet = triplet_list[first + i];
+			triplet.user = cached[i].user;
+			triplet.product = cached[i].product;
+			triplet.rating = cached[i].rating;
+		});
+		max_triplet_values.user = users() > 0 ? users() - 1 : 0;
+		max_triplet_values.product = products() > 0 ? products() - 1 : 0;
+	}
+
+	static size_t triplets_offset()
+	{
+		return dataset_cache_align(sizeof(dataset_cache_header_t));
+	}
+	static size_t user_ids_offset(size_t triplets)
+	{
+		return dataset_cache_align(triplets_offset()
+								   + triplets*sizeof(dataset_cache_triplet_t));
+	}
+	static size_t product_ids_offset(size_t triplets, size_t users)
+	{
+		return user_ids_offset(triplets) + users*sizeof(uint64_t);
+	}
+	static size_t file_size(size_t triplets, size_t users, size_t products)
+	{
+		return product_ids_offset(triplets, users) + products*sizeof(uint64_t);
+	}
+
+private:
+	mapped_file_t m_file;	///< Cache file
+	const dataset_cache_header_t *m_header;	///< Header of the valid cache, null otherwise
+};
+
+/// Write dataset cache
+/// IDs are compacted in their ascending order, so the compacted triplets
+/// order users and products as the source IDs do (e.g. cross-validation 
+/// folds don't change).
+/// The file is written under a temporary name and renamed when complete.
+/// \param[in] filename Cache filename
+/// \param[in] source Source of the triplets
+/// \param[in] triplets Dataset triplets
+/// \return false on I/O error
+template <class T>
+bool write_dataset_cache(const std::string &filename, const dataset_source_t &source,
+						 const T &triplets)
+{
+	typedef typename T::value_type triplet_type;
+	id_dictionary_t users_converter;
+	id_dictionary_t products_converter;
+	users_converter.build(triplets, [](const triplet_type &x) { return x.user; });
+	products_converter.build(triplets, [](const triplet_type &x) { return x.product; });
+	users_converter.sort_ids();
+	products_converter.sort_ids();
+
+	dataset_cache_header_t header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "RCMDSET", 8);
+	header.version = dataset_cache_version;
+	header.source = source;
+	header.triplets = triplets.size();
+	header.users = users_converter.used_idxs();
+	header.products = products_converter.used_idxs();
+
+	std::vector<char> buffer(dataset_cache_t::file_size(header.triplets, header.users,
+														header.products), 0);
+	std::memcpy(&buffer[0], &header, sizeof(header));
+	dataset_cache_triplet_t *cached = reinterpret_cast<dataset_cache_triplet_t *>(
+				&buffer[dataset_cache_t::triplets_offset()]);
+	parallel_for(0, triplets.size(), [&](size_t i) {
+		size_t user = 0;
+		size_t product = 0;
+		users_converter.find(triplets[i].user, user);
+		products_converter.find(triplets[i].product, product);
+		cached[i].user = user;
+		cached[i].product = product;
+		cached[i].rating = triplets[i].rating;
+	});
+	uint64_t *users = reinterpret_cast<uint64_t *>(
+				&buffer[dataset_cache_t::user_ids_offset(header.triplets)]);
+	for (size_t i = 0; i < header.users; ++i)
+	{
+		users[i] = users_converter.id(i);
+	}
+	uint64_t *products = reinterpret_cast<uint64_t *>(
+				&buffer[dataset_cache_t::product_ids_offset(header.triplets, header.users)]);
+	for (size_t i = 0; i < header.products; ++i)
+	{
+		products[i] = products_converter.id(i);
+	}
+
+	std::string tmp_filename = filename + ".tmp";
+	std::ofstream file(tmp_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	file.write(&buffer[0], buffer.size());
+	file.close();
+	if (file.fail())
+	{
+		std::remove(tmp_filename.c_str());
+		return false;
+	}
+	return std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+#endif	// SPBAU_RECOMMENDER_DATASET_CACHE_HPP_
@@ -2,13 +2,22 @@
 #ifndef SPBAU_RECOMMENDER_DATASET_IO_HPP_
 #define SPBAU_RECOMMENDER_DATASET_IO_HPP_
 
+#include <cstddef>
+#include <cstring>
+#include <cmath>
 #include <locale>
 #include <vector>
+#include <string>
 #include <algorithm>
 #include <iostream>
 
 #include <itpp/base/vec.h>
 
+#include "sparse_ratings.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "id_dictionary.hpp"
+
 struct csv_locale_facet : std::ctype<char>
 {
 	csv_locale_facet()
@@ -34,73 +43,96 @@ struct dataset_triplet_t
 	float rating;	///< Product rating
 };
 
-class id_to_matrix_idx_converter_t
-{
-public:
-	id_to_matrix_idx_converter_t(size_t table_size)
-		:m_conversion_table(table_size), m_used(0)
-	{
-		for (size_t i = 0; i < table_size; ++i)
-		{
-			m_conversion_table[i] = -1;
-		}
-	}
-	size_t operator()(size_t id)
-	{
-		if (m_conversion_table[id] == -1)
-		{
-			m_conversion_table[id] = m_used++;
-		}
-		return m_conversion_table[id];
-	}
-	size_t used_idxs() const
-	{
-		return m_used;
-	}
-private:
-	itpp::ivec m_conversion_table;
-	size_t m_used;
-};
-
+/// Dense version: ids are compacted first, so the matrix is allocated once 
+/// with the exact size (numbers of used ids); later duplicate ratings win.
 template <class M, class B, class T>
 void convert_triplets_to_matrix(M &matrix, B &matrix_mask, const T &triplets, 
-								const typename T::value_type &max_triplet_values,
-								id_to_matrix_idx_converter_t &users_converter,
-								id_to_matrix_idx_converter_t &products_converter,
+								const typename T::value_type &/*max_triplet_values*/,
+								id_dictionary_t &users_converter,
+								id_dictionary_t &products_converter,
 								size_t verbosity = 0)
 {
-	matrix.set_size(max_triplet_values.user+1, max_triplet_values.product+1);
+	users_converter.build(triplets, [](const typename T::value_type &x) { return x.user; });
+	products_converter.build(triplets, [](const typename T::value_type &x) { return x.product; });
+	matrix.set_size(users_converter.used_idxs(), products_converter.used_idxs());
 	matrix_mask.set_size(matrix.rows(), matrix.cols());
 	matrix.zeros();
 	matrix_mask.zeros();
 
 	std::for_each(triplets.begin(), triplets.end(), 
 		[&](const typename T::value_type &x){
-			size_t user = users_converter(x.user);
-			size_t product = products_converter(x.product);
+			size_t user = 0;
+			size_t product = 0;
+			users_converter.find(x.user, user);
+			products_converter.find(x.product, product);
 			
 			if (verbosity >= 2)
 			{
 				std::cout << "(" << x.user << ", " << x.product << ") -> (" 
 							 << user << ", " << product << ")" << std::endl;
 			}
-			
-			if (user >= static_cast<size_t>(matrix.rows()) 
-				|| product >= static_cast<size_t>(matrix.cols()))
-			{
-				if (verbosity >= 2)
-				{
-					std::cout << "convert_triplets_to_matrix: resizing matrix" 
-							<< std::endl;
-				}
-				matrix.set_size(user+1, product+1, true);
-				matrix_mask.set_size(user+1, product+1, true);
-			}
 			matrix(user, product) = x.rating;
 			matrix_mask(user, product) = true;
 	});
 }
 
+/// Sparse version: matrix is built at once with exact size, ids are 
+/// compacted, so rows() and cols() are the numbers of used ids. 
+/// Dictionaries are extended and the triplets converted in parallel.
+template <class T>
+void convert_triplets_to_matrix(sparse_ratings_t &matrix, 
+								sparse_ratings_mask_t &matrix_mask, 
+								const T &triplets, 
+								const typename T::value_type &/*max_triplet_values*/,
+								id_dictionary_t &users_converter,
+								id_dictionary_t &products_converter,
+								size_t verbosity = 0)
+{
+	users_converter.build(triplets, [](const typename T::value_type &x) { return x.user; });
+	products_converter.build(triplets, [](const typename T::value_type &x) { return x.product; });
+	std::vector<sparse_ratings_t::entry_t> entries(triplets.size());
+	parallel_for(0, triplets.size(), [&](size_t i) {
+		size_t user = 0;
+		size_t product = 0;
+		users_converter.find(triplets[i].user, user);
+		products_converter.find(triplets[i].product, product);
+		entries[i].row = user;
+		entries[i].col = product;
+		entries[i].value = triplets[i].rating;
+	});
+	if (verbosity >= 2)
+	{
+		for (size_t i = 0; i < triplets.size(); ++i)
+		{
+			std::cout << "(" << triplets[i].user << ", " << triplets[i].product << ") -> (" 
+					  << entries[i].row << ", " << entries[i].col << ")" << std::endl;
+		}
+	}
+	matrix.assign(users_converter.used_idxs(), products_converter.used_idxs(), 
+				  entries);
+	matrix_mask = sparse_ratings_mask_t(matrix);
+}
+
+/// Sparse version for the compacted triplets: IDs are already matrix indexes
+/// (e.g. restored from the dataset cache with its dictionaries), nothing is 
+/// looked up.
+/// \param[in] users,products Matrix size, numbers of the used indexes
+template <class T>
+void convert_compacted_triplets_to_matrix(sparse_ratings_t &matrix, 
+										  sparse_ratings_mask_t &matrix_mask, 
+										  const T &triplets, 
+										  size_t users, size_t products)
+{
+	std::vector<sparse_ratings_t::entry_t> entries(triplets.size());
+	parallel_for(0, triplets.size(), [&](size_t i) {
+		entries[i].row = triplets[i].user;
+		entries[i].col = triplets[i].product;
+		entries[i].value = triplets[i].rating;
+	});
+	matrix.assign(users, products, entries);
+	matrix_mask = sparse_ratings_mask_t(matrix);
+}
+
 template <class F, class L, class T>
 void read_dataset(F &file, L &triplet_list, T &max_triplet_values, 
 				  size_t input_limit = 0, size_t skip_lines = 0,
@@ -135,4 +167,243 @@ void read_dataset(F &file, L &triplet_list, T &max_triplet_values,
 	}
 }
 
+/// Parse unsigned decimal integer (locale independent)
+/// \return Pointer past the number or 'first' if there is no number
+inline const char *parse_unsigned(const char *first, const char *last, size_t &value)
+{
+	const char *p = first;
+	size_t result = 0;
+	while (p != last && *p >= '0' && *p <= '9')
+	{
+		result = result*10 + (*p - '0');
+		++p;
+	}
+	if (p != first)
+	{
+		value = result;
+	}
+	return p;
+}
+
+/// Parse decimal floating point number with optional sign, fraction and 
+/// exponent (locale independent)
+/// \return Pointer past the number or 'first' if there is no number
+inline const char *parse_float(const char *first, const char *last, float &value)
+{
+	const char *p = first;
+	bool negative = false;
+	if (p != last && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		++p;
+	}
+	
+	double mantissa = 0;
+	int exponent = 0;
+	bool digits = false;
+	while (p != last && *p >= '0' && *p <= '9')
+	{
+		mantissa = mantissa*10 + (*p - '0');
+		digits = true;
+		++p;
+	}
+	if (p != last && *p == '.')
+	{
+		++p;
+		while (p != last && *p >= '0' && *p <= '9')
+		{
+			mantissa = mantissa*10 + (*p - '0');
+			--exponent;
+			digits = true;
+			++p;
+		}
+	}
+	if (!digits)
+	{
+		return first;
+	}
+	if (p != last && (*p == 'e' || *p == 'E'))
+	{
+		const char *exponent_begin = p + 1;
+		bool exponent_negative = false;
+		if (exponent_begin != last && (*exponent_begin == '-' || *exponent_begin == '+'))
+		{
+			exponent_negative = (*exponent_begin == '-');
+			++exponent_begin;
+		}
+		size_t exponent_value = 0;
+		const char *exponent_end = parse_unsigned(exponent_begin, last, exponent_value);
+		if (exponent_end != exponent_begin)
+		{
+			exponent += exponent_negative ? -static_cast<int>(exponent_value) 
+										  : static_cast<int>(exponent_value);
+			p = exponent_end;
+		}
+	}
+	
+	double result = exponent == 0 ? mantissa 
+				  : exponent > 0 ? mantissa * std::pow(10.0, exponent) 
+				  : mantissa / std::pow(10.0, -exponent);
+	value = static_cast<float>(negative ? -result : result);
+	return p;
+}
+
+/// Characters separating the triplet's fields (as csv_locale_facet)
+inline bool is_triplet_separator(char c)
+{
+	return c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r';
+}
+
+/// Parse triplets, one per line
+/// \param[in] first,last Text to parse
+/// \param[out] triplet_list Parsed triplets are appended to the list
+/// \param[in] input_limit Stop after so many triplets (0 - no limit)
+/// \return false if parsing has stopped at a malformed line
+template <class L>
+bool parse_triplets(const char *first, const char *last, L &triplet_list, 
+					size_t input_limit = 0)
+{
+	typename L::value_type triplet = {0, 0, 0};
+	const char *p = first;
+	while (p != last && (input_limit == 0 || triplet_list.size() < input_limit))
+	{
+		while (p != last && (is_triplet_separator(*p) || *p == '\n'))
+		{
+			++p;
+		}
+		if (p == last)
+		{
+			break;
+		}
+		
+		const char *field_end = parse_unsigned(p, last, triplet.user);
+		if (field_end == p)
+		{
+			return false;
+		}
+		for (p = field_end; p != last && is_triplet_separator(*p); ++p)
+		{}
+		field_end = parse_unsigned(p, last, triplet.product);
+		if (field_end == p)
+		{
+			return false;
+		}
+		for (p = field_end; p != last && is_triplet_separator(*p); ++p)
+		{}
+		field_end = parse_float(p, last, triplet.rating);
+		if (field_end == p)
+		{
+			return false;
+		}
+		for (p = field_end; p != last && is_triplet_separator(*p); ++p)
+		{}
+		if (p != last && *p != '\n')
+		{
+			return false;
+		}
+		triplet_list.push_back(triplet);
+	}
+	return true;
+}
+
+/// Read dataset file
+/// The file is memory mapped and split into newline aligned chunks which 
+/// are parsed concurrently; the result is the same as of read_dataset() 
+/// on the file stream: triplets in file order, reading stops at the first 
+/// malformed line.
+/// \return false if the file can't be opened
+template <class L, class T>
+bool read_dataset_file(const std::string &filename, 
+					   L &triplet_list, T &max_triplet_values, 
+					   size_t input_limit = 0, size_t skip_lines = 0,
+					   size_t verbosity = 0)
+{
+	mapped_file_t file;
+	if (!file.open(filename))
+	{
+		return false;
+	}
+	const char *begin = file.data();
+	const char *end = file.data() + file.size();
+	
+	size_t lines_skipped = 0;
+	while (lines_skipped++ < skip_lines && begin != end)
+	{
+		const char *line_end = static_cast<const char *>(
+								std::memchr(begin, '\n', end - begin));
+		line_end = line_end != 0 ? line_end : end;
+		if (verbosity >= 2)
+		{
+			std::cout << "Skipped line: \"" << std::string(begin, line_end) 
+					  << "\"" << std::endl;
+		}
+		begin = line_end != end ? line_end + 1 : end;
+	}
+	
+	// newline aligned chunks
+	const size_t min_chunk_size = 1 << 20;
+	size_t chunks_count = std::max<size_t>(1, 
+							std::min(parallel_threads(), 
+									 (end - begin)/min_chunk_size));
+	std::vector<const char *> chunk_begin(chunks_count + 1, end);
+	chunk_begin[0] = begin;
+	for (size_t c = 1; c < chunks_count; ++c)
+	{
+		const char *nominal = std::max(chunk_begin[c-1], 
+									   begin + (end - begin)*c/chunks_count);
+		const char *line_end = static_cast<const char *>(
+								std::memchr(nominal, '\n', end - nominal));
+		chunk_begin[c] = line_end != 0 ? line_end + 1 : end;
+	}
+	
+	std::vector<L> chunk_triplets(chunks_count);
+	std::vector<char> chunk_complete(chunks_count, false);
+	parallel_for(0, chunks_count, [&](size_t c) {
+		chunk_triplets[c].reserve((chunk_begin[c+1] - chunk_begin[c])/8);
+		chunk_complete[c] = parse_triplets(chunk_begin[c], chunk_begin[c+1], 
+										   chunk_triplets[c], input_limit);
+	});
+	
+	// merge in file order
+	size_t first_read = triplet_list.size();
+	size_t total = triplet_list.size();
+	for (size_t c = 0; c < chunks_count; ++c)
+	{
+		total += chunk_triplets[c].size();
+	}
+	triplet_list.reserve(input_limit == 0 ? total : std::min(total, input_limit));
+	for (size_t c = 0; c < chunks_count; ++c)
+	{
+		const L &chunk = chunk_triplets[c];
+		typename L::const_iterator chunk_end = chunk.end();
+		if (input_limit != 0 && triplet_list.size() + chunk.size() > input_limit)
+		{
+			chunk_end = chunk.begin() + (input_limit - triplet_list.size());
+		}
+		for (typename L::const_iterator i = chunk.begin(); i != chunk_end; ++i)
+		{
+			max_triplet_values.user = std::max(max_triplet_values.user, i->user);
+			max_triplet_values.product = std::max(max_triplet_values.product, i->product);
+		}
+		triplet_list.insert(triplet_list.end(), chunk.begin(), chunk_end);
+		L().swap(chunk_triplets[c]);
+		
+		if (!chunk_complete[c] 
+			|| (input_limit != 0 && triplet_list.size() >= input_limit))
+		{
+			break;
+		}
+	}
+	
+	if (verbosity >= 3)
+	{
+		std::for_each(triplet_list.begin() + first_read, triplet_list.end(), 
+			[](const typename L::value_type &triplet) {
+				std::cout << "(" << triplet.user << ", " << triplet.product << ") -> " 
+									<< triplet.rating << std::endl;
+		});
+	}
+	return true;
+}
+
 #endif	// SPBAU_RECOMMENDER_DATASET_IO_HPP_
@@ -1,35 +1,215 @@
-
 #ifndef SPBAU_RECOMMENDER_ERROR_HPP_
 #define SPBAU_RECOMMENDER_ERROR_HPP_
 
+/// Error and ranking metrics
+/// Metrics are accumulated from a stream of (actual, predicted) pairs (or 
+/// per-user rankings) with compensated summation; accumulators of parallel 
+/// shards are merged, so no matrix of differences is ever materialized.
+
 #include <cmath>
 #include <cstddef>
 #include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "sparse_ratings.hpp"
+#include "parallel.hpp"
+
+/// Compensated (Kahan-Babuska-Neumaier) sum
+class kahan_sum_t
+{
+public:
+	kahan_sum_t()
+		:m_sum(0), m_compensation(0)
+	{}
+	void add(double x)
+	{
+		double t = m_sum + x;
+		if (std::abs(m_sum) >= std::abs(x))
+		{
+			m_compensation += (m_sum - t) + x;
+		}
+		else
+		{
+			m_compensation += (x - t) + m_sum;
+		}
+		m_sum = t;
+	}
+	void merge(const kahan_sum_t &other)
+	{
+		add(other.m_sum);
+		add(other.m_compensation);
+	}
+	double value() const
+	{
+		return m_sum + m_compensation;
+	}
+private:
+	double m_sum;	///< Running sum
+	double m_compensation;	///< Lost low-order bits
+};
+
+/// Prediction error accumulator (RMSE, MAE)
+/// Non-finite predictions (e.g. 0/0 of a user without resembling users) are
+/// not accumulated, they are counted as undefined instead.
+class error_accumulator_t
+{
+public:
+	error_accumulator_t()
+		:m_count(0), m_undefined(0)
+	{}
+	void add(double actual, double predicted)
+	{
+		if (!std::isfinite(predicted))
+		{
+			++m_undefined;
+			return;
+		}
+		double diff = actual - predicted;
+		m_sqr_sum.add(diff*diff);
+		m_abs_sum.add(std::abs(diff));
+		++m_count;
+	}
+	void merge(const error_accumulator_t &other)
+	{
+		m_sqr_sum.merge(other.m_sqr_sum);
+		m_abs_sum.merge(other.m_abs_sum);
+		m_count += other.m_count;
+		m_undefined += other.m_undefined;
+	}
+	/// Number of the accumulated pairs
+	size_t count() const
+	{
+		return m_count;
+	}
+	/// Number of the skipped pairs with non-finite prediction
+	size_t undefined() const
+	{
+		return m_undefined;
+	}
+	/// Root mean square error, 0 if nothing was accumulated
+	double rmse() const
+	{
+		return m_count > 0 ? std::sqrt(m_sqr_sum.value()/m_count) : 0;
+	}
+	/// Mean absolute error, 0 if nothing was accumulated
+	double mae() const
+	{
+		return m_count > 0 ? m_abs_sum.value()/m_count : 0;
+	}
+private:
+	kahan_sum_t m_sqr_sum;	///< Sum of squared errors
+	kahan_sum_t m_abs_sum;	///< Sum of absolute errors
+	size_t m_count;	///< Number of pairs
+	size_t m_undefined;	///< Number of pairs with non-finite prediction
+};
+
+/// Top-N ranking metrics accumulator (precision@k, NDCG@k)
+/// Metrics are averaged over the users; a product is relevant to the user 
+/// if the actual rating is at least the relevance threshold. NDCG gain of 
+/// the rating 'r' is 2^r - 1.
+class ranking_accumulator_t
+{
+public:
+	/// \param[in] k Cut-off of the ranking
+	/// \param[in] relevance_threshold Minimal relevant rating
+	ranking_accumulator_t(size_t k, float relevance_threshold)
+		:m_k(k), m_relevance_threshold(relevance_threshold), m_users(0)
+	{}
+
+	/// Add the user's ranking
+	/// \param[in] ranking Recommended products, the best first
+	/// \param[in] actual (product, actual rating) pairs of the user, 
+	///   products not listed are irrelevant
+	template <class P>
+	void add(const std::vector<P> &ranking, const std::vector<std::pair<P, float> > &actual)
+	{
+		double hits = 0;
+		double dcg = 0;
+		for (size_t n = 0; n < std::min(m_k, ranking.size()); ++n)
+		{
+			for (size_t a = 0; a < actual.size(); ++a)
+			{
+				if (actual[a].first == ranking[n])
+				{
+					hits += actual[a].second >= m_relevance_threshold ? 1 : 0;
+					dcg += gain(actual[a].second)/std::log2(n + 2.0);
+					break;
+				}
+			}
+		}
+		std::vector<float> ideal(actual.size());
+		for (size_t a = 0; a < actual.size(); ++a)
+		{
+			ideal[a] = actual[a].second;
+		}
+		std::sort(ideal.begin(), ideal.end(), std::greater<float>());
+		double idcg = 0;
+		for (size_t n = 0; n < std::min(m_k, ideal.size()); ++n)
+		{
+			idcg += gain(ideal[n])/std::log2(n + 2.0);
+		}
+
+		m_precision.add(m_k > 0 ? hits/m_k : 0);
+		m_ndcg.add(idcg > 0 ? dcg/idcg : 0);
+		++m_users;
+	}
+	void merge(const ranking_accumulator_t &other)
+	{
+		m_precision.merge(other.m_precision);
+		m_ndcg.merge(other.m_ndcg);
+		m_users += other.m_users;
+	}
+	size_t users() const
+	{
+		return m_users;
+	}
+	size_t k() const
+	{
+		return m_k;
+	}
+	double precision() const
+	{
+		return m_users > 0 ? m_precision.value()/m_users : 0;
+	}
+	double ndcg() const
+	{
+		return m_users > 0 ? m_ndcg.value()/m_users : 0;
+	}
+private:
+	static double gain(float rating)
+	{
+		return std::pow(2.0, rating) - 1;
+	}
+
+	size_t m_k;	///< Cut-off of the ranking
+	float m_relevance_threshold;	///< Minimal relevant rating
+	kahan_sum_t m_precision;	///< Sum of the users' precision@k
+	kahan_sum_t m_ndcg;	///< Sum of the users' NDCG@k
+	size_t m_users;	///< Number of users
+};
 
 /// Matrix RMSE
 /// \tparam R Matrix type
 /// \param[in] real First argument matrix
 /// \param[in] prediction Second argument matrix
-/// \return RMSE of two matrices
+/// \return RMSE of two matrices over all the cells
 template <class R>
 float rmse(const R &real, const R &prediction)
 {
 	assert(real.cols() == prediction.cols() 
 		&& real.rows() == prediction.rows());
 
-	float sum = 0;
-#if defined(ALG_REF_IMPL)
-	for (int i = 0; i < prediction.cols(); ++i)
-	{
-		sum += rmse_v(real.get_col(i), prediction.get_col(i));
-	}
-#else	// ALG_ITPP_IMPL
-	for (int i = 0; i < prediction.cols(); ++i)
+	error_accumulator_t error;
+	for (int i = 0; i < prediction.rows(); ++i)
 	{
-		sum += sum_sqr(real.get_col(i) - prediction.get_col(i));
+		for (int j = 0; j < prediction.cols(); ++j)
+		{
+			error.add(real(i, j), prediction(i, j));
+		}
 	}
-#endif
-	return std::sqrt((1.0/prediction.cols()) * sum);
+	return error.rmse();
 }
 
 /// Vector RMSE
@@ -42,16 +222,12 @@ float rmse_v(const V &x1, const V &x2)
 {
 	assert(x1.size() == x2.size());
 
-	float sum = 0;
-#if defined(ALG_REF_IMPL)
-	for (int i = 0; i < x1.size(); ++i)
+	error_accumulator_t error;
+	for (int i = 0; i < int(x1.size()); ++i)
 	{
-		sum += (x1(i) - x2(i))*(x1(i) - x2(i));
+		error.add(x1[i], x2[i]);
 	}
-#else	// ALG_ITPP_IMPL
-	sum = sum_sqr(x1 - x2);
-#endif
-	return std::sqrt((1.0/x1.size()) * sum);
+	return error.rmse();
 }
 
 /// Matrix RMSE
@@ -61,7 +237,7 @@ float rmse_v(const V &x1, const V &x2)
 /// \param[in] real_mask First argument vector mask
 /// \param[in] prediction Second argument matrix
 /// \param[in] prediction_mask Second argument vector mask
-/// \return RMSE of two matrices
+/// \return RMSE of two matrices over the cells valid in both masks
 template <class R, class M>
 float rmse(const R &real, const M &real_mask, 
 		   const R &prediction, const M &prediction_mask)
@@ -73,22 +249,18 @@ float rmse(const R &real, const M &real_mask,
 	assert(real.cols() == real_mask.cols()
 		   && real.rows() == real_mask.rows());
 
-	float sum = 0;
-	size_t valid_cols = 0;
-	for (int i = 0; i < prediction.cols(); ++i)
+	error_accumulator_t error;
+	for (int i = 0; i < prediction.rows(); ++i)
 	{
-		float valid_elems = 0;
-		float rmse_result = rmse_v(real.get_col(i), real_mask.get_col(i), 
-					  prediction.get_col(i), prediction_mask.get_col(i), 
-					  valid_elems);
-		if (valid_elems > 0)
+		for (int j = 0; j < prediction.cols(); ++j)
 		{
-			sum += rmse_result;
-			++valid_cols;
+			if (bool(real_mask(i, j)) && bool(prediction_mask(i, j)))
+			{
+				error.add(real(i, j), prediction(i, j));
+			}
 		}
 	}
-	
-	return std::sqrt((1.0/valid_cols) * sum);
+	return error.rmse();
 }
 
 /// Vector RMSE
@@ -109,17 +281,194 @@ float rmse_v(const V &x1, const M &x1_mask,
 	assert(x1_mask.size() == x2_mask.size());
 	assert(x1_mask.size() == x1.size());
 
-	float sum = 0;
-	/*size_t*/ valid_elems = 0;
-	for (int i = 0; i < x1.size(); ++i)
+	error_accumulator_t error;
+	for (int i = 0; i < int(x1.size()); ++i)
 	{
 		if (x1_mask[i] && x2_mask[i])
 		{
-			sum += (x1[i] - x2[i])*(x1[i] - x2[i]);
-			++valid_elems;
+			error.add(x1[i], x2[i]);
+		}
+	}
+	valid_elems = error.count();
+	return error.rmse();
+}
+
+/// Apply 'f(i, j, rating, predicted)' to every rating stored in the rows 
+/// [row_begin, row_end) of 'real'
+/// Rows are merged in order, so no cell is looked up; the cells not stored 
+/// in 'prediction' are predicted as 0.
+template <class F>
+void for_each_prediction(const sparse_ratings_t &real, const sparse_ratings_t &prediction, 
+						 size_t row_begin, size_t row_end, F f)
+{
+	for (size_t i = row_begin; i < row_end; ++i)
+	{
+		sparse_vector_view_t real_row = real.get_row(i);
+		sparse_vector_view_t predicted_row = prediction.get_row(i);
+		size_t p = 0;
+		for (size_t r = 0; r < real_row.nonzeros(); ++r)
+		{
+			while (p < predicted_row.nonzeros() && predicted_row.index(p) < real_row.index(r))
+			{
+				++p;
+			}
+			bool predicted = p < predicted_row.nonzeros() 
+								&& predicted_row.index(p) == real_row.index(r);
+			f(i, real_row.index(r), real_row.value(r), 
+			  predicted ? predicted_row.value(p) : 0.0f);
+		}
+	}
+}
+
+/// Prediction error of the sparse ratings over the ratings stored in 'real' 
+/// for which 'valid(i, j)' holds
+/// Rows are split into shards accumulated concurrently and merged in order 
+/// (the result doesn't depend on the number of threads).
+template <class V>
+error_accumulator_t prediction_error(const sparse_ratings_t &real, 
+									 const sparse_ratings_t &prediction, V valid)
+{
+	assert(real.cols() == prediction.cols() 
+		   && real.rows() == prediction.rows());
+
+	const size_t shard_rows = 1024;
+	size_t shards = (real.rows() + shard_rows - 1)/shard_rows;
+	std::vector<error_accumulator_t> shard_error(shards);
+	parallel_for(0, shards, [&](size_t s) {
+		size_t row_end = std::min<size_t>((s + 1)*shard_rows, real.rows());
+		for_each_prediction(real, prediction, s*shard_rows, row_end, 
+							[&](int i, int j, float rating, float predicted) {
+			if (valid(i, j))
+			{
+				shard_error[s].add(rating, predicted);
+			}
+		});
+	});
+	error_accumulator_t error;
+	for (size_t s = 0; s < shards; ++s)
+	{
+		error.merge(shard_error[s]);
+	}
+	return error;
+}
+
+/// Prediction error of the sparse ratings over the cells valid in both masks
+inline error_accumulator_t prediction_error(const sparse_ratings_t &real, 
+											const sparse_ratings_mask_t &real_mask, 
+											const sparse_ratings_t &prediction, 
+											const sparse_ratings_mask_t &prediction_mask)
+{
+	return prediction_error(real, prediction, [&](int i, int j) {
+		return bool(real_mask(i, j)) && bool(prediction_mask(i, j));
+	});
+}
+
+/// Prediction error of the sparse ratings over the ratings stored in 'real'
+inline error_accumulator_t prediction_error(const sparse_ratings_t &real, 
+											const sparse_ratings_t &prediction)
+{
+	return prediction_error(real, prediction, [](int, int) {
+		return true;
+	});
+}
+
+/// Sparse matrix RMSE
+/// Computed over the ratings stored in 'real' (the unset cells are not 
+/// compared), every rating has the same weight.
+/// \param[in] real Real ratings
+/// \param[in] prediction Predicted ratings
+/// \return RMSE of two matrices
+inline float rmse(const sparse_ratings_t &real, const sparse_ratings_t &prediction)
+{
+	return prediction_error(real, prediction).rmse();
+}
+
+/// Sparse matrix RMSE over the cells valid in both masks
+inline float rmse(const sparse_ratings_t &real, const sparse_ratings_mask_t &real_mask, 
+				  const sparse_ratings_t &prediction, 
+				  const sparse_ratings_mask_t &prediction_mask)
+{
+	return prediction_error(real, real_mask, prediction, prediction_mask).rmse();
+}
+
+/// Sparse matrix MAE
+/// Computed over the ratings stored in 'real', as rmse().
+/// \param[in] real Real ratings
+/// \param[in] prediction Predicted ratings
+/// \return Mean absolute error of two matrices
+inline float mae(const sparse_ratings_t &real, const sparse_ratings_t &prediction)
+{
+	return prediction_error(real, prediction).mae();
+}
+
+/// Sparse matrix MAE over the cells valid in both masks
+inline float mae(const sparse_ratings_t &real, const sparse_ratings_mask_t &real_mask, 
+				 const sparse_ratings_t &prediction, 
+				 const sparse_ratings_mask_t &prediction_mask)
+{
+	return prediction_error(real, real_mask, prediction, prediction_mask).mae();
+}
+
+/// Ranking metrics of the predicted ratings
+/// Every user's candidates (the cells stored in 'prediction') are ranked by 
+/// the predicted rating, the candidates not stored in 'real' are irrelevant; 
+/// users without ratings in 'real' are skipped. Users are split into shards 
+/// as in prediction_error().
+/// \param[in] real Real ratings
+/// \param[in] prediction Predicted ratings of the candidates, of (at least) 
+///   the cells of 'real'
+inline ranking_accumulator_t ranking_error(const sparse_ratings_t &real, 
+										   const sparse_ratings_t &prediction, 
+										   size_t k, float relevance_threshold)
+{
+	const size_t shard_rows = 1024;
+	size_t shards = (real.rows() + shard_rows - 1)/shard_rows;
+	std::vector<ranking_accumulator_t> shard_ranking(shards, 
+			ranking_accumulator_t(k, relevance_threshold));
+	parallel_for(0, shards, [&](size_t s) {
+		std::vector<std::pair<float, uint32_t> > predicted;
+		std::vector<uint32_t> ranking;
+		std::vector<std::pair<uint32_t, float> > actual;
+		size_t row_end = std::min<size_t>((s + 1)*shard_rows, real.rows());
+		for (size_t i = s*shard_rows; i < row_end; ++i)
+		{
+			sparse_vector_view_t real_row = real.get_row(i);
+			if (real_row.nonzeros() == 0)
+			{
+				continue;
+			}
+			sparse_vector_view_t predicted_row = prediction.get_row(i);
+			predicted.clear();
+			actual.clear();
+			for (size_t p = 0; p < predicted_row.nonzeros(); ++p)
+			{
+				predicted.push_back(std::make_pair(predicted_row.value(p), 
+												   uint32_t(predicted_row.index(p))));
+			}
+			for (size_t r = 0; r < real_row.nonzeros(); ++r)
+			{
+				actual.push_back(std::make_pair(uint32_t(real_row.index(r)), 
+												real_row.value(r)));
+			}
+			std::stable_sort(predicted.begin(), predicted.end(), 
+							 [](const std::pair<float, uint32_t> &a, 
+								const std::pair<float, uint32_t> &b) {
+								return a.first > b.first;
+							 });
+			ranking.resize(predicted.size());
+			for (size_t n = 0; n < predicted.size(); ++n)
+			{
+				ranking[n] = predicted[n].second;
+			}
+			shard_ranking[s].add(ranking, actual);
 		}
+	});
+	ranking_accumulator_t ranking(k, relevance_threshold);
+	for (size_t s = 0; s < shards; ++s)
+	{
+		ranking.merge(shard_ranking[s]);
 	}
-	return valid_elems > 0 ? std::sqrt((1.0/valid_elems) * sum) : 0;
+	return ranking;
 }
 
 #endif	// SPBAU_RECOMMENDER_ERROR_HPP_
@@ -4,8 +4,15 @@
 
 #include <cstddef>
 #include <cmath>
+#include <vector>
+#include <limits>
+
+#include "sparse_ratings.hpp"
+#include "parallel.hpp"
 
 /// GroupLens
+/// Users with undefined (NaN) resemblance to the 'user' are not weighted;
+/// the prediction is undefined if no user's resemblance is.
 /// \param[in] avg_product_rating Average rating of the product (user's rating of a product)
 /// \param[in] users_rating User-Product rating matrix
 /// \param[in] avg_users_rating Average rating of the user (rating of the user)
@@ -24,20 +31,79 @@ float grouplens(const V &avg_product_rating, const M &users_rating,
 	for (int i=0; i<users_rating.rows(); ++i)
 	{
 		float user_resemblance = resemblance(user,i);
+		if (std::isnan(user_resemblance))
+		{
+			continue;
+		}
+		
+		numer += (users_rating(i, product) - avg_users_rating[i])*user_resemblance;
+		denom += std::abs(user_resemblance);
+	}
+	
+	return avg_users_rating[user] + avg_product_rating[product] + (numer/denom);
+}
+
+/// GroupLens over a subset of users (neighbours of the 'user')
+/// \param[in] neighbours_begin,neighbours_end Range of the neighbours' indexes in the rating matrix
+/// \return Predicted 'product' rating by the 'user'
+template <class V, class M, class R, class InputIterator>
+float grouplens(const V &avg_product_rating, const M &users_rating,
+				const V &avg_users_rating, 
+				size_t user, size_t product, R &resemblance,
+				InputIterator neighbours_begin, InputIterator neighbours_end)
+{
+	float numer = 0;
+	float denom = 0;
+	
+	for (InputIterator i = neighbours_begin; i != neighbours_end; ++i)
+	{
+		float user_resemblance = resemblance(user, *i);
+		if (std::isnan(user_resemblance))
+		{
+			continue;
+		}
 		
-		numer += (users_rating.get_row(i)[product] - avg_users_rating[i])*user_resemblance;
+		numer += (users_rating(*i, product) - avg_users_rating[*i])*user_resemblance;
 		denom += std::abs(user_resemblance);
 	}
 	
 	return avg_users_rating[user] + avg_product_rating[product] + (numer/denom);
 }
 
+/// GroupLens over the neighbours with known resemblance (neighbour_index_t lists)
+/// \param[in] neighbours_begin,neighbours_end Range of the neighbours' indexes in the rating matrix
+/// \param[in] resemblance Resemblance of the 'user' to the neighbours, in the order of neighbours
+/// \return Predicted 'product' rating by the 'user'
+template <class V, class M, class InputIterator>
+float grouplens(const V &avg_product_rating, const M &users_rating,
+				const V &avg_users_rating, 
+				size_t user, size_t product, 
+				InputIterator neighbours_begin, InputIterator neighbours_end, 
+				const float *resemblance)
+{
+	float numer = 0;
+	float denom = 0;
+	
+	for (InputIterator i = neighbours_begin; i != neighbours_end; ++i, ++resemblance)
+	{
+		numer += (users_rating(*i, product) - avg_users_rating[*i])*(*resemblance);
+		denom += std::abs(*resemblance);
+	}
+	
+	return avg_users_rating[user] + avg_product_rating[product] + (numer/denom);
+}
+
+/// GroupLens predictions of every unrated cell
+/// \param[in] user_resemblance Users' resemblance store (user_resemblance_t)
 template <class M, class V, class R, class B>
 void grouplens(M &grouplens_predict, 
 			   const M &users_ratings, const B &users_ratings_mask,
-			   R &user_resemblance, 
+			   const R &user_resemblance, 
 			   const V &avg_users_rating, const V &avg_product_ratings)
 {
+	auto resemblance = [&user_resemblance](size_t user1, size_t user2) {
+		return user_resemblance.resemblance(user1, user2);
+	};
 	for (int i=0; i<users_ratings.rows(); ++i)	// users
 	{
 		for (int j=0; j<users_ratings.cols(); ++j)	// products
@@ -47,10 +113,179 @@ void grouplens(M &grouplens_predict,
 				grouplens_predict(i,j) = grouplens(avg_product_ratings, 
 												   users_ratings, 
 												   avg_users_rating, i, j, 
-												   user_resemblance);
+												   resemblance);
+			}
+		}
+	}
+}
+
+/// GroupLens predictions, serial reference implementation
+template <class M, class V, class R, class B>
+void grouplens_reference(M &grouplens_predict, 
+						 const M &users_ratings, const B &users_ratings_mask,
+						 const R &user_resemblance, 
+						 const V &avg_users_rating, const V &avg_product_ratings)
+{
+	grouplens(grouplens_predict, users_ratings, users_ratings_mask, 
+			  user_resemblance, avg_users_rating, avg_product_ratings);
+}
+
+/// GroupLens predictions for the sparse ratings, serial reference implementation
+/// Every prediction loops over all users; used to measure the parallel 
+/// engine's speed-up.
+/// \param[in] user_resemblance Users' resemblance store (user_resemblance_t)
+template <class V, class R>
+void grouplens_reference(sparse_ratings_t &grouplens_predict, 
+						 const sparse_ratings_t &users_ratings, 
+						 const sparse_ratings_mask_t &users_ratings_mask,
+						 const R &user_resemblance, 
+						 const V &avg_users_rating, const V &avg_product_ratings)
+{
+	auto resemblance = [&user_resemblance](size_t user1, size_t user2) {
+		return user_resemblance.resemblance(user1, user2);
+	};
+	grouplens_predict.for_each([&](int i, int j, float) {
+		if (users_ratings_mask(i,j) == false)
+		{
+			grouplens_predict.set(i, j, grouplens(avg_product_ratings, 
+												  users_ratings, 
+												  avg_users_rating, i, j, 
+												  resemblance));
+		}
+	});
+}
+
+/// GroupLens predictions for the sparse ratings
+/// Only the cells stored in 'grouplens_predict' (its pattern is the set of 
+/// requested predictions) are computed, rated cells are left untouched.
+/// Users are predicted in parallel; a thread loads the user's resemblance 
+/// row into its contiguous buffer once, the terms of the users that haven't
+/// rated the product don't depend on the product and are summed once per 
+/// user as well, so a prediction visits only the product's raters (column 
+/// view).
+/// \param[in] user_resemblance Users' resemblance store (user_resemblance_t), 
+///   read concurrently
+template <class V, class R>
+void grouplens(sparse_ratings_t &grouplens_predict, 
+			   const sparse_ratings_t &users_ratings, 
+			   const sparse_ratings_mask_t &users_ratings_mask,
+			   const R &user_resemblance, 
+			   const V &avg_users_rating, const V &avg_product_ratings)
+{
+	size_t users = users_ratings.rows();
+	parallel_scratch_t<std::vector<float> > resemblance_rows((std::vector<float>(users)));
+	parallel_for(0, grouplens_predict.rows(), [&](size_t i) {
+		sparse_vector_view_t predicted = grouplens_predict.get_row(i);
+		if (predicted.nonzeros() == 0)
+		{
+			return;
+		}
+		std::vector<float> &resemblance = resemblance_rows.local();
+		// (0 - avg_users_rating[u])*resemblance of every user
+		double unrated_numer = 0;
+		double denom = 0;
+		for (size_t u = 0; u < users; ++u)
+		{
+			resemblance[u] = user_resemblance.resemblance(i, u);
+			if (std::isnan(resemblance[u]))
+			{
+				resemblance[u] = 0;
+			}
+			unrated_numer -= avg_users_rating[u]*resemblance[u];
+			denom += std::abs(resemblance[u]);
+		}
+		for (size_t k = 0; k < predicted.nonzeros(); ++k)
+		{
+			size_t j = predicted.index(k);
+			if (users_ratings_mask(i,j) == true)
+			{
+				continue;
+			}
+			sparse_vector_view_t raters = users_ratings.get_col(j);
+			double numer = unrated_numer;
+			for (size_t r = 0; r < raters.nonzeros(); ++r)
+			{
+				numer += raters.value(r)*resemblance[raters.index(r)];
 			}
+			grouplens_predict.set(i, j, avg_users_rating[i] + avg_product_ratings[j] 
+										+ numer/denom);
 		}
+	});
+}
+
+/// GroupLens over the raters of the product (Resnick's estimator)
+/// Only the users who rated the product are visited, through the product's
+/// posting list of (user, rating) pairs (column view of the ratings), so a
+/// prediction costs O(raters of the product) and the resemblance is needed
+/// for the co-raters only. User's average is predicted if no rater resembles
+/// the user: avg_u + sum(s(u,v)*(r_vj - avg_v))/sum(|s(u,v)|) over the raters.
+/// \param[in,out] resemblance Resemblance functor 'float(size_t user1, size_t user2)'
+/// \return Predicted 'product' rating by the 'user'
+template <class V, class R>
+float grouplens_raters(const sparse_ratings_t &users_rating, const V &avg_users_rating, 
+					   size_t user, size_t product, R &resemblance)
+{
+	sparse_vector_view_t raters = users_rating.get_col(product);
+	double numer = 0;
+	double denom = 0;
+	for (size_t r = 0; r < raters.nonzeros(); ++r)
+	{
+		size_t rater = raters.index(r);
+		float user_resemblance = resemblance(user, rater);
+		if (rater == user || std::isnan(user_resemblance))
+		{
+			continue;
+		}
+		numer += (raters.value(r) - avg_users_rating[rater])*user_resemblance;
+		denom += std::abs(user_resemblance);
 	}
+	return avg_users_rating[user] + (denom > 0 ? numer/denom : 0);
+}
+
+/// GroupLens over the raters of the products for the sparse ratings
+/// Only the cells stored in 'grouplens_predict' are computed, rated cells are
+/// left untouched. Users are predicted in parallel; a thread keeps the 
+/// user's resemblance to the raters met so far in its buffer, so a pair's 
+/// resemblance is looked up once per user and only for co-raters.
+/// \param[in] user_resemblance Users' resemblance store (user_resemblance_t), 
+///   read concurrently
+template <class V, class R>
+void grouplens_raters(sparse_ratings_t &grouplens_predict, 
+					  const sparse_ratings_t &users_ratings, 
+					  const sparse_ratings_mask_t &users_ratings_mask,
+					  const R &user_resemblance, const V &avg_users_rating)
+{
+	const float unknown = std::numeric_limits<float>::infinity();
+	parallel_scratch_t<std::vector<float> > resemblance_rows(
+		std::vector<float>(users_ratings.rows(), unknown));
+	parallel_scratch_t<std::vector<size_t> > known_raters((std::vector<size_t>()));
+	parallel_for(0, grouplens_predict.rows(), [&](size_t i) {
+		sparse_vector_view_t predicted = grouplens_predict.get_row(i);
+		std::vector<float> &resemblance_row = resemblance_rows.local();
+		std::vector<size_t> &known = known_raters.local();
+		auto resemblance = [&](size_t user, size_t rater) {
+			if (resemblance_row[rater] == unknown)
+			{
+				resemblance_row[rater] = user_resemblance.resemblance(user, rater);
+				known.push_back(rater);
+			}
+			return resemblance_row[rater];
+		};
+		for (size_t k = 0; k < predicted.nonzeros(); ++k)
+		{
+			size_t j = predicted.index(k);
+			if (users_ratings_mask(i,j) == false)
+			{
+				grouplens_predict.set(i, j, grouplens_raters(users_ratings, avg_users_rating, 
+															 i, j, resemblance));
+			}
+		}
+		for (size_t u = 0; u < known.size(); ++u)
+		{
+			resemblance_row[known[u]] = unknown;
+		}
+		known.clear();
+	});
 }
 
 #endif	// SPBAU_RECOMMENDER_GROUPLENS_HPP_
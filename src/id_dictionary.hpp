@@ -0,0 +1,232 @@
+#ifndef SPBAU_RECOMMENDER_ID_DICTIONARY_HPP_
+#define SPBAU_RECOMMENDER_ID_DICTIONARY_HPP_
+
+/// Dictionary of the external (user or product) IDs
+/// IDs are arbitrary 64-bit values; they are assigned dense matrix indexes
+/// in the order of their first appearance. The dictionary is a linear-probing
+/// hash table of (ID, index) pairs, kept at most half full, plus the index to
+/// ID table for the reverse lookup, so memory is proportional to the number
+/// of distinct IDs, not to the largest ID.
+/// Serialised format (native byte order), written after or before a model:
+/// id_dictionary_header_t, uint64_t[ids] IDs by index.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <algorithm>
+
+#include "parallel.hpp"
+
+const uint64_t id_dictionary_version = 1;
+
+struct id_dictionary_header_t
+{
+	char magic[8];	///< "RCMIDS"
+	uint64_t version;	///< id_dictionary_version
+	uint64_t ids;	///< Number of IDs
+};
+
+class id_dictionary_t
+{
+public:
+	/// \param[in] expected_ids Number of the distinct IDs expected (table is reserved)
+	explicit id_dictionary_t(size_t expected_ids = 0)
+	{
+		rehash(table_size(expected_ids));
+	}
+
+	/// Matrix index of the ID, the next free index is assigned to a new ID
+	size_t operator()(uint64_t id)
+	{
+		size_t slot = find_slot(id);
+		if (m_slots[slot].index == empty_index)
+		{
+			if (2*(m_ids.size() + 1) > m_slots.size())
+			{
+				rehash(2*m_slots.size());
+				slot = find_slot(id);
+			}
+			m_slots[slot].id = id;
+			m_slots[slot].index = m_ids.size();
+			m_ids.push_back(id);
+		}
+		return m_slots[slot].index;
+	}
+
+	/// Assign indexes to the IDs of the triplets (in parallel)
+	/// IDs get the same indexes as if operator() were called for every triplet
+	/// in order: blocks of the triplets collect their distinct IDs in the order
+	/// of the first appearance concurrently, then they are added block by block.
+	/// \param[in] key Functor 'uint64_t(const triplet &)', ID of the triplet
+	template <class T, class K>
+	void build(const T &triplets, K key)
+	{
+		size_t count = triplets.size();
+		size_t blocks = std::min(std::max<size_t>(count/4096, 1), 8*parallel_threads());
+		std::vector<std::vector<uint64_t> > block_ids(blocks);
+		parallel_for(0, blocks, [&](size_t b) {
+			id_dictionary_t distinct;
+			for (size_t i = count*b/blocks; i < count*(b+1)/blocks; ++i)
+			{
+				distinct(key(triplets[i]));
+			}
+			block_ids[b].swap(distinct.m_ids);
+		});
+		for (size_t b = 0; b < blocks; ++b)
+		{
+			for (size_t k = 0; k < block_ids[b].size(); ++k)
+			{
+				(*this)(block_ids[b][k]);
+			}
+		}
+	}
+
+	/// Replace the dictionary by the IDs of the indexes 0, 1, ... (e.g. a
+	/// persisted index to ID table)
+	/// \param[in] ids IDs by index, distinct
+	/// \param[in] count Number of IDs
+	void assign(const uint64_t *ids, size_t count)
+	{
+		m_ids.clear();
+		rehash(table_size(count));
+		for (size_t k = 0; k < count; ++k)
+		{
+			(*this)(ids[k]);
+		}
+	}
+
+	/// Reassign the indexes in the ascending order of IDs
+	void sort_ids()
+	{
+		std::vector<uint64_t> ids(m_ids);
+		std::sort(ids.begin(), ids.end());
+		assign(ids.data(), ids.size());
+	}
+
+	/// Number of the assigned indexes (distinct IDs)
+	size_t used_idxs() const
+	{
+		return m_ids.size();
+	}
+	/// Conversion of the already known ID, no index is assigned
+	/// Can be called concurrently (with no concurrent assignment).
+	/// \param[in] id ID
+	/// \param[out] idx Matrix index
+	/// \return false if the ID is not known
+	bool find(uint64_t id, size_t &idx) const
+	{
+		const slot_t &slot = m_slots[find_slot(id)];
+		if (slot.index == empty_index)
+		{
+			return false;
+		}
+		idx = slot.index;
+		return true;
+	}
+	/// Reverse conversion
+	/// \param[in] idx Matrix index
+	/// \return ID converted to 'idx'
+	uint64_t id(size_t idx) const
+	{
+		return m_ids[idx];
+	}
+
+	/// Serialise the dictionary
+	/// \return false on I/O error
+	bool write(std::ostream &out) const
+	{
+		id_dictionary_header_t header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "RCMIDS", 6);
+		header.version = id_dictionary_version;
+		header.ids = m_ids.size();
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(m_ids.data()), m_ids.size()*sizeof(uint64_t));
+		return !out.fail();
+	}
+
+	/// Load the dictionary serialised by write()
+	/// \return false if the stream isn't a dictionary of this version
+	bool read(std::istream &in)
+	{
+		id_dictionary_header_t header;
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+		if (in.fail() || std::memcmp(header.magic, "RCMIDS", 6) != 0
+			|| header.version != id_dictionary_version)
+		{
+			return false;
+		}
+		std::vector<uint64_t> ids(header.ids);
+		in.read(reinterpret_cast<char *>(ids.data()), ids.size()*sizeof(uint64_t));
+		if (in.fail())
+		{
+			return false;
+		}
+		assign(ids.data(), ids.size());
+		return true;
+	}
+
+private:
+	static const size_t empty_index = ~size_t(0);
+
+	struct slot_t
+	{
+		uint64_t id;	///< ID
+		size_t index;	///< Matrix index, empty_index if the slot is free
+	};
+
+	/// Power of 2 table size keeping 'ids' at most half of it
+	static size_t table_size(size_t ids)
+	{
+		size_t size = 16;
+		while (size < 2*ids)
+		{
+			size *= 2;
+		}
+		return size;
+	}
+
+	/// 64-bit finalizer of MurmurHash3
+	static uint64_t mix(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	/// Slot of the ID or the free slot where it belongs
+	size_t find_slot(uint64_t id) const
+	{
+		size_t mask = m_slots.size() - 1;
+		size_t slot = mix(id) & mask;
+		while (m_slots[slot].index != empty_index && m_slots[slot].id != id)
+		{
+			slot = (slot + 1) & mask;
+		}
+		return slot;
+	}
+
+	/// Rebuild the table with 'size' slots
+	void rehash(size_t size)
+	{
+		slot_t free_slot = {0, empty_index};
+		m_slots.assign(size, free_slot);
+		for (size_t k = 0; k < m_ids.size(); ++k)
+		{
+			size_t slot = find_slot(m_ids[k]);
+			m_slots[slot].id = m_ids[k];
+			m_slots[slot].index = k;
+		}
+	}
+
+	std::vector<slot_t> m_slots;	///< Linear-probing table, power of 2 size
+	std::vector<uint64_t> m_ids;	///< Matrix index to ID table
+};
+
+#endif	// SPBAU_RECOMMENDER_ID_DICTIONARY_HPP_
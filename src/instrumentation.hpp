@@ -0,0 +1,275 @@
+#ifndef SPBAU_RECOMMENDER_INSTRUMENTATION_HPP_
+#define SPBAU_RECOMMENDER_INSTRUMENTATION_HPP_
+
+/// Stage timers and event counters
+/// Instrumentation is disabled by default: a scoped stage timer then costs
+/// one flag test, a counter increment one flag test as well. When enabled,
+/// every stage's calls, total time and the peak resident set size at its end
+/// are recorded; counters are sharded across cache lines so concurrent hot
+/// paths don't contend. The summary is written as JSON or CSV.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <ostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+/// Peak resident set size of the process (KiB), 0 if unknown
+inline uint64_t peak_rss_kib()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+#if defined(__APPLE__)
+	return usage.ru_maxrss/1024;	// bytes
+#else
+	return usage.ru_maxrss;	// KiB
+#endif
+#else
+	return 0;
+#endif
+}
+
+/// Event counter, safe to increment concurrently
+class instrumentation_counter_t
+{
+public:
+	explicit instrumentation_counter_t(const std::string &name)
+		:m_name(name)
+	{
+		for (size_t s = 0; s < shards; ++s)
+		{
+			m_shards[s].value = 0;
+		}
+	}
+
+	void add(uint64_t n)
+	{
+		m_shards[shard()].value.fetch_add(n, std::memory_order_relaxed);
+	}
+	uint64_t value() const
+	{
+		uint64_t sum = 0;
+		for (size_t s = 0; s < shards; ++s)
+		{
+			sum += m_shards[s].value.load(std::memory_order_relaxed);
+		}
+		return sum;
+	}
+	const std::string &name() const
+	{
+		return m_name;
+	}
+
+private:
+	static const size_t shards = 16;
+
+	/// Shard of the calling thread, threads are assigned round-robin
+	static size_t shard()
+	{
+		static std::atomic<size_t> next_shard(0);
+		static thread_local size_t thread_shard = next_shard++ % shards;
+		return thread_shard;
+	}
+
+	/// Shards are a cache line apart
+	struct shard_t
+	{
+		std::atomic<uint64_t> value;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	std::string m_name;	///< Counter name
+	shard_t m_shards[shards];	///< Per-thread-group partial counts
+};
+
+/// Recorded stage
+struct instrumentation_stage_t
+{
+	std::string name;	///< Stage name
+	size_t calls;	///< Number of the stage's runs
+	double seconds;	///< Total time of the runs (concurrent runs are summed)
+	uint64_t peak_rss_kib;	///< Peak RSS at the end of the last run
+};
+
+/// Registry of the stages and counters
+class instrumentation_t
+{
+public:
+	static instrumentation_t &instance()
+	{
+		static instrumentation_t registry;
+		return registry;
+	}
+
+	void enable(bool enabled = true)
+	{
+		m_enabled.store(enabled, std::memory_order_relaxed);
+	}
+	bool enabled() const
+	{
+		return m_enabled.load(std::memory_order_relaxed);
+	}
+
+	/// Counter of the name, created on the first call
+	/// Hot paths should keep the reference (e.g. in a function-local static).
+	instrumentation_counter_t &counter(const std::string &name)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t c = 0; c < m_counters.size(); ++c)
+		{
+			if (m_counters[c]->name() == name)
+			{
+				return *m_counters[c];
+			}
+		}
+		m_counters.push_back(std::unique_ptr<instrumentation_counter_t>(
+								new instrumentation_counter_t(name)));
+		return *m_counters.back();
+	}
+
+	/// Record a run of the stage
+	void record(const std::string &name, double seconds)
+	{
+		uint64_t rss = peak_rss_kib();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t s = 0; s < m_stages.size(); ++s)
+		{
+			if (m_stages[s].name == name)
+			{
+				++m_stages[s].calls;
+				m_stages[s].seconds += seconds;
+				m_stages[s].peak_rss_kib = rss;
+				return;
+			}
+		}
+		instrumentation_stage_t stage = {name, 1, seconds, rss};
+		m_stages.push_back(stage);
+	}
+
+	/// Stages in the order of their first runs
+	std::vector<instrumentation_stage_t> stages() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_stages;
+	}
+
+	void write_json(std::ostream &out) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		out << "{\n\t\"peak_rss_kib\": " << peak_rss_kib() << ",\n\t\"stages\": [";
+		for (size_t s = 0; s < m_stages.size(); ++s)
+		{
+			out << (s > 0 ? ",\n\t\t{" : "\n\t\t{")
+				<< "\"name\": \"" << m_stages[s].name << "\""
+				<< ", \"calls\": " << m_stages[s].calls
+				<< ", \"seconds\": " << m_stages[s].seconds
+				<< ", \"peak_rss_kib\": " << m_stages[s].peak_rss_kib << "}";
+		}
+		out << "\n\t],\n\t\"counters\": {";
+		for (size_t c = 0; c < m_counters.size(); ++c)
+		{
+			out << (c > 0 ? ",\n\t\t\"" : "\n\t\t\"")
+				<< m_counters[c]->name() << "\": " << m_counters[c]->value();
+		}
+		out << "\n\t}\n}" << std::endl;
+	}
+
+	/// "kind;name;calls;seconds;peak_rss_kib" lines, counters' value is in 'calls'
+	void write_csv(std::ostream &out) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		out << "kind;name;calls;seconds;peak_rss_kib\n";
+		for (size_t s = 0; s < m_stages.size(); ++s)
+		{
+			out << "stage;" << m_stages[s].name << ";" << m_stages[s].calls << ";"
+				<< m_stages[s].seconds << ";" << m_stages[s].peak_rss_kib << "\n";
+		}
+		for (size_t c = 0; c < m_counters.size(); ++c)
+		{
+			out << "counter;" << m_counters[c]->name() << ";"
+				<< m_counters[c]->value() << ";;\n";
+		}
+	}
+
+private:
+	instrumentation_t()
+		:m_enabled(false)
+	{}
+	instrumentation_t(const instrumentation_t &);
+	instrumentation_t &operator=(const instrumentation_t &);
+
+	std::atomic<bool> m_enabled;	///< Stages and counters are recorded
+	mutable std::mutex m_mutex;	///< Guards the stages and the counters' list
+	std::vector<instrumentation_stage_t> m_stages;	///< Recorded stages
+	std::vector<std::unique_ptr<instrumentation_counter_t> > m_counters;	///< Counters
+};
+
+inline bool instrumentation_enabled()
+{
+	return instrumentation_t::instance().enabled();
+}
+
+/// Count 'n' events if the instrumentation is enabled
+inline void instrumentation_count(instrumentation_counter_t &counter, uint64_t n = 1)
+{
+	if (instrumentation_enabled())
+	{
+		counter.add(n);
+	}
+}
+
+/// Times the scope as a run of the stage
+class instrumentation_scope_t
+{
+public:
+	explicit instrumentation_scope_t(const char *name)
+		:m_name(name), m_enabled(instrumentation_enabled())
+	{
+		if (m_enabled)
+		{
+			m_start = std::chrono::steady_clock::now();
+		}
+	}
+	explicit instrumentation_scope_t(const std::string &name)
+		:m_name(0), m_dynamic_name(name), m_enabled(instrumentation_enabled())
+	{
+		if (m_enabled)
+		{
+			m_start = std::chrono::steady_clock::now();
+		}
+	}
+	~instrumentation_scope_t()
+	{
+		if (m_enabled)
+		{
+			double seconds = std::chrono::duration<double>(
+								std::chrono::steady_clock::now() - m_start).count();
+			instrumentation_t::instance().record(m_name != 0 ? std::string(m_name)
+															 : m_dynamic_name, seconds);
+		}
+	}
+
+private:
+	instrumentation_scope_t(const instrumentation_scope_t &);
+	instrumentation_scope_t &operator=(const instrumentation_scope_t &);
+
+	const char *m_name;	///< Stage name (literal)
+	std::string m_dynamic_name;	///< Stage name if not a literal
+	bool m_enabled;	///< Instrumentation was enabled at the start
+	std::chrono::steady_clock::time_point m_start;	///< Start of the run
+};
+
+#endif	// SPBAU_RECOMMENDER_INSTRUMENTATION_HPP_
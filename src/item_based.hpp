@@ -0,0 +1,134 @@
+#ifndef SPBAU_RECOMMENDER_ITEM_BASED_HPP_
+#define SPBAU_RECOMMENDER_ITEM_BASED_HPP_
+
+/// 4.2.2 Item-based Recommendation
+/// Recommender Systems Handbook By Francesco Ricci, Lior Rokach, Paul B. Kantor, p.117
+
+#include <cstddef>
+#include <cmath>
+#include <vector>
+#include <limits>
+
+#include "sparse_ratings.hpp"
+#include "neighbour_index.hpp"
+#include "parallel.hpp"
+
+/// Adjusted Cosine (AC) of two products over the users who rated both (p.125)
+/// Ratings are centred by the users' averages, so the users' rating scales
+/// don't bias the resemblance of products (one merge pass).
+/// \param[in] product1,product2 Products' ratings (columns of the ratings matrix)
+/// \param[in] avg_users_rating Average rating of the user
+template <class V>
+float adjusted_cosine_corated(const sparse_vector_view_t &product1,
+							  const sparse_vector_view_t &product2,
+							  const V &avg_users_rating)
+{
+	double numer = 0;
+	double product1r_sq_sum = 0;
+	double product2r_sq_sum = 0;
+	size_t k1 = 0;
+	size_t k2 = 0;
+	while (k1 < product1.nonzeros() && k2 < product2.nonzeros())
+	{
+		if (product1.index(k1) < product2.index(k2))
+		{
+			++k1;
+		}
+		else if (product2.index(k2) < product1.index(k1))
+		{
+			++k2;
+		}
+		else
+		{
+			double avg = avg_users_rating[product1.index(k1)];
+			double product1r = product1.value(k1) - avg;
+			double product2r = product2.value(k2) - avg;
+			numer += product1r * product2r;
+			product1r_sq_sum += product1r * product1r;
+			product2r_sq_sum += product2r * product2r;
+			++k1;
+			++k2;
+		}
+	}
+	double denom = std::sqrt(product1r_sq_sum) * std::sqrt(product2r_sq_sum);
+
+	return numer/denom;
+}
+
+/// Build the index of the 'k' most resembling products of every product
+/// Products are the rows of the index; products without co-raters (or with
+/// zero centred ratings) have undefined resemblance and aren't neighbours.
+/// Adjusted cosine is symmetric, so every pair of products is computed once.
+/// \param[in] avg_users_rating Average rating of the user
+template <class V>
+void item_neighbours(neighbour_index_t &neighbours, size_t k,
+					 const sparse_ratings_t &users_ratings, const V &avg_users_rating)
+{
+	neighbours.build_symmetric(users_ratings.cols(), k,
+					 [&](size_t product1, size_t product2) {
+						return adjusted_cosine_corated(users_ratings.get_col(product1),
+													   users_ratings.get_col(product2),
+													   avg_users_rating);
+					 });
+}
+
+/// Item-based predictions for the sparse ratings
+/// Only the cells stored in 'item_predict' are computed, rated cells are left
+/// untouched. The prediction is the product's average corrected by the
+/// user's centred ratings of the product's neighbours:
+/// avg_j + sum(s(j,n)*(r_un - avg_n))/sum(|s(j,n)|) over the rated neighbours.
+/// A thread scatters the user's ratings into its dense buffer once per user,
+/// so a prediction costs O(k). Product's average is predicted if the user
+/// rated none of its neighbours.
+/// \param[in] neighbours Products' neighbour index (item_neighbours())
+template <class V>
+void item_based(sparse_ratings_t &item_predict, const neighbour_index_t &neighbours,
+				const sparse_ratings_t &users_ratings,
+				const sparse_ratings_mask_t &users_ratings_mask,
+				const V &avg_product_ratings)
+{
+	size_t products = users_ratings.cols();
+	parallel_scratch_t<std::vector<float> > ratings_rows(
+		std::vector<float>(products, std::numeric_limits<float>::quiet_NaN()));
+	parallel_for(0, item_predict.rows(), [&](size_t i) {
+		sparse_vector_view_t predicted = item_predict.get_row(i);
+		if (predicted.nonzeros() == 0)
+		{
+			return;
+		}
+		std::vector<float> &user_ratings = ratings_rows.local();
+		sparse_vector_view_t rated = users_ratings.get_row(i);
+		for (size_t r = 0; r < rated.nonzeros(); ++r)
+		{
+			user_ratings[rated.index(r)] = rated.value(r);
+		}
+		for (size_t k = 0; k < predicted.nonzeros(); ++k)
+		{
+			size_t j = predicted.index(k);
+			if (users_ratings_mask(i,j) == true)
+			{
+				continue;
+			}
+			const float *resemblance = neighbours.resemblance(j);
+			double numer = 0;
+			double denom = 0;
+			for (neighbour_index_t::const_iterator n = neighbours.begin(j);
+				 n != neighbours.end(j); ++n, ++resemblance)
+			{
+				if (!std::isnan(user_ratings[*n]))
+				{
+					numer += (user_ratings[*n] - avg_product_ratings[*n])*(*resemblance);
+					denom += std::abs(*resemblance);
+				}
+			}
+			item_predict.set(i, j, avg_product_ratings[j]
+								   + (denom > 0 ? numer/denom : 0));
+		}
+		for (size_t r = 0; r < rated.nonzeros(); ++r)
+		{
+			user_ratings[rated.index(r)] = std::numeric_limits<float>::quiet_NaN();
+		}
+	});
+}
+
+#endif	// SPBAU_RECOMMENDER_ITEM_BASED_HPP_
@@ -5,139 +5,213 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
-#include <utility>
+#include <limits>
 
 #include <itpp/base/mat.h>
-#include <kdtree++/kdtree.hpp>
 
 #include "user_resemblance.hpp"
+#include "sparse_ratings.hpp"
+#include "grouplens.hpp"
+#include "neighbour_index.hpp"
+#include "parallel.hpp"
 
-class kdtree_distance_cosine_angle_t
+/// Number of neighbours of k-NN by default
+const size_t knn_default_neighbours = 30;
+
+/// Number of candidates per user considered by the approximate neighbour search
+inline size_t knn_approximate_candidates(size_t k)
 {
-public:
-	kdtree_distance_cosine_angle_t()
-	{}
-	template <class U>
-	float operator()(const U &user1, const U &user2) const
-	{
-		float c = 0;
-		c = cosine_angle(user1, user2);
-		return c*c;
-	}
-	typedef float distance_type;
-};
+	return 4*k;
+}
+
+/// Build the index of the 'k' most resembling users
+/// \param[in] users_ratings Ratings matrix
+/// \param[in] user_resemblance Users' resemblance store (user_resemblance_t)
+/// \param[in] search Approximate search is supported for the sparse ratings only
+template <class M, class R>
+void knn_neighbours(neighbour_index_t &neighbours, size_t k, 
+					const M &users_ratings, const R &user_resemblance, 
+					neighbour_search_t /*search*/)
+{
+	neighbours.build(users_ratings.rows(), k, 
+					 [&user_resemblance](size_t user1, size_t user2) {
+						return user_resemblance.resemblance(user1, user2);
+					 });
+}
 
-class kdtree_distance_correlation_coeff_t
+template <class R>
+void knn_neighbours(neighbour_index_t &neighbours, size_t k, 
+					const sparse_ratings_t &users_ratings, const R &user_resemblance, 
+					neighbour_search_t search)
 {
-public:
-	kdtree_distance_correlation_coeff_t()
-	{}
-	template <class U>
-	float operator()(const U &user1, const U &user2) const
+	if (search == NEIGHBOUR_SEARCH_APPROXIMATE)
 	{
-		float c = 0;
-		c = correlation_coeff(user1, user2);
-		return c*c;
+		neighbours.build(users_ratings, k, knn_approximate_candidates(k), 
+						 [&user_resemblance](size_t user1, size_t user2) {
+							return user_resemblance.resemblance(user1, user2);
+						 });
 	}
-	typedef float distance_type;
-};
+	else
+	{
+		neighbours.build(users_ratings.rows(), k, 
+						 [&user_resemblance](size_t user1, size_t user2) {
+							return user_resemblance.resemblance(user1, user2);
+						 });
+	}
+}
 
-template <class T, class V, class OutputIterator>
-void k_nearest(T &tree, const V &value, size_t k, OutputIterator out)
+inline void knn_print_neighbours(const neighbour_index_t &neighbours, size_t user)
 {
-	size_t found = 0;
-	std::vector<V> neighbours;
-	neighbours.reserve(k+1);
-	while (found < k)
+	std::cout << "\nNeighbours of " << user << ": " << std::endl;
+	const float *resemblance = neighbours.resemblance(user);
+	for (neighbour_index_t::const_iterator n = neighbours.begin(user); 
+		 n != neighbours.end(user); ++n)
 	{
-		std::pair<typename T::const_iterator, typename T::distance_type> nearest = tree.find_nearest(value);
- 		if (nearest.first == tree.end())
- 			return;
-		neighbours.push_back(*(nearest.first));
-		++out = nearest.first;
-		++found;
-		tree.erase_exact(nearest.first);
+		std::cout << "\t" << *n << " with resemblance " 
+				  << resemblance[n - neighbours.begin(user)] << std::endl;
 	}
-	std::for_each(neighbours.begin(), neighbours.end(), 
-				  [&tree](const V &x) {
-					tree.insert(x);
-				  });
-	tree.optimise();
 }
 
+/// k-NN by the neighbour index
+/// Every unrated cell is estimated by GroupLens over the user's neighbours.
 template <class M, class V, class R, class B>
-void knn(M &knn_predict, double k, 
+void knn(M &knn_predict, const neighbour_index_t &neighbours, 
 		 const M &users_ratings, const B &users_ratings_mask, 
-		 R &user_resemblance, 
+		 const R &user_resemblance, 
 		 const V &avg_users_rating, const V &avg_product_ratings,
 		 size_t verbosity = 0)
 {
-	typedef itpp::vec kdtree_value_type;
-	//access i-th element of the vector (using operator[]) (result_type operator()(_Val const& V, size_t const N) const)
-	typedef KDTree::_Bracket_accessor<itpp::vec> kdtree_bracket_accessor_type;
-	//squared distance between vectors (distance_type operator() (const _Tp& __a, const _Tp& __b) const)
-	typedef kdtree_distance_correlation_coeff_t kdtree_distance_type;
-	typedef KDTree::KDTree<kdtree_value_type, 
-						   kdtree_bracket_accessor_type, 
-						   kdtree_distance_type> kdtree_type;
-	
-	kdtree_bracket_accessor_type kdtree_bracket_accessor;
-	kdtree_distance_type kdtree_distance;
-	
-	kdtree_type tree(users_ratings.cols(), kdtree_bracket_accessor, kdtree_distance);
-	for (int i=0; i<users_ratings.rows(); ++i)	//users
-	{
-		tree.insert(users_ratings.get_row(i));
-	}
-	
+	auto resemblance = [&user_resemblance](size_t user1, size_t user2) {
+		return user_resemblance.resemblance(user1, user2);
+	};
 	for (int i=0; i<users_ratings.rows(); ++i)	//users
 	{
-		itpp::mat nearest_neighbours;
-		std::vector<kdtree_value_type> neighbours;
-		
-		// Nearest neighbours of the i-th user
-#define KNN_WITHIN_RANGE
-#if defined(KNN_WITHIN_RANGE)
 		if (verbosity >= 2)
 		{
-			std::cout << "\nNeighbours of " << i 
-						<< " (" << users_ratings.get_row(i) 
-						<< ") within " << k << ": " << std::endl;
+			knn_print_neighbours(neighbours, i);
 		}
-		tree.find_within_range(users_ratings.get_row(i), k, 
-				std::back_insert_iterator<std::vector<kdtree_value_type>>(neighbours));
-#else
-		if (verbosity >= 2)
-		{
-			std::cout << "\n" << k << " nearest neighbours of " << i 
-					<< " (" << users_ratings.get_row(i) << "): " << std::endl;
-		}
-		k_nearest(tree, users_ratings.get_row(i), k, 
-				  std::back_insert_iterator<std::vector<kdtree_value_type>>(neighbours));
-#endif	
-		std::for_each(neighbours.begin(), neighbours.end(), 
-					  [&](const kdtree_value_type &v){
-						if (verbosity >= 2)
-						{
-							std::cout << "\t" << v << " at distance " 
-									<< kdtree_distance(users_ratings.get_row(i), v) << std::endl;
-						}
-						nearest_neighbours.append_row(v);
-					});
-		
-		//assert(users_ratings.cols() == nearest_neighbours.cols());
 		// Estimate i-th user by its nearest neighbours using GroupLens
 		for (int j = 0; j < users_ratings.cols(); ++j)	//products
 		{
 			if (bool(users_ratings_mask(i,j)) == false)
 			{
 				knn_predict(i,j) = grouplens(avg_product_ratings, 
-											nearest_neighbours, 
+											users_ratings, 
 											avg_users_rating, i, j, 
-											user_resemblance);
+											resemblance, 
+											neighbours.begin(i), neighbours.end(i));
 			}
 		}
 	}
 }
 
+/// k-NN by the neighbour index for the sparse ratings
+/// Only the cells stored in 'knn_predict' are predicted, users in parallel.
+template <class V, class R>
+void knn(sparse_ratings_t &knn_predict, const neighbour_index_t &neighbours, 
+		 const sparse_ratings_t &users_ratings, 
+		 const sparse_ratings_mask_t &users_ratings_mask, 
+		 const R &user_resemblance, 
+		 const V &avg_users_rating, const V &avg_product_ratings,
+		 size_t verbosity = 0)
+{
+	auto resemblance = [&user_resemblance](size_t user1, size_t user2) {
+		return user_resemblance.resemblance(user1, user2);
+	};
+	if (verbosity >= 2)
+	{
+		for (int i = 0; i < knn_predict.rows(); ++i)
+		{
+			if (knn_predict.get_row(i).nonzeros() > 0)
+			{
+				knn_print_neighbours(neighbours, i);
+			}
+		}
+	}
+	parallel_for(0, knn_predict.rows(), [&](size_t i) {
+		sparse_vector_view_t predicted = knn_predict.get_row(i);
+		for (size_t k = 0; k < predicted.nonzeros(); ++k)
+		{
+			size_t j = predicted.index(k);
+			if (users_ratings_mask(i,j) == true)
+			{
+				continue;
+			}
+			// Estimate i-th user by its nearest neighbours using GroupLens
+			knn_predict.set(i, j, grouplens(avg_product_ratings, users_ratings, 
+											avg_users_rating, i, j, 
+											resemblance, 
+											neighbours.begin(i), neighbours.end(i)));
+		}
+	});
+}
+
+/// k-NN over the raters of the products for the sparse ratings
+/// GroupLens over the raters (grouplens_raters()) restricted to the user's
+/// neighbours: a thread scatters the neighbours' resemblance into its buffer
+/// indexed by user, then a prediction visits the product's raters (column 
+/// view) and weights the ones which are neighbours. No resemblance is looked
+/// up, a prediction costs O(raters of the product).
+template <class V>
+void knn_raters(sparse_ratings_t &knn_predict, const neighbour_index_t &neighbours, 
+				const sparse_ratings_t &users_ratings, 
+				const sparse_ratings_mask_t &users_ratings_mask, 
+				const V &avg_users_rating)
+{
+	const float not_neighbour = std::numeric_limits<float>::quiet_NaN();
+	parallel_scratch_t<std::vector<float> > resemblance_rows(
+		std::vector<float>(users_ratings.rows(), not_neighbour));
+	parallel_for(0, knn_predict.rows(), [&](size_t i) {
+		sparse_vector_view_t predicted = knn_predict.get_row(i);
+		if (predicted.nonzeros() == 0)
+		{
+			return;
+		}
+		std::vector<float> &resemblance_row = resemblance_rows.local();
+		const float *resemblance = neighbours.resemblance(i);
+		for (neighbour_index_t::const_iterator n = neighbours.begin(i); 
+			 n != neighbours.end(i); ++n)
+		{
+			resemblance_row[*n] = resemblance[n - neighbours.begin(i)];
+		}
+		auto neighbour_resemblance = [&resemblance_row](size_t, size_t rater) {
+			return resemblance_row[rater];
+		};
+		for (size_t k = 0; k < predicted.nonzeros(); ++k)
+		{
+			size_t j = predicted.index(k);
+			if (users_ratings_mask(i,j) == false)
+			{
+				knn_predict.set(i, j, grouplens_raters(users_ratings, avg_users_rating, 
+													   i, j, neighbour_resemblance));
+			}
+		}
+		for (neighbour_index_t::const_iterator n = neighbours.begin(i); 
+			 n != neighbours.end(i); ++n)
+		{
+			resemblance_row[*n] = not_neighbour;
+		}
+	});
+}
+
+/// k-NN: GroupLens by the 'k' most resembling users
+/// \param[in] k Number of neighbours
+/// \param[in] search Neighbour search mode (exact or approximate)
+template <class M, class V, class R, class B>
+void knn(M &knn_predict, size_t k, 
+		 const M &users_ratings, const B &users_ratings_mask, 
+		 const R &user_resemblance, 
+		 const V &avg_users_rating, const V &avg_product_ratings,
+		 size_t verbosity = 0, 
+		 neighbour_search_t search = NEIGHBOUR_SEARCH_EXACT)
+{
+	neighbour_index_t neighbours;
+	knn_neighbours(neighbours, k, users_ratings, user_resemblance, search);
+	knn(knn_predict, neighbours, 
+		users_ratings, users_ratings_mask, 
+		user_resemblance, 
+		avg_users_rating, avg_product_ratings, 
+		verbosity);
+}
+
 #endif	// SPBAU_RECOMMENDER_KNN_HPP_
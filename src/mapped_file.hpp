@@ -0,0 +1,119 @@
+#ifndef SPBAU_RECOMMENDER_MAPPED_FILE_HPP_
+#define SPBAU_RECOMMENDER_MAPPED_FILE_HPP_
+
+#include <cstddef>
+#include <string>
+
+#if defined(_WIN32)
+#include <vector>
+#include <fstream>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/// Read-only memory mapped file
+/// On the platforms without mmap the file is read into memory.
+class mapped_file_t
+{
+public:
+	mapped_file_t()
+		:m_data(0), m_size(0)
+	{}
+	explicit mapped_file_t(const std::string &filename)
+		:m_data(0), m_size(0)
+	{
+		open(filename);
+	}
+	~mapped_file_t()
+	{
+		close();
+	}
+
+	/// Map the file
+	/// \return true if the file is mapped
+	bool open(const std::string &filename)
+	{
+		close();
+#if defined(_WIN32)
+		std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+		if (!file.is_open())
+		{
+			return false;
+		}
+		file.seekg(0, std::ios::end);
+		m_buffer.resize(static_cast<size_t>(file.tellg()));
+		file.seekg(0, std::ios::beg);
+		file.read(m_buffer.data(), m_buffer.size());
+		m_data = m_buffer.data();
+		m_size = m_buffer.size();
+		return !file.fail();
+#else
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd == -1)
+		{
+			return false;
+		}
+		struct stat file_stat;
+		if (::fstat(fd, &file_stat) == -1)
+		{
+			::close(fd);
+			return false;
+		}
+		m_size = file_stat.st_size;
+		if (m_size > 0)
+		{
+			void *data = ::mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED)
+			{
+				::close(fd);
+				m_size = 0;
+				return false;
+			}
+			::madvise(data, m_size, MADV_SEQUENTIAL);
+			m_data = static_cast<const char *>(data);
+		}
+		::close(fd);
+		return true;
+#endif
+	}
+
+	void close()
+	{
+#if defined(_WIN32)
+		std::vector<char>().swap(m_buffer);
+#else
+		if (m_data != 0)
+		{
+			::munmap(const_cast<char *>(m_data), m_size);
+		}
+#endif
+		m_data = 0;
+		m_size = 0;
+	}
+
+	/// File contents, null for an empty file
+	const char *data() const
+	{
+		return m_data;
+	}
+	size_t size() const
+	{
+		return m_size;
+	}
+
+private:
+	mapped_file_t(const mapped_file_t &);
+	mapped_file_t &operator=(const mapped_file_t &);
+
+	const char *m_data;	///< Mapped contents
+	size_t m_size;	///< Mapped contents size
+#if defined(_WIN32)
+	std::vector<char> m_buffer;	///< File contents
+#endif
+};
+
+#endif	// SPBAU_RECOMMENDER_MAPPED_FILE_HPP_
@@ -0,0 +1,399 @@
+#ifndef SPBAU_RECOMMENDER_MATRIX_FACTORIZATION_HPP_
+#define SPBAU_RECOMMENDER_MATRIX_FACTORIZATION_HPP_
+
+/// 5.3 Matrix Factorization Models
+/// Recommender Systems Handbook By Francesco Ricci, Lior Rokach, Paul B. Kantor, p.151
+/// Rating is the sum of the average rating, the user's and the product's
+/// biases and the dot product of the user's and the product's latent factors.
+/// Factors are learned by Alternating Least Squares (ALS): every user's
+/// factors are a ridge regression on the fixed products' factors and vice
+/// versa, the solves are independent and spread across threads (no locks,
+/// the result doesn't depend on the number of threads).
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <istream>
+#include <ostream>
+#include <iostream>
+
+#include "sparse_ratings.hpp"
+#include "parallel.hpp"
+#include "simd_kernels.hpp"
+#include "baseline.hpp"
+#include "id_dictionary.hpp"
+
+const uint64_t matrix_factorization_version = 2;
+
+/// Serialised model header, followed by (native byte order):
+/// float[users] users' biases, float[products] products' biases,
+/// float[users*factors] users' factors, float[products*factors] products' factors,
+/// users' and products' dictionaries (id_dictionary_t::write())
+struct matrix_factorization_header_t
+{
+	char magic[8];	///< "RCMMF"
+	uint64_t version;	///< matrix_factorization_version
+	uint64_t users;	///< Number of users
+	uint64_t products;	///< Number of products
+	uint64_t factors;	///< Number of latent factors
+	float avg_rating;	///< Average rating
+	float reserved;	///< Zero
+};
+
+/// Row-major float matrix with cache line aligned rows
+/// Rows are padded with zeros to a multiple of 16 floats, so a SIMD kernel
+/// reads whole aligned vectors and the padding doesn't change dot products.
+class factor_matrix_t
+{
+public:
+	factor_matrix_t()
+		:m_rows(0), m_cols(0), m_stride(0), m_data(0)
+	{}
+
+	void resize(size_t rows, size_t cols)
+	{
+		const size_t alignment = 64/sizeof(float);
+		m_rows = rows;
+		m_cols = cols;
+		m_stride = (cols + alignment - 1)/alignment*alignment;
+		m_storage.assign(rows*m_stride + alignment, 0);
+		m_data = m_storage.data();
+		while (reinterpret_cast<uintptr_t>(m_data) % 64 != 0)
+		{
+			++m_data;
+		}
+	}
+
+	float *row(size_t i)
+	{
+		return m_data + i*m_stride;
+	}
+	const float *row(size_t i) const
+	{
+		return m_data + i*m_stride;
+	}
+	size_t rows() const
+	{
+		return m_rows;
+	}
+	size_t cols() const
+	{
+		return m_cols;
+	}
+	/// Floats per row including the padding
+	size_t stride() const
+	{
+		return m_stride;
+	}
+
+private:
+	factor_matrix_t(const factor_matrix_t &);
+	factor_matrix_t &operator=(const factor_matrix_t &);
+
+	size_t m_rows;	///< Number of rows
+	size_t m_cols;	///< Number of columns
+	size_t m_stride;	///< Floats per row
+	std::vector<float> m_storage;	///< Rows with the alignment slack
+	float *m_data;	///< First aligned row in 'm_storage'
+};
+
+/// Solve 'a x = b' for the symmetric positive definite 'a' (Cholesky decomposition)
+/// \param[in,out] a Row-major n x n matrix, overwritten by the decomposition
+/// \param[in,out] b Right-hand side, overwritten by the solution
+/// \return false if 'a' is not positive definite
+inline bool cholesky_solve(std::vector<double> &a, std::vector<double> &b, size_t n)
+{
+	for (size_t j = 0; j < n; ++j)
+	{
+		double d = a[j*n + j];
+		for (size_t k = 0; k < j; ++k)
+		{
+			d -= a[j*n + k]*a[j*n + k];
+		}
+		if (d <= 0)
+		{
+			return false;
+		}
+		a[j*n + j] = std::sqrt(d);
+		for (size_t i = j + 1; i < n; ++i)
+		{
+			double s = a[i*n + j];
+			for (size_t k = 0; k < j; ++k)
+			{
+				s -= a[i*n + k]*a[j*n + k];
+			}
+			a[i*n + j] = s/a[j*n + j];
+		}
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		for (size_t k = 0; k < i; ++k)
+		{
+			b[i] -= a[i*n + k]*b[k];
+		}
+		b[i] /= a[i*n + i];
+	}
+	for (size_t i = n; i-- > 0;)
+	{
+		for (size_t k = i + 1; k < n; ++k)
+		{
+			b[i] -= a[k*n + i]*b[k];
+		}
+		b[i] /= a[i*n + i];
+	}
+	return true;
+}
+
+/// Biased matrix factorization model
+class matrix_factorization_t
+{
+public:
+	/// \param[in] factors Number of latent factors
+	/// \param[in] iterations Number of ALS sweeps (users' and products' solves)
+	/// \param[in] regularization Factors' regularization, weighted by the number of ratings
+	/// \param[in] bias_regularization Biases' regularization (damping towards 0)
+	/// \param[in] seed Random generator seed of the initial products' factors
+	matrix_factorization_t(size_t factors = 20, size_t iterations = 10,
+						   float regularization = 0.05f, float bias_regularization = 5,
+						   uint32_t seed = 1)
+		:m_factors(factors), m_iterations(iterations),
+		m_regularization(regularization), m_bias_regularization(bias_regularization),
+		m_seed(seed), m_avg_rating(0)
+	{}
+
+	/// Learn the model of the ratings
+	void train(const sparse_ratings_t &ratings, size_t verbosity = 0)
+	{
+		size_t users = ratings.rows();
+		size_t products = ratings.cols();
+
+		// Average rating and damped biases
+		rating_statistics_t statistics(m_bias_regularization, m_bias_regularization);
+		statistics.compute(ratings);
+		m_avg_rating = statistics.avg_rating();
+		m_users_bias = statistics.users_bias();
+		m_products_bias = statistics.products_bias();
+
+		// Products' factors start small and random, users' ones are solved first
+		m_users_factors.resize(users, m_factors);
+		m_products_factors.resize(products, m_factors);
+		std::mt19937 random(m_seed);
+		std::normal_distribution<float> initial(0, 0.1f);
+		for (size_t j = 0; j < products; ++j)
+		{
+			for (size_t f = 0; f < m_factors; ++f)
+			{
+				m_products_factors.row(j)[f] = initial(random);
+			}
+		}
+
+		for (size_t iteration = 0; iteration < m_iterations; ++iteration)
+		{
+			solve(m_users_factors, m_products_factors, users,
+				  [&ratings](size_t i) { return ratings.get_row(i); },
+				  [this](size_t i, size_t j) { return m_users_bias[i] + m_products_bias[j]; });
+			solve(m_products_factors, m_users_factors, products,
+				  [&ratings](size_t j) { return ratings.get_col(j); },
+				  [this](size_t j, size_t i) { return m_users_bias[i] + m_products_bias[j]; });
+			if (verbosity >= 2)
+			{
+				std::cout << "ALS iteration " << iteration << " learning RMSE: "
+						  << learning_rmse(ratings) << std::endl;
+			}
+		}
+	}
+
+	/// Predicted rating, O(factors)
+	float predict(size_t user, size_t product) const
+	{
+		return m_avg_rating + m_users_bias[user] + m_products_bias[product]
+				+ simd_kernels().dot(m_users_factors.row(user),
+									 m_products_factors.row(product),
+									 m_users_factors.stride());
+	}
+
+	/// Predict the cells stored in 'prediction', rated cells are left untouched
+	void predict(sparse_ratings_t &prediction, const sparse_ratings_mask_t &ratings_mask) const
+	{
+		parallel_for(0, prediction.rows(), [&](size_t i) {
+			sparse_vector_view_t predicted = prediction.get_row(i);
+			for (size_t k = 0; k < predicted.nonzeros(); ++k)
+			{
+				size_t j = predicted.index(k);
+				if (ratings_mask(i,j) == false)
+				{
+					prediction.set(i, j, predict(i, j));
+				}
+			}
+		});
+	}
+
+	/// Serialise the learned model with the dictionaries of its indexes, so
+	/// the loaded model predicts by the users' and products' IDs
+	/// \param[in] users_converter,products_converter Dictionaries of the learning set
+	/// \return false on I/O error
+	bool write(std::ostream &out, const id_dictionary_t &users_converter, 
+			   const id_dictionary_t &products_converter) const
+	{
+		matrix_factorization_header_t header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "RCMMF", 5);
+		header.version = matrix_factorization_version;
+		header.users = m_users_factors.rows();
+		header.products = m_products_factors.rows();
+		header.factors = m_factors;
+		header.avg_rating = m_avg_rating;
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(m_users_bias.data()),
+				  m_users_bias.size()*sizeof(float));
+		out.write(reinterpret_cast<const char *>(m_products_bias.data()),
+				  m_products_bias.size()*sizeof(float));
+		write_factors(out, m_users_factors);
+		write_factors(out, m_products_factors);
+		return users_converter.write(out) && products_converter.write(out);
+	}
+
+	/// Load the model serialised by write()
+	/// \param[out] users_converter,products_converter Dictionaries of the model
+	/// \return false if the stream isn't a model of this version
+	bool read(std::istream &in, id_dictionary_t &users_converter, 
+			  id_dictionary_t &products_converter)
+	{
+		matrix_factorization_header_t header;
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+		if (in.fail() || std::memcmp(header.magic, "RCMMF", 5) != 0
+			|| header.version != matrix_factorization_version)
+		{
+			return false;
+		}
+		m_factors = header.factors;
+		m_avg_rating = header.avg_rating;
+		m_users_bias.resize(header.users);
+		m_products_bias.resize(header.products);
+		in.read(reinterpret_cast<char *>(m_users_bias.data()),
+				m_users_bias.size()*sizeof(float));
+		in.read(reinterpret_cast<char *>(m_products_bias.data()),
+				m_products_bias.size()*sizeof(float));
+		m_users_factors.resize(header.users, m_factors);
+		m_products_factors.resize(header.products, m_factors);
+		read_factors(in, m_users_factors);
+		read_factors(in, m_products_factors);
+		return !in.fail() 
+			&& users_converter.read(in) && users_converter.used_idxs() == header.users 
+			&& products_converter.read(in) && products_converter.used_idxs() == header.products;
+	}
+
+	size_t factors() const
+	{
+		return m_factors;
+	}
+	size_t users() const
+	{
+		return m_users_factors.rows();
+	}
+	size_t products() const
+	{
+		return m_products_factors.rows();
+	}
+
+private:
+	matrix_factorization_t(const matrix_factorization_t &);
+	matrix_factorization_t &operator=(const matrix_factorization_t &);
+
+	/// Solve the factors of every row given the fixed factors of the other side
+	/// \param[out] solved Factors being solved
+	/// \param[in] fixed Fixed factors
+	/// \param[in] ratings 'sparse_vector_view_t(size_t row)', ratings of the row
+	/// \param[in] bias 'float(size_t row, size_t other)', biases of the rating
+	template <class V, class B>
+	void solve(factor_matrix_t &solved, const factor_matrix_t &fixed, size_t rows,
+			   V ratings, B bias) const
+	{
+		size_t n = m_factors;
+		parallel_scratch_t<std::vector<double> > normal_matrices((std::vector<double>(n*n)));
+		parallel_scratch_t<std::vector<double> > right_sides((std::vector<double>(n)));
+		parallel_for(0, rows, [&](size_t row) {
+			sparse_vector_view_t rated = ratings(row);
+			float *x = solved.row(row);
+			if (rated.nonzeros() == 0)
+			{
+				std::fill(x, x + n, 0.0f);
+				return;
+			}
+			std::vector<double> &a = normal_matrices.local();
+			std::vector<double> &b = right_sides.local();
+			std::fill(a.begin(), a.end(), 0.0);
+			std::fill(b.begin(), b.end(), 0.0);
+			for (size_t r = 0; r < rated.nonzeros(); ++r)
+			{
+				const float *y = fixed.row(rated.index(r));
+				double residual = rated.value(r) - m_avg_rating - bias(row, rated.index(r));
+				for (size_t f = 0; f < n; ++f)
+				{
+					for (size_t g = 0; g <= f; ++g)
+					{
+						a[f*n + g] += double(y[f])*y[g];
+					}
+					b[f] += residual*y[f];
+				}
+			}
+			double lambda = m_regularization*rated.nonzeros();
+			for (size_t f = 0; f < n; ++f)
+			{
+				a[f*n + f] += lambda;
+				for (size_t g = f + 1; g < n; ++g)
+				{
+					a[f*n + g] = a[g*n + f];
+				}
+			}
+			bool solvable = cholesky_solve(a, b, n);
+			for (size_t f = 0; f < n; ++f)
+			{
+				x[f] = solvable ? b[f] : 0;
+			}
+		});
+	}
+
+	double learning_rmse(const sparse_ratings_t &ratings) const
+	{
+		double sq_sum = 0;
+		ratings.for_each([&](int i, int j, float rating) {
+			double diff = rating - predict(i, j);
+			sq_sum += diff*diff;
+		});
+		return ratings.nonzeros() > 0 ? std::sqrt(sq_sum/ratings.nonzeros()) : 0;
+	}
+
+	static void write_factors(std::ostream &out, const factor_matrix_t &factors)
+	{
+		for (size_t i = 0; i < factors.rows(); ++i)
+		{
+			out.write(reinterpret_cast<const char *>(factors.row(i)),
+					  factors.cols()*sizeof(float));
+		}
+	}
+	static void read_factors(std::istream &in, factor_matrix_t &factors)
+	{
+		for (size_t i = 0; i < factors.rows(); ++i)
+		{
+			in.read(reinterpret_cast<char *>(factors.row(i)),
+					factors.cols()*sizeof(float));
+		}
+	}
+
+	size_t m_factors;	///< Number of latent factors
+	size_t m_iterations;	///< Number of ALS sweeps
+	float m_regularization;	///< Factors' regularization
+	float m_bias_regularization;	///< Biases' regularization
+	uint32_t m_seed;	///< Random seed of the initial factors
+	float m_avg_rating;	///< Average rating
+	std::vector<float> m_users_bias;	///< Users' biases
+	std::vector<float> m_products_bias;	///< Products' biases
+	factor_matrix_t m_users_factors;	///< Users' factors, a row per user
+	factor_matrix_t m_products_factors;	///< Products' factors, a row per product
+};
+
+#endif	// SPBAU_RECOMMENDER_MATRIX_FACTORIZATION_HPP_
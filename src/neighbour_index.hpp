@@ -0,0 +1,366 @@
+#ifndef SPBAU_RECOMMENDER_NEIGHBOUR_INDEX_HPP_
+#define SPBAU_RECOMMENDER_NEIGHBOUR_INDEX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <istream>
+#include <ostream>
+
+#include "sparse_ratings.hpp"
+#include "parallel.hpp"
+
+/// Search modes of the neighbour index
+enum neighbour_search_t
+{
+	NEIGHBOUR_SEARCH_EXACT,	///< Resemblance to every other user is considered
+	NEIGHBOUR_SEARCH_APPROXIMATE	///< Only users sharing the most products are considered
+};
+
+const uint64_t neighbour_index_version = 1;
+
+/// Serialised index header, followed by (native byte order):
+/// uint32_t[users] numbers of neighbours, uint32_t[users*k] neighbours,
+/// float[users*k] resemblance to the neighbours
+struct neighbour_index_header_t
+{
+	char magic[8];	///< "RCMNBR"
+	uint64_t version;	///< neighbour_index_version
+	uint64_t users;	///< Number of users
+	uint64_t k;	///< Maximal number of neighbours per user
+};
+
+/// Top-k neighbour index
+/// Keeps at most 'k' most resembling users (by the absolute value of the
+/// resemblance) for every user, ordered from the most resembling one.
+/// Users with undefined (NaN) resemblance are never neighbours.
+/// Lookup is O(k), the index is built in parallel with a bounded heap per user.
+class neighbour_index_t
+{
+public:
+	typedef const uint32_t *const_iterator;
+
+	neighbour_index_t()
+		:m_k(0)
+	{}
+
+	/// Build the index considering every pair of users, O(users^2) resemblance lookups
+	/// \param[in] users Number of users
+	/// \param[in] k Maximal number of neighbours per user
+	/// \param[in] resemblance Resemblance functor 'float(size_t user1, size_t user2)',
+	///   called concurrently
+	template <class R>
+	void build(size_t users, size_t k, const R &resemblance)
+	{
+		reset(users, k);
+		parallel_scratch_t<std::vector<candidate_t> > heaps((std::vector<candidate_t>()));
+		parallel_for(0, users, [&](size_t user) {
+			std::vector<candidate_t> &heap = heaps.local();
+			heap.clear();
+			for (size_t other = 0; other < users; ++other)
+			{
+				if (other != user)
+				{
+					push(heap, other, resemblance(user, other));
+				}
+			}
+			store(user, heap);
+		});
+	}
+
+	/// Build the index of a symmetric resemblance considering every pair of 
+	/// users, O(users^2/2) resemblance lookups
+	/// Users are split into blocks; every pair of blocks (tile) is computed 
+	/// once and offered to the heaps of both blocks' users under the block's 
+	/// lock. The heaps keep the same neighbours whatever the order of offers, 
+	/// so the index equals the one of build(users, k, resemblance).
+	/// \param[in] users Number of users
+	/// \param[in] k Maximal number of neighbours per user
+	/// \param[in] resemblance Symmetric resemblance functor 
+	///   'float(size_t user1, size_t user2)', called concurrently
+	template <class R>
+	void build_symmetric(size_t users, size_t k, const R &resemblance)
+	{
+		reset(users, k);
+		const size_t block_users = 64;
+		size_t blocks = (users + block_users - 1)/block_users;
+		std::vector<std::pair<uint32_t, uint32_t> > tiles;
+		for (size_t a = 0; a < blocks; ++a)
+		{
+			for (size_t b = a; b < blocks; ++b)
+			{
+				tiles.push_back(std::make_pair(uint32_t(a), uint32_t(b)));
+			}
+		}
+		std::vector<std::vector<candidate_t> > heaps(users);
+		std::unique_ptr<std::mutex[]> block_locks(new std::mutex[blocks]);
+		parallel_scratch_t<std::vector<float> > tile_rows(
+			(std::vector<float>(block_users*block_users)));
+		parallel_for(0, tiles.size(), [&](size_t t) {
+			std::vector<float> &tile = tile_rows.local();
+			size_t a_begin = tiles[t].first*block_users;
+			size_t a_end = std::min(a_begin + block_users, users);
+			size_t b_begin = tiles[t].second*block_users;
+			size_t b_end = std::min(b_begin + block_users, users);
+			for (size_t user = a_begin; user < a_end; ++user)
+			{
+				for (size_t other = std::max(b_begin, user + 1); other < b_end; ++other)
+				{
+					tile[(user - a_begin)*block_users + other - b_begin] = 
+						resemblance(user, other);
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(block_locks[tiles[t].first]);
+				for (size_t user = a_begin; user < a_end; ++user)
+				{
+					for (size_t other = std::max(b_begin, user + 1); other < b_end; ++other)
+					{
+						push(heaps[user], other, 
+							 tile[(user - a_begin)*block_users + other - b_begin]);
+					}
+				}
+			}
+			std::lock_guard<std::mutex> lock(block_locks[tiles[t].second]);
+			for (size_t user = a_begin; user < a_end; ++user)
+			{
+				for (size_t other = std::max(b_begin, user + 1); other < b_end; ++other)
+				{
+					push(heaps[other], user, 
+						 tile[(user - a_begin)*block_users + other - b_begin]);
+				}
+			}
+		});
+		parallel_for(0, users, [&](size_t user) {
+			store(user, heaps[user]);
+		});
+	}
+
+	/// Build the index considering only the users sharing the most products
+	/// Candidates of the user are collected from the raters of the user's
+	/// products (inverted lists); 'candidates' of them with the most common
+	/// products are ranked by the resemblance.
+	/// \param[in] ratings Ratings matrix
+	/// \param[in] k Maximal number of neighbours per user
+	/// \param[in] candidates Number of candidates per user (at least 'k')
+	/// \param[in] resemblance Resemblance functor 'float(size_t user1, size_t user2)',
+	///   called concurrently
+	template <class R>
+	void build(const sparse_ratings_t &ratings, size_t k, size_t candidates,
+			   const R &resemblance)
+	{
+		size_t users = ratings.rows();
+		reset(users, k);
+		candidates = std::max(candidates, m_k);
+		parallel_scratch_t<std::vector<candidate_t> > heaps((std::vector<candidate_t>()));
+		parallel_scratch_t<std::vector<uint32_t> > common_counts((std::vector<uint32_t>(users, 0)));
+		parallel_scratch_t<std::vector<uint32_t> > touched_users((std::vector<uint32_t>()));
+		parallel_for(0, users, [&](size_t user) {
+			std::vector<candidate_t> &heap = heaps.local();
+			std::vector<uint32_t> &common = common_counts.local();
+			std::vector<uint32_t> &touched = touched_users.local();
+			// Number of products in common with the other users
+			sparse_vector_view_t products = ratings.get_row(user);
+			for (size_t p = 0; p < products.nonzeros(); ++p)
+			{
+				sparse_vector_view_t raters = ratings.get_col(products.index(p));
+				for (size_t r = 0; r < raters.nonzeros(); ++r)
+				{
+					uint32_t other = raters.index(r);
+					if (other != user && common[other]++ == 0)
+					{
+						touched.push_back(other);
+					}
+				}
+			}
+			if (touched.size() > candidates)
+			{
+				std::nth_element(touched.begin(), touched.begin() + candidates,
+								 touched.end(),
+								 [&common](uint32_t a, uint32_t b) {
+									return common[a] > common[b]
+										|| (common[a] == common[b] && a < b);
+								 });
+			}
+
+			heap.clear();
+			for (size_t c = 0; c < touched.size(); ++c)
+			{
+				if (c < candidates)
+				{
+					push(heap, touched[c], resemblance(user, touched[c]));
+				}
+				common[touched[c]] = 0;
+			}
+			touched.clear();
+			store(user, heap);
+		});
+	}
+
+	/// Build the index from the users' lists of candidates (e.g. persisted
+	/// top-N resemblance), no resemblance is looked up
+	/// \param[in] users Number of users
+	/// \param[in] k Maximal number of neighbours per user
+	/// \param[in] candidates Functor 'std::pair<I, I>(size_t user)', range of the 
+	///   user's candidates; I iterates over objects with 'user' and 'resemblance'
+	///   fields (resemblance_cache_entry_t)
+	template <class C>
+	void build_from_lists(size_t users, size_t k, const C &candidates)
+	{
+		reset(users, k);
+		parallel_scratch_t<std::vector<candidate_t> > heaps((std::vector<candidate_t>()));
+		parallel_for(0, users, [&](size_t user) {
+			std::vector<candidate_t> &heap = heaps.local();
+			heap.clear();
+			auto range = candidates(user);
+			for (auto c = range.first; c != range.second; ++c)
+			{
+				if (c->user != user)
+				{
+					push(heap, c->user, c->resemblance);
+				}
+			}
+			store(user, heap);
+		});
+	}
+
+	/// Neighbours of the 'user', the most resembling first
+	const_iterator begin(size_t user) const
+	{
+		return m_neighbours.data() + user*m_k;
+	}
+	const_iterator end(size_t user) const
+	{
+		return begin(user) + m_count[user];
+	}
+	/// Resemblance to the neighbours, in the order of neighbours
+	const float *resemblance(size_t user) const
+	{
+		return m_resemblance.data() + user*m_k;
+	}
+	size_t neighbours(size_t user) const
+	{
+		return m_count[user];
+	}
+	size_t users() const
+	{
+		return m_count.size();
+	}
+	/// Maximal number of neighbours per user
+	size_t k() const
+	{
+		return m_k;
+	}
+
+	/// Serialise the index
+	/// \return false on I/O error
+	bool write(std::ostream &out) const
+	{
+		neighbour_index_header_t header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "RCMNBR", 6);
+		header.version = neighbour_index_version;
+		header.users = users();
+		header.k = m_k;
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(m_count.data()), 
+				  m_count.size()*sizeof(uint32_t));
+		out.write(reinterpret_cast<const char *>(m_neighbours.data()), 
+				  m_neighbours.size()*sizeof(uint32_t));
+		out.write(reinterpret_cast<const char *>(m_resemblance.data()), 
+				  m_resemblance.size()*sizeof(float));
+		return !out.fail();
+	}
+
+	/// Load the index serialised by write()
+	/// \return false if the stream isn't an index of this version
+	bool read(std::istream &in)
+	{
+		neighbour_index_header_t header;
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+		if (in.fail() || std::memcmp(header.magic, "RCMNBR", 6) != 0
+			|| header.version != neighbour_index_version)
+		{
+			return false;
+		}
+		m_k = header.k;
+		m_count.resize(header.users);
+		m_neighbours.resize(header.users*header.k);
+		m_resemblance.resize(header.users*header.k);
+		in.read(reinterpret_cast<char *>(m_count.data()), 
+				m_count.size()*sizeof(uint32_t));
+		in.read(reinterpret_cast<char *>(m_neighbours.data()), 
+				m_neighbours.size()*sizeof(uint32_t));
+		in.read(reinterpret_cast<char *>(m_resemblance.data()), 
+				m_resemblance.size()*sizeof(float));
+		return !in.fail();
+	}
+
+private:
+	struct candidate_t
+	{
+		float key;	///< |Resemblance|
+		uint32_t user;	///< Candidate user
+		float resemblance;	///< Resemblance
+	};
+
+	/// More resembling candidate first, the heap top is the least resembling one
+	static bool more_resembling(const candidate_t &a, const candidate_t &b)
+	{
+		return a.key > b.key || (a.key == b.key && a.user < b.user);
+	}
+
+	void reset(size_t users, size_t k)
+	{
+		m_k = std::min(k, users > 0 ? users - 1 : 0);
+		m_neighbours.assign(users*m_k, 0);
+		m_resemblance.assign(users*m_k, 0);
+		m_count.assign(users, 0);
+	}
+
+	/// Offer the 'other' user to the bounded heap of the 'k' most resembling users
+	void push(std::vector<candidate_t> &heap, size_t other, float resemblance) const
+	{
+		if (std::isnan(resemblance) || m_k == 0)
+		{
+			return;
+		}
+		candidate_t candidate = {std::abs(resemblance), uint32_t(other), resemblance};
+		if (heap.size() < m_k)
+		{
+			heap.push_back(candidate);
+			std::push_heap(heap.begin(), heap.end(), more_resembling);
+		}
+		else if (more_resembling(candidate, heap.front()))
+		{
+			std::pop_heap(heap.begin(), heap.end(), more_resembling);
+			heap.back() = candidate;
+			std::push_heap(heap.begin(), heap.end(), more_resembling);
+		}
+	}
+
+	/// Store the heap's users as neighbours of the 'user'
+	void store(size_t user, std::vector<candidate_t> &heap)
+	{
+		std::sort_heap(heap.begin(), heap.end(), more_resembling);
+		m_count[user] = heap.size();
+		for (size_t n = 0; n < heap.size(); ++n)
+		{
+			m_neighbours[user*m_k + n] = heap[n].user;
+			m_resemblance[user*m_k + n] = heap[n].resemblance;
+		}
+	}
+
+	size_t m_k;	///< Maximal number of neighbours per user
+	std::vector<uint32_t> m_neighbours;	///< Neighbours, 'm_k' slots per user
+	std::vector<float> m_resemblance;	///< Resemblance to the neighbours
+	std::vector<uint32_t> m_count;	///< Number of neighbours of each user
+};
+
+#endif	// SPBAU_RECOMMENDER_NEIGHBOUR_INDEX_HPP_
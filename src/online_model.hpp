@@ -0,0 +1,331 @@
+#ifndef SPBAU_RECOMMENDER_ONLINE_MODEL_HPP_
+#define SPBAU_RECOMMENDER_ONLINE_MODEL_HPP_
+
+/// Incrementally updated recommendation model
+/// New ratings are ingested one by one without rebuilding the model: user's
+/// and product's averages are kept as running sums, Pearson Correlation of
+/// users is kept as sufficient statistics (sums, sums of squares and
+/// co-rating dot products). Neighbour lists of the users whose statistics
+/// changed are marked dirty and refreshed lazily on the next prediction.
+/// Library API: the command line tool serves requests by recommender_t, 
+/// the online model is used by the benchmarks only.
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+#include "dataset_io.hpp"
+
+/// Online GroupLens model over the users' neighbours
+/// Resemblance is Pearson Correlation over all the known products (unset
+/// ratings are zeros) as correlation_coeff(), computed in O(1) from the
+/// sufficient statistics. Updates and queries are not thread-safe.
+/// A rating changes the user's resemblance to every other user, not only to
+/// the product's co-raters that are marked dirty: the correlation centres 
+/// by the user's sum over all the products, and a new product changes their
+/// number. So a neighbour list is outdated after any update; lists are 
+/// refreshed if dirty or if more than 'max_staleness' updates of the model 
+/// were ingested since their refresh.
+class online_model_t
+{
+public:
+	/// \param[in] neighbours_count Number of the most resembling users used for prediction
+	/// \param[in] max_staleness Number of the model's updates a neighbour list 
+	///   of a user that is not a co-rater may miss; 0 keeps the lists exact
+	explicit online_model_t(size_t neighbours_count, size_t max_staleness = 0)
+		:m_neighbours_count(neighbours_count), m_max_staleness(max_staleness), 
+		m_ratings_sum(0), m_ratings_count(0), m_updates(0)
+	{}
+
+	/// Ingest a rating, a rating of the already rated product replaces the old one
+	/// Averages are updated in O(1), co-rating dot products in O(raters of the product).
+	void add(const dataset_triplet_t &triplet)
+	{
+		uint32_t user = index(m_users, triplet.user, m_user_ratings, m_user_stats);
+		uint32_t product = index(m_products, triplet.product, m_product_raters, m_product_stats);
+		if (m_dirty.size() < m_user_ratings.size())
+		{
+			m_dirty.resize(m_user_ratings.size(), true);
+			m_neighbours.resize(m_user_ratings.size());
+			m_refreshed.resize(m_user_ratings.size(), 0);
+		}
+		++m_updates;
+
+		float old_rating = 0;
+		bool rated = set(m_user_ratings[user], product, triplet.rating, old_rating);
+		set(m_product_raters[product], user, triplet.rating, old_rating);
+		double delta = triplet.rating - old_rating;
+		double delta_sqr = double(triplet.rating)*triplet.rating - double(old_rating)*old_rating;
+
+		m_user_stats[user].add(delta, delta_sqr, rated);
+		m_product_stats[product].add(delta, delta_sqr, rated);
+		m_ratings_sum += delta;
+		m_ratings_count += rated ? 0 : 1;
+
+		// co-raters' dot products with the user changed
+		const ratings_t &raters = m_product_raters[product];
+		for (size_t r = 0; r < raters.size(); ++r)
+		{
+			if (raters[r].first != user)
+			{
+				m_dot[pair_key(user, raters[r].first)] += delta*raters[r].second;
+				m_dirty[raters[r].first] = true;
+			}
+		}
+		m_dirty[user] = true;
+	}
+
+	/// Ingest the ratings in order
+	template <class T>
+	void add(const T &triplets)
+	{
+		for (typename T::const_iterator i = triplets.begin(); i != triplets.end(); ++i)
+		{
+			add(*i);
+		}
+	}
+
+	/// Predict the rating of the product by the user
+	/// Unknown users get the product's average, unknown products the user's
+	/// average, unknown both the average rating.
+	/// \param[in] user_id,product_id Dataset IDs
+	float predict(size_t user_id, size_t product_id)
+	{
+		size_t user = 0;
+		size_t product = 0;
+		bool known_user = find(m_users, user_id, user);
+		bool known_product = find(m_products, product_id, product);
+		if (known_user && known_product)
+		{
+			float prediction = grouplens(user, product);
+			return std::isfinite(prediction) ? prediction : avg_user_rating(user);
+		}
+		else if (known_user)
+		{
+			return avg_user_rating(user);
+		}
+		else if (known_product)
+		{
+			return avg_product_rating(product);
+		}
+		return m_ratings_count > 0 ? m_ratings_sum/m_ratings_count : 0;
+	}
+
+	/// Pearson Correlation of two users (indexes of the model)
+	float resemblance(size_t user1, size_t user2) const
+	{
+		double n = m_product_raters.size();
+		const stats_t &stats1 = m_user_stats[user1];
+		const stats_t &stats2 = m_user_stats[user2];
+		dot_products_t::const_iterator dot = m_dot.find(pair_key(user1, user2));
+		double numer = (dot != m_dot.end() ? dot->second : 0) - stats1.sum*stats2.sum/n;
+		double user1r_sq_sum = stats1.sum_sqr - stats1.sum*stats1.sum/n;
+		double user2r_sq_sum = stats2.sum_sqr - stats2.sum*stats2.sum/n;
+		return numer/(std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum));
+	}
+
+	/// Most resembling users of the user (index of the model), refreshed if outdated
+	const std::vector<uint32_t> &neighbours(size_t user)
+	{
+		if (dirty(user))
+		{
+			refresh_neighbours(user);
+		}
+		return m_neighbours[user];
+	}
+
+	/// Whether the neighbour list of the user (index of the model) is outdated:
+	/// the user's or a co-rater's ratings changed, or the list is stale
+	bool dirty(size_t user) const
+	{
+		return m_dirty[user] || m_updates - m_refreshed[user] > m_max_staleness;
+	}
+
+	float avg_user_rating(size_t user) const
+	{
+		return m_user_stats[user].mean();
+	}
+	float avg_product_rating(size_t product) const
+	{
+		return m_product_stats[product].mean();
+	}
+
+	/// Model index of the known user ID
+	/// \return false if the user is not known
+	bool find_user(size_t user_id, size_t &user) const
+	{
+		return find(m_users, user_id, user);
+	}
+	bool find_product(size_t product_id, size_t &product) const
+	{
+		return find(m_products, product_id, product);
+	}
+
+	size_t users() const
+	{
+		return m_user_ratings.size();
+	}
+	size_t products() const
+	{
+		return m_product_raters.size();
+	}
+	size_t ratings() const
+	{
+		return m_ratings_count;
+	}
+
+private:
+	/// (index, rating) pairs ordered by index
+	typedef std::vector<std::pair<uint32_t, float> > ratings_t;
+	typedef std::unordered_map<size_t, uint32_t> ids_t;
+	/// Co-rating dot products, by pair_key()
+	typedef std::unordered_map<uint64_t, double> dot_products_t;
+
+	/// Sufficient statistics of a user's (product's) ratings
+	struct stats_t
+	{
+		stats_t()
+			:sum(0), sum_sqr(0), count(0)
+		{}
+		void add(double delta, double delta_sqr, bool rated)
+		{
+			sum += delta;
+			sum_sqr += delta_sqr;
+			count += rated ? 0 : 1;
+		}
+		float mean() const
+		{
+			return count > 0 ? sum/count : 0;
+		}
+
+		double sum;	///< Sum of the ratings
+		double sum_sqr;	///< Sum of the squared ratings
+		uint32_t count;	///< Number of the ratings
+	};
+
+	static uint64_t pair_key(uint64_t user1, uint64_t user2)
+	{
+		return user1 < user2 ? (user1 << 32 | user2) : (user2 << 32 | user1);
+	}
+
+	static bool find(const ids_t &ids, size_t id, size_t &idx)
+	{
+		ids_t::const_iterator i = ids.find(id);
+		if (i == ids.end())
+		{
+			return false;
+		}
+		idx = i->second;
+		return true;
+	}
+
+	/// Index of the ID, a new one is assigned to an unknown ID
+	static uint32_t index(ids_t &ids, size_t id,
+						  std::vector<ratings_t> &ratings, std::vector<stats_t> &stats)
+	{
+		std::pair<ids_t::iterator, bool> i = ids.insert(std::make_pair(id, uint32_t(ratings.size())));
+		if (i.second)
+		{
+			ratings.push_back(ratings_t());
+			stats.push_back(stats_t());
+		}
+		return i.first->second;
+	}
+
+	/// Set the rating of the index
+	/// \param[out] old_rating Replaced rating, 0 if there was none
+	/// \return true if the index was rated
+	static bool set(ratings_t &ratings, uint32_t idx, float rating, float &old_rating)
+	{
+		ratings_t::iterator i = std::lower_bound(ratings.begin(), ratings.end(),
+												 std::make_pair(idx, -HUGE_VALF));
+		if (i != ratings.end() && i->first == idx)
+		{
+			old_rating = i->second;
+			i->second = rating;
+			return true;
+		}
+		old_rating = 0;
+		ratings.insert(i, std::make_pair(idx, rating));
+		return false;
+	}
+
+	static float rating(const ratings_t &ratings, uint32_t idx)
+	{
+		ratings_t::const_iterator i = std::lower_bound(ratings.begin(), ratings.end(),
+													   std::make_pair(idx, -HUGE_VALF));
+		return i != ratings.end() && i->first == idx ? i->second : 0;
+	}
+
+	/// Select the most resembling users, as the exact neighbour search does
+	void refresh_neighbours(size_t user)
+	{
+		std::vector<uint32_t> &neighbours = m_neighbours[user];
+		m_resemblance.resize(users());
+		neighbours.clear();
+		for (size_t other = 0; other < users(); ++other)
+		{
+			if (other == user)
+			{
+				continue;
+			}
+			m_resemblance[other] = resemblance(user, other);
+			if (!std::isnan(m_resemblance[other]))
+			{
+				neighbours.push_back(other);
+			}
+		}
+		if (neighbours.size() > m_neighbours_count)
+		{
+			const std::vector<float> &resemblance = m_resemblance;
+			std::nth_element(neighbours.begin(), neighbours.begin() + m_neighbours_count,
+							 neighbours.end(),
+							 [&resemblance](uint32_t a, uint32_t b) {
+								return std::abs(resemblance[a]) > std::abs(resemblance[b]);
+							 });
+			neighbours.resize(m_neighbours_count);
+		}
+		m_dirty[user] = false;
+		m_refreshed[user] = m_updates;
+	}
+
+	/// GroupLens over the user's neighbours as grouplens()
+	float grouplens(size_t user, size_t product)
+	{
+		const std::vector<uint32_t> &user_neighbours = neighbours(user);
+		const ratings_t &raters = m_product_raters[product];
+		float numer = 0;
+		float denom = 0;
+		for (size_t n = 0; n < user_neighbours.size(); ++n)
+		{
+			uint32_t other = user_neighbours[n];
+			float user_resemblance = resemblance(user, other);
+			numer += (rating(raters, other) - avg_user_rating(other))*user_resemblance;
+			denom += std::abs(user_resemblance);
+		}
+		return avg_user_rating(user) + avg_product_rating(product) + (numer/denom);
+	}
+
+	size_t m_neighbours_count;	///< Number of neighbours used for prediction
+	size_t m_max_staleness;	///< Updates a neighbour list may miss
+	ids_t m_users;	///< User IDs to model indexes
+	ids_t m_products;	///< Product IDs to model indexes
+	std::vector<ratings_t> m_user_ratings;	///< (product, rating) of every user
+	std::vector<ratings_t> m_product_raters;	///< (user, rating) of every product
+	std::vector<stats_t> m_user_stats;	///< Users' sufficient statistics
+	std::vector<stats_t> m_product_stats;	///< Products' sufficient statistics
+	dot_products_t m_dot;	///< Users' co-rating dot products
+	double m_ratings_sum;	///< Sum of all the ratings
+	size_t m_ratings_count;	///< Number of all the ratings
+	uint64_t m_updates;	///< Number of the ingested ratings (model's version)
+	std::vector<std::vector<uint32_t> > m_neighbours;	///< Neighbour lists
+	std::vector<bool> m_dirty;	///< Neighbour lists to be refreshed
+	std::vector<uint64_t> m_refreshed;	///< Model's version of the neighbour lists' refresh
+	std::vector<float> m_resemblance;	///< Resemblance row scratch of the refresh
+};
+
+#endif	// SPBAU_RECOMMENDER_ONLINE_MODEL_HPP_
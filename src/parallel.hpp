@@ -0,0 +1,412 @@
+#ifndef SPBAU_RECOMMENDER_PARALLEL_HPP_
+#define SPBAU_RECOMMENDER_PARALLEL_HPP_
+
+/// Work-stealing thread pool shared by all the compute stages
+/// A parallel loop is split into tasks pushed to the queue of the calling
+/// thread; idle workers steal tasks from the other queues. A thread waiting
+/// for its loop runs queued tasks meanwhile, so loops may be nested (e.g.
+/// concurrent cross-validation folds running parallel algorithms) without
+/// blocking the pool.
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+class thread_pool_t
+{
+public:
+	/// Pool shared by the parallel algorithms
+	static thread_pool_t &instance()
+	{
+		static thread_pool_t pool;
+		return pool;
+	}
+
+	~thread_pool_t()
+	{
+		stop();
+	}
+
+	/// Number of threads running the tasks, the waiting caller included
+	size_t threads() const
+	{
+		return m_queues.size();
+	}
+
+	/// Index of the calling thread in [0, threads()): worker's own one, 0 for
+	/// the others (the thread that started the pool)
+	size_t thread_index() const
+	{
+		return current_queue();
+	}
+
+	/// Restart the pool with 'threads' threads (0 for every hardware thread)
+	/// Must not be called while a loop is running.
+	void resize(size_t threads)
+	{
+		if (threads == 0)
+		{
+			threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		}
+		if (threads == this->threads())
+		{
+			return;
+		}
+		stop();
+		start(threads);
+	}
+
+	/// Run 'f(task)' for every task in [0, tasks) and wait for them
+	/// An exception thrown by a task is rethrown in the calling thread.
+	void run(size_t tasks, const std::function<void(size_t)> &f)
+	{
+		job_t job(f, tasks);
+		queue_t &queue = *m_queues[current_queue()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			for (size_t t = 0; t < tasks; ++t)
+			{
+				task_t task = {&job, t};
+				queue.tasks.push_back(task);
+			}
+		}
+		m_queued += tasks;
+		{
+			std::lock_guard<std::mutex> lock(m_wake_mutex);
+		}
+		m_wake.notify_all();
+
+		// the caller runs the queued tasks (of the nested loops too) and 
+		// sleeps while there are none, until its loop is finished
+		while (job.remaining.load() > 0)
+		{
+			if (run_one())
+			{
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_wake_mutex);
+			m_wake.wait(lock, [this, &job]() {
+				return job.remaining.load() == 0 || m_queued.load() > 0;
+			});
+		}
+		if (job.error)
+		{
+			std::rethrow_exception(job.error);
+		}
+	}
+
+private:
+	struct job_t
+	{
+		job_t(const std::function<void(size_t)> &job_f, size_t tasks)
+			:f(job_f), remaining(tasks)
+		{}
+
+		const std::function<void(size_t)> &f;	///< Task functor
+		std::atomic<size_t> remaining;	///< Tasks not finished yet
+		std::mutex error_mutex;	///< Guards 'error'
+		std::exception_ptr error;	///< First exception thrown by a task
+	};
+
+	struct task_t
+	{
+		job_t *job;	///< Loop of the task
+		size_t index;	///< Task index in the loop
+	};
+
+	struct queue_t
+	{
+		std::mutex mutex;	///< Guards 'tasks'
+		std::deque<task_t> tasks;	///< Owner pops from the back, thieves from the front
+	};
+
+	thread_pool_t()
+		:m_stop(false), m_queued(0)
+	{
+		start(std::max<size_t>(std::thread::hardware_concurrency(), 1));
+	}
+	thread_pool_t(const thread_pool_t &);
+	thread_pool_t &operator=(const thread_pool_t &);
+
+	/// Queue of the calling thread: its own one for a worker, 0 for the others
+	static size_t &worker_index()
+	{
+		static thread_local size_t index = 0;
+		return index;
+	}
+	size_t current_queue() const
+	{
+		return worker_index() < m_queues.size() ? worker_index() : 0;
+	}
+
+	void start(size_t threads)
+	{
+		m_stop = false;
+		for (size_t q = 0; q < threads; ++q)
+		{
+			m_queues.push_back(std::unique_ptr<queue_t>(new queue_t));
+		}
+		for (size_t w = 1; w < threads; ++w)
+		{
+			m_workers.push_back(std::thread([this, w]() {
+				worker_index() = w;
+				work();
+			}));
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_wake_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (size_t w = 0; w < m_workers.size(); ++w)
+		{
+			m_workers[w].join();
+		}
+		m_workers.clear();
+		m_queues.clear();
+	}
+
+	void work()
+	{
+		for (;;)
+		{
+			if (run_one())
+			{
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_wake_mutex);
+			m_wake.wait(lock, [this]() { return m_stop || m_queued.load() > 0; });
+			if (m_stop)
+			{
+				return;
+			}
+		}
+	}
+
+	/// Run a task of the own queue (the newest) or steal one (the oldest)
+	/// \return false if there was no task
+	bool run_one()
+	{
+		size_t own = current_queue();
+		task_t task = {0, 0};
+		for (size_t k = 0; k < m_queues.size() && task.job == 0; ++k)
+		{
+			queue_t &queue = *m_queues[(own + k) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty())
+			{
+				if (k == 0)
+				{
+					task = queue.tasks.back();
+					queue.tasks.pop_back();
+				}
+				else
+				{
+					task = queue.tasks.front();
+					queue.tasks.pop_front();
+				}
+			}
+		}
+		if (task.job == 0)
+		{
+			return false;
+		}
+		--m_queued;
+
+		job_t &job = *task.job;
+		try
+		{
+			job.f(task.index);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(job.error_mutex);
+			if (!job.error)
+			{
+				job.error = std::current_exception();
+			}
+		}
+		// the job lives in the caller's run(), it isn't touched after the last task
+		if (--job.remaining == 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_wake_mutex);
+			}
+			m_wake.notify_all();
+		}
+		return true;
+	}
+
+	std::vector<std::unique_ptr<queue_t> > m_queues;	///< Task queue of every thread
+	std::vector<std::thread> m_workers;	///< Worker threads (queues 1..)
+	bool m_stop;	///< Workers are to exit
+	std::atomic<size_t> m_queued;	///< Number of queued tasks
+	std::mutex m_wake_mutex;	///< Guards 'm_stop' and the idle threads' wait
+	std::condition_variable m_wake;	///< Tasks were queued, a loop finished or the pool stops
+};
+
+/// Number of worker threads used by the parallel algorithms
+inline size_t parallel_threads()
+{
+	return thread_pool_t::instance().threads();
+}
+
+/// Set the number of worker threads (0 for every hardware thread)
+inline void parallel_set_threads(size_t threads)
+{
+	thread_pool_t::instance().resize(threads);
+}
+
+/// Index of the calling thread in [0, parallel_threads())
+inline size_t parallel_thread_index()
+{
+	return thread_pool_t::instance().thread_index();
+}
+
+/// Scratch object of every thread of the pool, for the functors of the
+/// parallel loops
+/// Buffers the functor needs for every index are created once per thread
+/// instead of once per index, while the indexes themselves are balanced 
+/// between the threads by parallel_for(). A thread runs one 'f(i)' at a 
+/// time, so 'f' may use its thread's object freely unless it starts a 
+/// nested loop meanwhile (the thread would run other tasks of the loop while
+/// waiting). Objects are copies of 'initial' made on the first use by their
+/// thread; the pool must not be resized while the scratch is in use.
+template <class T>
+class parallel_scratch_t
+{
+public:
+	explicit parallel_scratch_t(const T &initial)
+		:m_initial(initial), m_scratch(parallel_threads())
+	{}
+
+	/// Object of the calling thread
+	T &local()
+	{
+		std::unique_ptr<T> &scratch = m_scratch[parallel_thread_index()];
+		if (!scratch)
+		{
+			scratch.reset(new T(m_initial));
+		}
+		return *scratch;
+	}
+
+private:
+	parallel_scratch_t(const parallel_scratch_t &);
+	parallel_scratch_t &operator=(const parallel_scratch_t &);
+
+	const T m_initial;	///< Value of the new objects
+	std::vector<std::unique_ptr<T> > m_scratch;	///< Object of every thread, created on demand
+};
+
+/// Apply 'f(i)' to every i in [begin, end)
+/// The range is split into contiguous blocks, several per worker thread so
+/// the uneven ones are balanced by stealing; an exception thrown by 'f' is
+/// rethrown in the calling thread.
+/// \param[in] begin,end Range of indexes
+/// \param[in] f Functor, called concurrently for different indexes
+template <class F>
+void parallel_for(size_t begin, size_t end, F f)
+{
+	size_t count = end > begin ? end - begin : 0;
+	size_t threads = parallel_threads();
+	if (threads <= 1 || count <= 1)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			f(i);
+		}
+		return;
+	}
+
+	const size_t blocks_per_thread = 8;
+	size_t blocks = std::min(count, threads*blocks_per_thread);
+	thread_pool_t::instance().run(blocks, [=, &f](size_t b) {
+		for (size_t i = begin + count*b/blocks; i < begin + count*(b+1)/blocks; ++i)
+		{
+			f(i);
+		}
+	});
+}
+
+/// Reduce 'map(i)' of every i in [begin, end) by 'reduce'
+/// Blocks are reduced concurrently and their results are reduced in order,
+/// so for a given number of threads the result is deterministic.
+/// \param[in] identity Identity element of 'reduce'
+/// \param[in] map Functor 'T(size_t i)', called concurrently
+/// \param[in] reduce Associative functor 'T(const T &, const T &)'
+template <class T, class F, class R>
+T parallel_reduce(size_t begin, size_t end, const T &identity, F map, R reduce)
+{
+	size_t count = end > begin ? end - begin : 0;
+	size_t blocks = std::min(count, parallel_threads());
+	std::vector<T> partial(blocks, identity);
+	parallel_for(0, blocks, [&](size_t b) {
+		for (size_t i = begin + count*b/blocks; i < begin + count*(b+1)/blocks; ++i)
+		{
+			partial[b] = reduce(partial[b], map(i));
+		}
+	});
+	T result = identity;
+	for (size_t b = 0; b < blocks; ++b)
+	{
+		result = reduce(result, partial[b]);
+	}
+	return result;
+}
+
+/// Stable sort of 'in' by the bucket of the elements into 'out'
+/// Blocks of 'in' count their buckets concurrently, the positions of every
+/// (bucket, block) follow in the order of the buckets and the blocks, then
+/// the blocks scatter their elements concurrently. Equal buckets keep the
+/// order of 'in' whatever the number of threads.
+/// \param[in] buckets Number of the buckets
+/// \param[in] bucket Functor 'size_t(const T &)', bucket of the element in [0, buckets)
+template <class T, class B>
+void parallel_counting_sort(const std::vector<T> &in, std::vector<T> &out, 
+							size_t buckets, B bucket)
+{
+	size_t count = in.size();
+	out.resize(count);
+	size_t blocks = std::max<size_t>(std::min(count/4096, parallel_threads()), 1);
+	// counts, then positions, of the bucket 'k' in the block 'b' at [b*buckets + k]
+	std::vector<size_t> position(blocks*buckets, 0);
+	parallel_for(0, blocks, [&](size_t b) {
+		size_t *block_count = &position[b*buckets];
+		for (size_t i = count*b/blocks; i < count*(b+1)/blocks; ++i)
+		{
+			++block_count[bucket(in[i])];
+		}
+	});
+	size_t total = 0;
+	for (size_t k = 0; k < buckets; ++k)
+	{
+		for (size_t b = 0; b < blocks; ++b)
+		{
+			size_t block_count = position[b*buckets + k];
+			position[b*buckets + k] = total;
+			total += block_count;
+		}
+	}
+	parallel_for(0, blocks, [&](size_t b) {
+		size_t *block_position = &position[b*buckets];
+		for (size_t i = count*b/blocks; i < count*(b+1)/blocks; ++i)
+		{
+			out[block_position[bucket(in[i])]++] = in[i];
+		}
+	});
+}
+
+#endif	// SPBAU_RECOMMENDER_PARALLEL_HPP_
@@ -3,15 +3,24 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <fstream>
+#include <memory>
 
 #include <tclap/CmdLine.h>
 
 #include "dataset_io.hpp"
+#include "dataset_cache.hpp"
 #include "cross_validation.hpp"
+#include "recommender.hpp"
+#include "parallel.hpp"
+#include "instrumentation.hpp"
 
 int main(int argc, char **argv)
 {
 	bool do_cross_validation = true;
+	size_t cv_folds = 10;
+	size_t cv_leave_p_out = 0;
+	size_t cv_seed = 1;
 	std::string recommendation_request_filename("");
 	
 	std::string input_filename("");
@@ -21,9 +30,15 @@ int main(int argc, char **argv)
 	size_t recom_skip_lines = 0;
 	size_t recom_input_limit = 0;
 	std::string recom_output_filename("out.csv");
+	size_t recom_top_n = 0;
+	size_t recom_neighbours = 30;
 	
 	bool load_cached_data = false;
+	size_t resemblance_cache_size = 0;
+	size_t resemblance_top_n = 0;
 	size_t output_verbosity = 0;
+	size_t threads = 0;
+	std::string instrumentation_filename("");
 
 	try
 	{
@@ -35,6 +50,28 @@ int main(int argc, char **argv)
 										cmd, 
 										do_cross_validation);
 		
+		// Cross-validation parameters
+		TCLAP::ValueArg<size_t> cv_folds_arg("f", "cv-folds", 
+										"Number of folds (k-fold) or of repetitions (leave-p-out)", 
+										false, 
+										cv_folds, 
+										"unsigned integer", 
+										cmd);
+		
+		TCLAP::ValueArg<size_t> cv_leave_p_out_arg("p", "cv-leave-p-out", 
+										"Ratings of every user left out for validation (leave-p-out instead of k-fold)", 
+										false, 
+										cv_leave_p_out, 
+										"unsigned integer", 
+										cmd);
+		
+		TCLAP::ValueArg<size_t> cv_seed_arg("e", "cv-seed", 
+										"Random seed of the cross-validation folds", 
+										false, 
+										cv_seed, 
+										"unsigned integer", 
+										cmd);
+		
 		TCLAP::ValueArg<std::string> recommendation_arg("r", "recommendation", 
 										"Recommendation request filename", 
 										false, 
@@ -86,6 +123,20 @@ int main(int argc, char **argv)
 										"string", 
 										cmd);
 		
+		TCLAP::ValueArg<size_t> recom_top_n_arg("n", "recom-top-n", 
+										"Recommend so many products to every requested user instead of predicting requested ratings", 
+										false, 
+										recom_top_n, 
+										"unsigned integer", 
+										cmd);
+		
+		TCLAP::ValueArg<size_t> recom_neighbours_arg("b", "recom-neighbours", 
+										"Number of the most resembling users used for prediction", 
+										false, 
+										recom_neighbours, 
+										"unsigned integer", 
+										cmd);
+		
 		TCLAP::ValueArg<size_t> verbosity_arg("z", "verbosity",
 										"Output verbosity",
 										false,
@@ -98,12 +149,43 @@ int main(int argc, char **argv)
 										cmd, 
 										load_cached_data);
 		
+		TCLAP::ValueArg<size_t> resemblance_cache_size_arg("a", "resemblance-cache-size", 
+										"Compute users' resemblance on demand, keeping at most this many MiB of it in all the folds together or in the recommendation model (0 to precompute all the pairs); neighbours are searched among co-raters then", 
+										false, 
+										resemblance_cache_size, 
+										"unsigned integer", 
+										cmd);
+		
+		TCLAP::ValueArg<size_t> resemblance_top_n_arg("w", "resemblance-top-n", 
+										"Persist only this many most resembling users of every user with --load-cached-data (0 to persist all the pairs)", 
+										false, 
+										resemblance_top_n, 
+										"unsigned integer", 
+										cmd);
+		
+		TCLAP::ValueArg<size_t> threads_arg("t", "threads", 
+										"Number of worker threads (0 for every hardware thread)", 
+										false, 
+										threads, 
+										"unsigned integer", 
+										cmd);
+		
+		TCLAP::ValueArg<std::string> instrumentation_arg("i", "instrumentation-filename", 
+										"Write stage timings and counters to the file (CSV if the name ends with \".csv\", JSON otherwise)", 
+										false, 
+										instrumentation_filename, 
+										"string", 
+										cmd);
+		
 		
 		// Parse command line
 		cmd.parse(argc, argv);
 
 		// Read arguments' values
 		do_cross_validation = cross_validation_arg.getValue();
+		cv_folds = cv_folds_arg.getValue();
+		cv_leave_p_out = cv_leave_p_out_arg.getValue();
+		cv_seed = cv_seed_arg.getValue();
 		recommendation_request_filename = recommendation_arg.getValue();
 		
 		input_filename = input_filename_arg.getValue();
@@ -113,9 +195,15 @@ int main(int argc, char **argv)
 		recom_skip_lines = recom_skip_lines_arg.getValue();
 		recom_input_limit = recom_input_limit_arg.getValue();
 		recom_output_filename = output_filename_arg.getValue();
+		recom_top_n = recom_top_n_arg.getValue();
+		recom_neighbours = recom_neighbours_arg.getValue();
 		
 		load_cached_data = load_cached_data_arg.getValue();
+		resemblance_cache_size = resemblance_cache_size_arg.getValue();
+		resemblance_top_n = resemblance_top_n_arg.getValue();
 		output_verbosity = verbosity_arg.getValue();
+		threads = threads_arg.getValue();
+		instrumentation_filename = instrumentation_arg.getValue();
 	}
 	catch(TCLAP::ArgException &excp)
 	{
@@ -129,6 +217,9 @@ int main(int argc, char **argv)
 		perror("setvbuf");
 	}
 	
+	parallel_set_threads(threads);
+	instrumentation_t::instance().enable(!instrumentation_filename.empty());
+	
 	if (output_verbosity >= 1)
 	{
 		std::cout << "Reading dataset...";
@@ -137,24 +228,57 @@ int main(int argc, char **argv)
 	const size_t triplet_list_reserve = 3000;
 	dataset_triplet_t max_triplet_values = {0, 0, 0};
 	triplet_list.reserve(input_limit == 0 ? triplet_list_reserve : input_limit);
-	if (input_filename.empty() || input_filename == "-")
+	// cached dataset is read compacted, IDs are the indexes of the dictionaries
+	bool compacted = false;
+	id_dictionary_t users_converter;
+	id_dictionary_t products_converter;
+	// source of the cached data, if the cache is used
+	dataset_source_t source;
+	bool use_cache = false;
 	{
-		read_dataset(std::cin, triplet_list, max_triplet_values, 
-					 input_limit, skip_lines, output_verbosity);
-	}
-	else
-	{
-		std::ifstream input_file(input_filename);
-		if (input_file.is_open())
+		instrumentation_scope_t stage("read");
+		if (input_filename.empty() || input_filename == "-")
 		{
-			read_dataset(input_file, triplet_list, max_triplet_values, 
+			read_dataset(std::cin, triplet_list, max_triplet_values, 
 						 input_limit, skip_lines, output_verbosity);
-			input_file.close();
 		}
 		else
 		{
-			std::cout << "Can't open file: \"" 
-					  << input_filename << "\"" << std::endl;
+			// binary cache of the dataset is used while the source file is unchanged
+			const std::string cache_filename = input_filename + ".cache";
+			use_cache = load_cached_data 
+				&& dataset_source(input_filename, skip_lines, input_limit, source);
+			dataset_cache_t dataset_cache;
+			if (use_cache && dataset_cache.open(cache_filename, source))
+			{
+				if (output_verbosity >= 1)
+				{
+					std::cout << "(cached) ";
+				}
+				dataset_cache.get_compacted_triplets(triplet_list, max_triplet_values);
+				dataset_cache.get_dictionaries(users_converter, products_converter);
+				compacted = true;
+			}
+			else if (!read_dataset_file(input_filename, triplet_list, max_triplet_values, 
+										input_limit, skip_lines, output_verbosity))
+			{
+				std::cout << "Can't open file: \"" 
+						  << input_filename << "\"" << std::endl;
+			}
+			else if (use_cache 
+					 && !write_dataset_cache(cache_filename, source, triplet_list))
+			{
+				std::cout << "Can't write cache file: \"" 
+						  << cache_filename << "\"" << std::endl;
+			}
+			else if (use_cache && dataset_cache.open(cache_filename, source))
+			{
+				// the new cache is read back, so every run models the same compacted data
+				triplet_list.clear();
+				dataset_cache.get_compacted_triplets(triplet_list, max_triplet_values);
+				dataset_cache.get_dictionaries(users_converter, products_converter);
+				compacted = true;
+			}
 		}
 	}
 	if (output_verbosity >= 1)
@@ -165,7 +289,10 @@ int main(int argc, char **argv)
 	if (do_cross_validation)
 	{
 		cross_validation(triplet_list, max_triplet_values, 
-						 load_cached_data, output_verbosity);
+						 cv_folds, cv_leave_p_out, cv_seed, 
+						 use_cache ? input_filename : std::string(), 
+						 similarity_cache_t::capacity_for(resemblance_cache_size << 20), 
+						 resemblance_top_n, output_verbosity);
 	}
 	
 	if (!recommendation_request_filename.empty())
@@ -173,23 +300,114 @@ int main(int argc, char **argv)
 		std::vector<dataset_triplet_t> recom_triplet_list;
 		const size_t recom_triplet_list_reserve = 3000;
 		dataset_triplet_t recom_max_triplet_values = {0, 0, 0};
-		recom_triplet_list.reserve(input_limit == 0 ? recom_triplet_list_reserve : recom_input_limit);
+		recom_triplet_list.reserve(recom_input_limit == 0 ? recom_triplet_list_reserve : recom_input_limit);
 		
-		std::ifstream input_file(recommendation_request_filename);
-		if (input_file.is_open())
+		if (!read_dataset_file(recommendation_request_filename, 
+							   recom_triplet_list, recom_max_triplet_values, 
+							   recom_input_limit, recom_skip_lines, output_verbosity))
 		{
-			read_dataset(input_file, recom_triplet_list,recom_max_triplet_values, 
-						 recom_input_limit, recom_skip_lines, output_verbosity);
-			input_file.close();
+			std::cout << "Can't open file: \"" 
+					  << recommendation_request_filename << "\"" << std::endl;
+			return 1;
+		}
+		
+		if (output_verbosity >= 1)
+		{
+			std::cout << "Building recommendation model...";
+		}
+		typedef recommender_t<std::vector<dataset_triplet_t> > recommender_type;
+		size_t resemblance_cache_capacity = 
+			similarity_cache_t::capacity_for(resemblance_cache_size << 20);
+		// serving model is persisted next to the dataset cache
+		const std::string model_filename = input_filename + ".model";
+		std::unique_ptr<recommender_type> recommender(new recommender_type());
+		std::ifstream model_file;
+		if (use_cache && open_dataset_model(model_file, model_filename, source) 
+			&& recommender->read(model_file, recom_neighbours, 
+								 resemblance_cache_capacity > 0 ? NEIGHBOUR_SEARCH_APPROXIMATE 
+																: NEIGHBOUR_SEARCH_EXACT))
+		{
+			if (output_verbosity >= 1)
+			{
+				std::cout << "(cached) ";
+			}
 		}
 		else
+		{
+			recommender.reset(compacted 
+				? new recommender_type(triplet_list, users_converter, products_converter, 
+									   recom_neighbours, 
+									   use_cache ? input_filename : std::string(), 
+									   resemblance_cache_capacity, resemblance_top_n, 
+									   output_verbosity) 
+				: new recommender_type(triplet_list, max_triplet_values, 
+									   recom_neighbours, 
+									   use_cache ? input_filename : std::string(), 
+									   resemblance_cache_capacity, resemblance_top_n, 
+									   output_verbosity));
+			if (use_cache && !write_dataset_model(model_filename, source, *recommender))
+			{
+				std::cout << "Can't write cache file: \"" 
+						  << model_filename << "\"" << std::endl;
+			}
+		}
+		if (output_verbosity >= 1)
+		{
+			std::cout << "Done." << std::endl;
+			std::cout << "Serving " << recom_triplet_list.size() << " requests...";
+		}
+		std::ofstream output_file(recom_output_filename);
+		if (!output_file.is_open())
 		{
 			std::cout << "Can't open file: \"" 
-					  << input_filename << "\"" << std::endl;
+					  << recom_output_filename << "\"" << std::endl;
+			return 1;
+		}
+		{
+			instrumentation_scope_t stage("recommendation");
+			if (recom_top_n > 0)
+			{
+				std::vector<dataset_triplet_t> recommendations;
+				recommender->recommend(recom_triplet_list, recom_top_n, recommendations);
+				write_triplets(output_file, recommendations);
+			}
+			else
+			{
+				std::vector<float> predictions;
+				recommender->predict(recom_triplet_list, predictions);
+				for (size_t i = 0; i < predictions.size(); ++i)
+				{
+					recom_triplet_list[i].rating = predictions[i];
+				}
+				write_triplets(output_file, recom_triplet_list);
+			}
+		}
+		if (output_verbosity >= 1)
+		{
+			std::cout << "Done." << std::endl;
+		}
+	}
+
+	if (!instrumentation_filename.empty())
+	{
+		std::ofstream instrumentation_file(instrumentation_filename.c_str());
+		if (!instrumentation_file.is_open())
+		{
+			std::cout << "Can't open file: \"" 
+					  << instrumentation_filename << "\"" << std::endl;
+			return 1;
+		}
+		const std::string csv_extension(".csv");
+		if (instrumentation_filename.size() >= csv_extension.size()
+			&& instrumentation_filename.compare(instrumentation_filename.size() - csv_extension.size(), 
+												csv_extension.size(), csv_extension) == 0)
+		{
+			instrumentation_t::instance().write_csv(instrumentation_file);
+		}
+		else
+		{
+			instrumentation_t::instance().write_json(instrumentation_file);
 		}
-		
-		// launch recommender_t
-		std::cout << "Recommendations will be here someday." << std::endl;
 	}
 
 	return 0;
@@ -0,0 +1,456 @@
+#ifndef SPBAU_RECOMMENDER_RECOMMENDER_HPP_
+#define SPBAU_RECOMMENDER_RECOMMENDER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <memory>
+
+#include <itpp/base/vec.h>
+
+#include "dataset_io.hpp"
+#include "id_dictionary.hpp"
+#include "sparse_ratings.hpp"
+#include "user_resemblance.hpp"
+#include "resemblance_cache.hpp"
+#include "similarity_cache.hpp"
+#include "symmetric_matrix.hpp"
+#include "neighbour_index.hpp"
+#include "knn.hpp"
+#include "grouplens.hpp"
+#include "cross_validation.hpp"
+#include "parallel.hpp"
+
+const uint64_t recommender_model_version = 1;
+
+/// Serialised serving model header, followed by (native byte order): 
+/// users' and products' dictionaries (id_dictionary_t::write()), 
+/// sparse_ratings_t::entry_t[ratings] ratings by matrix indexes, 
+/// users' neighbour lists (neighbour_index_t::write())
+struct recommender_model_header_t
+{
+	char magic[8];	///< "RCMREC"
+	uint64_t version;	///< recommender_model_version
+	uint64_t users;	///< Number of users
+	uint64_t products;	///< Number of products
+	uint64_t ratings;	///< Number of ratings
+	uint64_t neighbours;	///< Number of neighbours used for prediction
+	uint64_t search;	///< neighbour_search_t of the neighbour lists
+};
+
+/// Recommendations serving model
+/// Ratings, averages and the users' neighbour lists are built once for the 
+/// whole dataset. Requests are answered in batches grouped by user, the 
+/// groups are served in parallel and read only the neighbour lists.
+/// \tparam T Triplets container type
+/// \tparam MetricT Type of the user resemblance metric
+template <class T, class MetricT = correlation_coeff_resembl_metric_t>
+class recommender_t
+{
+public:
+	typedef typename T::value_type triplet_type;
+	/// Users' resemblance store of the model
+	typedef user_resemblance_t<sparse_ratings_t, symmetric_matrix_t<float>, 
+							   symmetric_bit_matrix_t, MetricT> user_resemblance_type;
+
+	/// Empty model, to be read()
+	recommender_t()
+		:m_avg_rating(0), m_neighbours_count(0), m_neighbour_search(NEIGHBOUR_SEARCH_EXACT)
+	{}
+
+	/// Build the model
+	/// \param[in] triplets Dataset
+	/// \param[in] max_triplet_values Maximal IDs of the dataset
+	/// \param[in] neighbours_count Number of the most resembling users used for prediction
+	/// \param[in] resemblance_cache_prefix Persisted users' resemblance is used
+	///   (and written) in the files of this prefix (resemblance_cache_filename()), 
+	///   none if empty
+	/// \param[in] resemblance_cache_capacity Users' resemblance is computed on 
+	///   demand and kept in a similarity cache of that many pairs, the neighbours
+	///   are searched among the co-raters; if 0 it is precomputed for all the pairs
+	/// \param[in] resemblance_top_n Persisted resemblance layout, as of fold_model_t
+	/// \param[in] verbosity Output verbosity
+	recommender_t(const T &triplets, const triplet_type &max_triplet_values,
+				  size_t neighbours_count, 
+				  const std::string &resemblance_cache_prefix = std::string(), 
+				  size_t resemblance_cache_capacity = 0, size_t resemblance_top_n = 0, 
+				  size_t verbosity = 0, const MetricT &metric = MetricT())
+		:m_avg_rating(0), m_neighbours_count(neighbours_count), 
+		m_neighbour_search(NEIGHBOUR_SEARCH_EXACT)
+	{
+		convert_triplets_to_matrix(m_ratings, m_ratings_mask, triplets,
+								   max_triplet_values,
+								   m_users_converter, m_products_converter);
+		build_model(neighbours_count, resemblance_cache_prefix, resemblance_cache_capacity, 
+					resemblance_top_n, verbosity, metric);
+	}
+
+	/// Build the model of the compacted dataset (dataset_cache_t)
+	/// \param[in] triplets Dataset, IDs are the indexes of the dictionaries
+	/// \param[in] users_converter,products_converter Dictionaries of the dataset
+	/// Other parameters are as of the above constructor.
+	recommender_t(const T &triplets, const id_dictionary_t &users_converter, 
+				  const id_dictionary_t &products_converter, 
+				  size_t neighbours_count, 
+				  const std::string &resemblance_cache_prefix = std::string(), 
+				  size_t resemblance_cache_capacity = 0, size_t resemblance_top_n = 0, 
+				  size_t verbosity = 0, const MetricT &metric = MetricT())
+		:m_users_converter(users_converter), m_products_converter(products_converter), 
+		m_avg_rating(0), m_neighbours_count(neighbours_count), 
+		m_neighbour_search(NEIGHBOUR_SEARCH_EXACT)
+	{
+		convert_compacted_triplets_to_matrix(m_ratings, m_ratings_mask, triplets, 
+											 m_users_converter.used_idxs(), 
+											 m_products_converter.used_idxs());
+		build_model(neighbours_count, resemblance_cache_prefix, resemblance_cache_capacity, 
+					resemblance_top_n, verbosity, metric);
+	}
+
+	/// Predict ratings for (user, product) requests
+	/// \param[in] requests Requested (user, product) pairs, ratings are ignored
+	/// \param[out] predictions Predicted ratings, in the order of requests
+	void predict(const T &requests, std::vector<float> &predictions) const
+	{
+		predictions.assign(requests.size(), 0);
+		std::vector<size_t> order;
+		std::vector<size_t> groups;
+		group_by_user(requests, order, groups);
+
+		parallel_for(0, groups.size() - 1, [&](size_t g) {
+			size_t user = 0;
+			bool known_user = m_users_converter.find(requests[order[groups[g]]].user, user);
+			for (size_t k = groups[g]; k < groups[g+1]; ++k)
+			{
+				size_t product = 0;
+				bool known_product = m_products_converter.find(requests[order[k]].product, product);
+				if (known_user && known_product)
+				{
+					predictions[order[k]] = predict(user, product);
+				}
+				else if (known_user)
+				{
+					predictions[order[k]] = m_avg_users_rating[user];
+				}
+				else if (known_product)
+				{
+					predictions[order[k]] = m_avg_products_rating[product];
+				}
+				else
+				{
+					predictions[order[k]] = m_avg_rating;
+				}
+			}
+		});
+	}
+
+	/// Recommend the best products to the requested users
+	/// Products already rated by the user are not recommended; unknown users
+	/// get the products with the highest average rating.
+	/// \param[in] requests Requests, only users are used
+	/// \param[in] top_n Number of recommendations per user
+	/// \param[out] recommendations (user, product, predicted rating) triplets,
+	///   grouped by user in the order of the best ones
+	void recommend(const T &requests, size_t top_n, T &recommendations) const
+	{
+		std::vector<size_t> order;
+		std::vector<size_t> groups;
+		group_by_user(requests, order, groups);
+
+		std::vector<T> user_recommendations(groups.size() - 1);
+		parallel_for(0, groups.size() - 1, [&](size_t g) {
+			size_t user_id = requests[order[groups[g]]].user;
+			std::vector<std::pair<float, size_t> > candidates;
+			candidates.reserve(m_ratings.cols());
+			size_t user = 0;
+			if (m_users_converter.find(user_id, user))
+			{
+				for (int product = 0; product < m_ratings.cols(); ++product)
+				{
+					if (m_ratings_mask(user, product) == false)
+					{
+						candidates.push_back(std::make_pair(
+								predict(user, product), product));
+					}
+				}
+			}
+			else
+			{
+				for (int product = 0; product < m_ratings.cols(); ++product)
+				{
+					candidates.push_back(std::make_pair(
+							float(m_avg_products_rating[product]), size_t(product)));
+				}
+			}
+
+			size_t count = std::min(top_n, candidates.size());
+			std::partial_sort(candidates.begin(), candidates.begin() + count,
+							  candidates.end(),
+							  std::greater<std::pair<float, size_t> >());
+			for (size_t k = 0; k < count; ++k)
+			{
+				triplet_type recommendation;
+				recommendation.user = user_id;
+				recommendation.product = m_products_converter.id(candidates[k].second);
+				recommendation.rating = candidates[k].first;
+				user_recommendations[g].push_back(recommendation);
+			}
+		});
+
+		for (size_t g = 0; g < user_recommendations.size(); ++g)
+		{
+			recommendations.insert(recommendations.end(),
+								   user_recommendations[g].begin(),
+								   user_recommendations[g].end());
+		}
+	}
+
+	size_t users() const
+	{
+		return m_ratings.rows();
+	}
+	size_t products() const
+	{
+		return m_ratings.cols();
+	}
+
+	/// Serialise the model: the dictionaries, the ratings and the neighbour 
+	/// lists; averages are recomputed by read()
+	/// \return false on I/O error
+	bool write(std::ostream &out) const
+	{
+		recommender_model_header_t header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "RCMREC", 6);
+		header.version = recommender_model_version;
+		header.users = m_ratings.rows();
+		header.products = m_ratings.cols();
+		header.ratings = m_ratings.nonzeros();
+		header.neighbours = m_neighbours_count;
+		header.search = m_neighbour_search;
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		if (!m_users_converter.write(out) || !m_products_converter.write(out))
+		{
+			return false;
+		}
+		std::vector<sparse_ratings_t::entry_t> entries;
+		entries.reserve(m_ratings.nonzeros());
+		m_ratings.for_each([&entries](int user, int product, float rating) {
+			sparse_ratings_t::entry_t entry;
+			entry.row = user;
+			entry.col = product;
+			entry.value = rating;
+			entries.push_back(entry);
+		});
+		out.write(reinterpret_cast<const char *>(entries.data()), 
+				  entries.size()*sizeof(sparse_ratings_t::entry_t));
+		return m_neighbours.write(out);
+	}
+
+	/// Load the model serialised by write()
+	/// \param[in] neighbours_count,search Expected parameters of the neighbour 
+	///   lists; exact lists are accepted for the approximate search too
+	/// \return false if the stream isn't a model of this version and parameters
+	bool read(std::istream &in, size_t neighbours_count, neighbour_search_t search)
+	{
+		recommender_model_header_t header;
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+		if (in.fail() || std::memcmp(header.magic, "RCMREC", 6) != 0
+			|| header.version != recommender_model_version
+			|| header.neighbours != neighbours_count
+			|| (header.search != search && header.search != NEIGHBOUR_SEARCH_EXACT))
+		{
+			return false;
+		}
+		if (!m_users_converter.read(in) || m_users_converter.used_idxs() != header.users
+			|| !m_products_converter.read(in) 
+			|| m_products_converter.used_idxs() != header.products)
+		{
+			return false;
+		}
+		std::vector<sparse_ratings_t::entry_t> entries(header.ratings);
+		in.read(reinterpret_cast<char *>(entries.data()), 
+				entries.size()*sizeof(sparse_ratings_t::entry_t));
+		if (in.fail() || !m_neighbours.read(in) || m_neighbours.users() != header.users)
+		{
+			return false;
+		}
+		m_ratings.assign(header.users, header.products, entries);
+		m_ratings_mask = sparse_ratings_mask_t(m_ratings);
+		m_neighbours_count = header.neighbours;
+		m_neighbour_search = neighbour_search_t(header.search);
+		compute_averages();
+		return true;
+	}
+
+private:
+	/// Order requests by user (stable)
+	/// \param[out] order Indexes of the requests ordered by user
+	/// \param[out] groups Group 'g' of one user's requests is [groups[g], groups[g+1]) in 'order'
+	static void group_by_user(const T &requests,
+							  std::vector<size_t> &order, std::vector<size_t> &groups)
+	{
+		order.resize(requests.size());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			order[i] = i;
+		}
+		std::stable_sort(order.begin(), order.end(),
+						 [&requests](size_t a, size_t b) {
+							return requests[a].user < requests[b].user;
+						 });
+		groups.clear();
+		for (size_t k = 0; k < order.size(); ++k)
+		{
+			if (k == 0 || requests[order[k]].user != requests[order[k-1]].user)
+			{
+				groups.push_back(k);
+			}
+		}
+		groups.push_back(order.size());
+	}
+
+	/// Averages and the neighbour lists of the ratings matrix
+	void build_model(size_t neighbours_count, const std::string &resemblance_cache_prefix, 
+					 size_t resemblance_cache_capacity, size_t resemblance_top_n, 
+					 size_t verbosity, const MetricT &metric)
+	{
+		compute_averages();
+		build_neighbours(neighbours_count, resemblance_cache_prefix, resemblance_cache_capacity, 
+						 resemblance_top_n, verbosity, metric);
+	}
+
+	/// Average user's, product's and overall ratings
+	void compute_averages()
+	{
+		m_avg_users_rating.set_size(m_ratings.rows());
+		m_avg_products_rating.set_size(m_ratings.cols());
+		m_avg_users_rating.zeros();
+		m_avg_products_rating.zeros();
+		avg_ratings(m_ratings, m_ratings_mask, m_avg_users_rating, m_avg_products_rating);
+
+		double ratings_sum = 0;
+		m_ratings.for_each([&ratings_sum](int, int, float rating) {
+			ratings_sum += rating;
+		});
+		m_avg_rating = m_ratings.nonzeros() > 0 ? ratings_sum/m_ratings.nonzeros() : 0;
+	}
+
+	/// Users' neighbour lists
+	/// Persisted top-N lists are used as they are if they are long enough; 
+	/// otherwise the resemblance (persisted, precomputed or cached on demand) 
+	/// is searched once. Only the pairs the persisted file misses are 
+	/// precomputed. The resemblance itself is not kept.
+	void build_neighbours(size_t neighbours_count, const std::string &resemblance_cache_prefix, 
+						  size_t resemblance_cache_capacity, size_t resemblance_top_n, 
+						  size_t verbosity, const MetricT &metric)
+	{
+		symmetric_matrix_t<float> resemblance;
+		symmetric_bit_matrix_t resemblance_mask;
+		user_resemblance_type user_resemblance(m_ratings, resemblance, resemblance_mask, 
+											   metric);
+		
+		// resemblance persisted by the previous runs on the same dataset
+		resemblance_cache_t persisted;
+		std::string persisted_file;
+		uint64_t fingerprint = 0;
+		if (!resemblance_cache_prefix.empty())
+		{
+			fingerprint = dataset_fingerprint(m_ratings);
+			persisted_file = resemblance_cache_filename(resemblance_cache_prefix, 
+														user_resemblance.metric_name(), 
+														resemblance_top_n);
+			if (persisted.open(persisted_file, fingerprint, user_resemblance.metric_name()))
+			{
+				user_resemblance.use_persisted(persisted);
+				if (verbosity >= 1)
+				{
+					std::cout << "Using users' resemblance from \"" 
+							  << persisted_file << "\"" << std::endl;
+				}
+			}
+		}
+		
+		instrumentation_scope_t stage("recommendation neighbour search");
+		if (persisted.is_open() && persisted.top_n() >= neighbours_count)
+		{
+			// persisted top-N lists hold the exact neighbours
+			m_neighbours.build_from_lists(m_ratings.rows(), neighbours_count, 
+										  [&persisted](size_t user) {
+				return std::make_pair(persisted.entries_begin(user), 
+									  persisted.entries_end(user));
+			});
+			return;
+		}
+		
+		std::unique_ptr<similarity_cache_t> cache;
+		if (resemblance_cache_capacity > 0)
+		{
+			cache.reset(new similarity_cache_t(resemblance_cache_capacity));
+			user_resemblance.use_cache(*cache);
+		}
+		else if (!persisted.is_open() || !persisted.complete())
+		{
+			resemblance.set_size(m_ratings.rows(), m_ratings.rows());
+			resemblance_mask.set_size(m_ratings.rows(), m_ratings.rows());
+			if (persisted.is_open())
+			{
+				persisted.copy_to(resemblance, resemblance_mask);
+			}
+			size_t computed = user_resembl(m_ratings, resemblance, resemblance_mask, 
+										   metric, 256, verbosity);
+			if (!resemblance_cache_prefix.empty() && computed > 0 && !persisted.is_open()
+				&& !write_resemblance_cache(persisted_file, fingerprint, 
+											user_resemblance, resemblance_top_n))
+			{
+				std::cout << "Can't write cache file: \"" 
+						  << persisted_file << "\"" << std::endl;
+			}
+		}
+		m_neighbour_search = cache ? NEIGHBOUR_SEARCH_APPROXIMATE : NEIGHBOUR_SEARCH_EXACT;
+		knn_neighbours(m_neighbours, neighbours_count, m_ratings, user_resemblance, 
+					   m_neighbour_search);
+	}
+
+	/// GroupLens prediction by the user's neighbours
+	/// User's average rating is used if the neighbours don't define the prediction.
+	float predict(size_t user, size_t product) const
+	{
+		float prediction = grouplens(m_avg_products_rating, m_ratings, 
+									 m_avg_users_rating, user, product, 
+									 m_neighbours.begin(user), m_neighbours.end(user), 
+									 m_neighbours.resemblance(user));
+		return std::isfinite(prediction) ? prediction : m_avg_users_rating[user];
+	}
+
+	id_dictionary_t m_users_converter;	///< User IDs to matrix indexes
+	id_dictionary_t m_products_converter;	///< Product IDs to matrix indexes
+	sparse_ratings_t m_ratings;	///< Ratings matrix
+	sparse_ratings_mask_t m_ratings_mask;	///< Ratings matrix mask
+	itpp::vec m_avg_users_rating;	///< Average user's ratings
+	itpp::vec m_avg_products_rating;	///< Average product's ratings
+	double m_avg_rating;	///< Average rating
+	size_t m_neighbours_count;	///< Number of neighbours used for prediction
+	neighbour_search_t m_neighbour_search;	///< Search mode of the neighbour lists
+	neighbour_index_t m_neighbours;	///< Most resembling users of every user
+};
+
+/// Write triplets as CSV ("user;product;rating" lines)
+template <class T>
+void write_triplets(std::ostream &out, const T &triplets)
+{
+	for (typename T::const_iterator i = triplets.begin(); i != triplets.end(); ++i)
+	{
+		out << i->user << ";" << i->product << ";" << i->rating << "\n";
+	}
+}
+
+#endif	// SPBAU_RECOMMENDER_RECOMMENDER_HPP_
@@ -0,0 +1,412 @@
+#ifndef SPBAU_RECOMMENDER_RESEMBLANCE_CACHE_HPP_
+#define SPBAU_RECOMMENDER_RESEMBLANCE_CACHE_HPP_
+
+/// Persisted users' resemblance
+/// The file is keyed by the fingerprint of the ratings matrix and the name
+/// of the resemblance metric, it is used read-only from the memory map.
+/// Sections (native byte order, 8-byte aligned) after resemblance_cache_header_t:
+///  - triangular layout: float[users*(users+1)/2] upper triangle by rows,
+///    followed by uint64_t validity bitmap of the same elements;
+///  - top-N layout: uint64_t[users] number of the user's entries,
+///    followed by resemblance_cache_entry_t[users*top_n], every user's
+///    entries are sorted by user index.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+
+#include "sparse_ratings.hpp"
+#include "mapped_file.hpp"
+#include "symmetric_matrix.hpp"
+
+const uint64_t resemblance_cache_version = 1;
+
+enum resemblance_cache_layout_t
+{
+	RESEMBLANCE_CACHE_TRIANGULAR = 0,	///< All the computed pairs
+	RESEMBLANCE_CACHE_TOP_N = 1	///< Most resembling users of every user
+};
+
+struct resemblance_cache_header_t
+{
+	char magic[8];	///< "RCMSIM"
+	uint64_t version;	///< resemblance_cache_version
+	uint64_t fingerprint;	///< Ratings matrix fingerprint
+	char metric[16];	///< Resemblance metric name
+	uint64_t layout;	///< resemblance_cache_layout_t
+	uint64_t users;	///< Number of users
+	uint64_t top_n;	///< Entries per user (top-N layout)
+};
+
+struct resemblance_cache_entry_t
+{
+	uint32_t user;	///< Other user's index
+	float resemblance;	///< Resemblance coefficient
+};
+
+/// FNV-1a hash step
+inline uint64_t fingerprint_update(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = static_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/// Fingerprint of the ratings matrix (dimensions, set cells and their values)
+template <class M>
+uint64_t dataset_fingerprint(const M &ratings)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int rows = ratings.rows();
+	int cols = ratings.cols();
+	hash = fingerprint_update(hash, &rows, sizeof(rows));
+	hash = fingerprint_update(hash, &cols, sizeof(cols));
+	for (int i = 0; i < rows; ++i)
+	{
+		for (int j = 0; j < cols; ++j)
+		{
+			float value = ratings(i, j);
+			if (value != 0)
+			{
+				hash = fingerprint_update(hash, &i, sizeof(i));
+				hash = fingerprint_update(hash, &j, sizeof(j));
+				hash = fingerprint_update(hash, &value, sizeof(value));
+			}
+		}
+	}
+	return hash;
+}
+
+/// Fingerprint of the sparse ratings matrix, O(ratings)
+inline uint64_t dataset_fingerprint(const sparse_ratings_t &ratings)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int rows = ratings.rows();
+	int cols = ratings.cols();
+	hash = fingerprint_update(hash, &rows, sizeof(rows));
+	hash = fingerprint_update(hash, &cols, sizeof(cols));
+	ratings.for_each([&hash](int i, int j, float value) {
+		if (value != 0)
+		{
+			hash = fingerprint_update(hash, &i, sizeof(i));
+			hash = fingerprint_update(hash, &j, sizeof(j));
+			hash = fingerprint_update(hash, &value, sizeof(value));
+		}
+	});
+	return hash;
+}
+
+/// Cache filename for the dataset, the metric and the layout
+/// Files are kept next to the dataset (like its dataset cache), one per 
+/// metric and layout: resemblance of other ratings (e.g. folds of another
+/// seed) replaces the file instead of adding one, the ratings are told by 
+/// the fingerprint in the header.
+/// \param[in] prefix Dataset filename, followed by the fold for cross-validation
+/// \param[in] top_n 0 for the triangular layout, entries per user for the top-N layout
+inline std::string resemblance_cache_filename(const std::string &prefix,
+											  const std::string &metric, size_t top_n = 0)
+{
+	std::ostringstream filename;
+	filename << prefix << ".resemblance_" << metric;
+	if (top_n > 0)
+	{
+		filename << "_top" << top_n;
+	}
+	filename << ".cache";
+	return filename.str();
+}
+
+/// Read-only memory mapped users' resemblance
+class resemblance_cache_t
+{
+public:
+	resemblance_cache_t()
+		:m_header(0), m_values(0), m_valid(0), m_counts(0), m_entries(0)
+	{}
+
+	/// Map the cache file
+	/// \return false if there is no file or it was built for other ratings or metric
+	bool open(const std::string &filename, uint64_t fingerprint,
+			  const std::string &metric)
+	{
+		m_header = 0;
+		if (!m_file.open(filename) || m_file.size() < sizeof(resemblance_cache_header_t))
+		{
+			return false;
+		}
+		const resemblance_cache_header_t *header =
+				reinterpret_cast<const resemblance_cache_header_t *>(m_file.data());
+		if (std::memcmp(header->magic, "RCMSIM", 7) != 0
+			|| header->version != resemblance_cache_version
+			|| header->fingerprint != fingerprint
+			|| metric.compare(0, sizeof(header->metric) - 1, header->metric) != 0
+			|| (header->layout != RESEMBLANCE_CACHE_TRIANGULAR
+				&& header->layout != RESEMBLANCE_CACHE_TOP_N)
+			|| m_file.size() != file_size(header->layout, header->users, header->top_n))
+		{
+			m_file.close();
+			return false;
+		}
+		m_header = header;
+		const char *data = m_file.data() + sizeof(resemblance_cache_header_t);
+		if (m_header->layout == RESEMBLANCE_CACHE_TRIANGULAR)
+		{
+			m_values = reinterpret_cast<const float *>(data);
+			m_valid = reinterpret_cast<const uint64_t *>(
+					data + aligned(triangle_size(users())*sizeof(float)));
+		}
+		else
+		{
+			m_counts = reinterpret_cast<const uint64_t *>(data);
+			m_entries = reinterpret_cast<const resemblance_cache_entry_t *>(
+					data + users()*sizeof(uint64_t));
+		}
+		return true;
+	}
+
+	bool is_open() const
+	{
+		return m_header != 0;
+	}
+	size_t users() const
+	{
+		return m_header->users;
+	}
+	/// Every computed pair is persisted (triangular layout), a pair not found
+	/// has to be computed in the top-N layout
+	bool complete() const
+	{
+		return m_header->layout == RESEMBLANCE_CACHE_TRIANGULAR;
+	}
+	/// Entries per user, 0 for the triangular layout
+	size_t top_n() const
+	{
+		return complete() ? 0 : m_header->top_n;
+	}
+	/// Most resembling users of the 'user' (top-N layout), sorted by user index
+	const resemblance_cache_entry_t *entries_begin(size_t user) const
+	{
+		return m_entries + user*m_header->top_n;
+	}
+	const resemblance_cache_entry_t *entries_end(size_t user) const
+	{
+		return entries_begin(user) + m_counts[user];
+	}
+
+	/// Persisted resemblance of the users
+	/// \return false if the pair was not persisted
+	bool find(size_t user1, size_t user2, float &resemblance) const
+	{
+		if (user1 > user2)
+		{
+			std::swap(user1, user2);
+		}
+		if (user2 >= users())
+		{
+			return false;
+		}
+		if (m_header->layout == RESEMBLANCE_CACHE_TRIANGULAR)
+		{
+			size_t idx = triangle_index(user1, user2, users());
+			if ((m_valid[idx/64] & (uint64_t(1) << (idx%64))) == 0)
+			{
+				return false;
+			}
+			resemblance = m_values[idx];
+			return true;
+		}
+		return find_entry(user1, user2, resemblance)
+			|| find_entry(user2, user1, resemblance);
+	}
+
+	/// Copy the persisted pairs to the resemblance matrix and set their flags
+	/// \param[in,out] resemblance,resemblance_mask Resemblance matrix and its mask
+	template <class R, class B>
+	void copy_to(R &resemblance, B &resemblance_mask) const
+	{
+		for (size_t user = 0; user < users(); ++user)
+		{
+			if (m_header->layout == RESEMBLANCE_CACHE_TRIANGULAR)
+			{
+				for (size_t other = user; other < users(); ++other)
+				{
+					size_t idx = triangle_index(user, other, users());
+					if ((m_valid[idx/64] & (uint64_t(1) << (idx%64))) != 0)
+					{
+						resemblance(user, other) = m_values[idx];
+						resemblance(other, user) = m_values[idx];
+						resemblance_mask(user, other) = true;
+						resemblance_mask(other, user) = true;
+					}
+				}
+				continue;
+			}
+			for (const resemblance_cache_entry_t *entry = entries_begin(user); 
+				 entry != entries_end(user); ++entry)
+			{
+				resemblance(user, entry->user) = entry->resemblance;
+				resemblance(entry->user, user) = entry->resemblance;
+				resemblance_mask(user, entry->user) = true;
+				resemblance_mask(entry->user, user) = true;
+			}
+		}
+	}
+
+	/// Index of (user1, user2), user1 <= user2, in the upper triangle stored by rows
+	static size_t triangle_index(size_t user1, size_t user2, size_t users)
+	{
+		return symmetric_matrix_index(user1, user2, users);
+	}
+	static size_t triangle_size(size_t users)
+	{
+		return symmetric_matrix_size(users);
+	}
+	static size_t aligned(size_t size)
+	{
+		return (size + 7) & ~size_t(7);
+	}
+	static size_t file_size(uint64_t layout, size_t users, size_t top_n)
+	{
+		if (layout == RESEMBLANCE_CACHE_TRIANGULAR)
+		{
+			return sizeof(resemblance_cache_header_t)
+					+ aligned(triangle_size(users)*sizeof(float))
+					+ (triangle_size(users) + 63)/64*sizeof(uint64_t);
+		}
+		return sizeof(resemblance_cache_header_t) + users*sizeof(uint64_t)
+				+ users*top_n*sizeof(resemblance_cache_entry_t);
+	}
+
+private:
+	bool find_entry(size_t user, size_t other, float &resemblance) const
+	{
+		const resemblance_cache_entry_t *end = entries_end(user);
+		const resemblance_cache_entry_t *it = std::lower_bound(entries_begin(user), end, other,
+			[](const resemblance_cache_entry_t &entry, size_t u) {
+				return entry.user < u;
+			});
+		if (it == end || it->user != other)
+		{
+			return false;
+		}
+		resemblance = it->resemblance;
+		return true;
+	}
+
+	mapped_file_t m_file;	///< Cache file
+	const resemblance_cache_header_t *m_header;	///< Header of the valid cache, null otherwise
+	const float *m_values;	///< Upper triangle (triangular layout)
+	const uint64_t *m_valid;	///< Validity bitmap (triangular layout)
+	const uint64_t *m_counts;	///< Entries per user (top-N layout)
+	const resemblance_cache_entry_t *m_entries;	///< Users' entries (top-N layout)
+};
+
+/// Persist users' resemblance
+/// Only the already known resemblance is written, nothing is computed.
+/// \tparam R User resemblance functor type (user_resemblance_t)
+/// \param[in] filename Cache filename
+/// \param[in] fingerprint Ratings matrix fingerprint
+/// \param[in] resemblance Users' resemblance
+/// \param[in] top_n 0 for the triangular layout, entries per user for the top-N layout
+/// \return false on I/O error
+template <class R>
+bool write_resemblance_cache(const std::string &filename, uint64_t fingerprint,
+							 const R &resemblance, size_t top_n = 0)
+{
+	resemblance_cache_header_t header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "RCMSIM", 7);
+	header.version = resemblance_cache_version;
+	header.fingerprint = fingerprint;
+	std::strncpy(header.metric, resemblance.metric_name(), sizeof(header.metric) - 1);
+	header.layout = top_n == 0 ? RESEMBLANCE_CACHE_TRIANGULAR : RESEMBLANCE_CACHE_TOP_N;
+	header.users = resemblance.users();
+	header.top_n = top_n;
+	size_t users = header.users;
+
+	std::string tmp_filename = filename + ".tmp";
+	std::ofstream file(tmp_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	if (top_n == 0)
+	{
+		size_t size = resemblance_cache_t::triangle_size(users);
+		std::vector<float> values(resemblance_cache_t::aligned(size*sizeof(float))/sizeof(float), 0);
+		std::vector<uint64_t> valid((size + 63)/64, 0);
+		for (size_t i = 0; i < users; ++i)
+		{
+			for (size_t j = i; j < users; ++j)
+			{
+				float value = 0;
+				if (resemblance.cached(i, j, value))
+				{
+					size_t idx = resemblance_cache_t::triangle_index(i, j, users);
+					values[idx] = value;
+					valid[idx/64] |= uint64_t(1) << (idx%64);
+				}
+			}
+		}
+		file.write(reinterpret_cast<const char *>(values.data()), values.size()*sizeof(float));
+		file.write(reinterpret_cast<const char *>(valid.data()), valid.size()*sizeof(uint64_t));
+	}
+	else
+	{
+		std::vector<uint64_t> counts(users, 0);
+		std::vector<resemblance_cache_entry_t> entries(users*top_n);
+		std::vector<resemblance_cache_entry_t> user_entries;
+		for (size_t i = 0; i < users; ++i)
+		{
+			user_entries.clear();
+			for (size_t j = 0; j < users; ++j)
+			{
+				resemblance_cache_entry_t entry = {static_cast<uint32_t>(j), 0};
+				if (j != i && resemblance.cached(i, j, entry.resemblance)
+					&& !std::isnan(entry.resemblance))
+				{
+					user_entries.push_back(entry);
+				}
+			}
+			size_t count = std::min(top_n, user_entries.size());
+			std::partial_sort(user_entries.begin(), user_entries.begin() + count,
+							  user_entries.end(),
+				[](const resemblance_cache_entry_t &a, const resemblance_cache_entry_t &b) {
+					// ties as in neighbour_index_t, the lists give the same neighbours
+					return std::abs(a.resemblance) > std::abs(b.resemblance)
+						|| (std::abs(a.resemblance) == std::abs(b.resemblance) && a.user < b.user);
+				});
+			std::sort(user_entries.begin(), user_entries.begin() + count,
+				[](const resemblance_cache_entry_t &a, const resemblance_cache_entry_t &b) {
+					return a.user < b.user;
+				});
+			std::copy(user_entries.begin(), user_entries.begin() + count,
+					  entries.begin() + i*top_n);
+			counts[i] = count;
+		}
+		file.write(reinterpret_cast<const char *>(counts.data()), counts.size()*sizeof(uint64_t));
+		file.write(reinterpret_cast<const char *>(entries.data()),
+				   entries.size()*sizeof(resemblance_cache_entry_t));
+	}
+	file.close();
+	if (file.fail())
+	{
+		std::remove(tmp_filename.c_str());
+		return false;
+	}
+	return std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+#endif	// SPBAU_RECOMMENDER_RESEMBLANCE_CACHE_HPP_
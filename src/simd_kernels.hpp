@@ -0,0 +1,456 @@
+#ifndef SPBAU_RECOMMENDER_SIMD_KERNELS_HPP_
+#define SPBAU_RECOMMENDER_SIMD_KERNELS_HPP_
+
+/// Vectorised kernels of the resemblance metrics
+/// Every kernel has a scalar implementation and, with GCC on x86, AVX2 and
+/// AVX-512 ones; the best implementation supported by the CPU is selected
+/// at run time once. Kernels allocate nothing.
+/// Sorted sparse vectors are intersected by blocks: a block of one vector is
+/// compared with every rotation of a block of the other, and the block with
+/// the smaller last index is passed. The product-weighted metrics 
+/// (correlation_coeff_idf*) stay scalar, their weights come from a functor.
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/// Sum and sum of squares of the array in one pass
+inline void moments_scalar(const float *x, size_t n, double &sum, double &sum_sqr)
+{
+	float s = 0;
+	float sq = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		s += x[i];
+		sq += x[i] * x[i];
+	}
+	sum = s;
+	sum_sqr = sq;
+}
+
+/// Dot product of the sparse vector ('idx', 'val') and the dense vector 'dense'
+inline double gather_dot_scalar(const float *dense, const uint32_t *idx,
+								const float *val, size_t n)
+{
+	float dot = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		dot += dense[idx[i]] * val[i];
+	}
+	return dot;
+}
+
+/// Dot product of the dense vectors
+inline double dot_scalar(const float *x, const float *y, size_t n)
+{
+	float dot = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		dot += x[i] * y[i];
+	}
+	return dot;
+}
+
+/// Sums over the elements set in both sparse vectors
+struct intersect_moments_t
+{
+	double count;	///< Number of the common elements
+	double sum1;	///< Sum of the first vector's common elements
+	double sum2;	///< Sum of the second vector's common elements
+	double dot;	///< Dot product
+	double sum_sqr1;	///< Sum of the first vector's squared common elements
+	double sum_sqr2;	///< Sum of the second vector's squared common elements
+};
+
+/// Dot product of the sparse vectors ('idx1', 'val1') and ('idx2', 'val2') 
+/// with the strictly increasing indexes, one merge pass
+inline double intersect_dot_scalar(const uint32_t *idx1, const float *val1, size_t n1, 
+								   const uint32_t *idx2, const float *val2, size_t n2)
+{
+	double dot = 0;
+	size_t k1 = 0;
+	size_t k2 = 0;
+	while (k1 < n1 && k2 < n2)
+	{
+		if (idx1[k1] < idx2[k2])
+		{
+			++k1;
+		}
+		else if (idx2[k2] < idx1[k1])
+		{
+			++k2;
+		}
+		else
+		{
+			dot += double(val1[k1++]) * val2[k2++];
+		}
+	}
+	return dot;
+}
+
+/// Sums over the common elements of the sparse vectors, added to 'moments'
+/// \see intersect_dot_scalar
+inline void intersect_moments_scalar(const uint32_t *idx1, const float *val1, size_t n1, 
+									 const uint32_t *idx2, const float *val2, size_t n2, 
+									 intersect_moments_t &moments)
+{
+	size_t k1 = 0;
+	size_t k2 = 0;
+	while (k1 < n1 && k2 < n2)
+	{
+		if (idx1[k1] < idx2[k2])
+		{
+			++k1;
+		}
+		else if (idx2[k2] < idx1[k1])
+		{
+			++k2;
+		}
+		else
+		{
+			double r1 = val1[k1++];
+			double r2 = val2[k2++];
+			moments.count += 1;
+			moments.sum1 += r1;
+			moments.sum2 += r2;
+			moments.dot += r1 * r2;
+			moments.sum_sqr1 += r1 * r1;
+			moments.sum_sqr2 += r2 * r2;
+		}
+	}
+}
+
+#if defined(SIMD_KERNELS_X86)
+
+__attribute__((target("avx2,fma")))
+inline float horizontal_sum_avx2(__m256 v)
+{
+	__m128 low = _mm256_castps256_ps128(v);
+	__m128 high = _mm256_extractf128_ps(v, 1);
+	low = _mm_add_ps(low, high);
+	low = _mm_hadd_ps(low, low);
+	low = _mm_hadd_ps(low, low);
+	return _mm_cvtss_f32(low);
+}
+
+__attribute__((target("avx2,fma")))
+inline void moments_avx2(const float *x, size_t n, double &sum, double &sum_sqr)
+{
+	__m256 s = _mm256_setzero_ps();
+	__m256 sq = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 v = _mm256_loadu_ps(x + i);
+		s = _mm256_add_ps(s, v);
+		sq = _mm256_fmadd_ps(v, v, sq);
+	}
+	double tail_sum = 0;
+	double tail_sum_sqr = 0;
+	moments_scalar(x + i, n - i, tail_sum, tail_sum_sqr);
+	sum = horizontal_sum_avx2(s) + tail_sum;
+	sum_sqr = horizontal_sum_avx2(sq) + tail_sum_sqr;
+}
+
+__attribute__((target("avx2,fma")))
+inline double gather_dot_avx2(const float *dense, const uint32_t *idx,
+							  const float *val, size_t n)
+{
+	__m256 dot = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i indexes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + i));
+		__m256 gathered = _mm256_i32gather_ps(dense, indexes, 4);
+		dot = _mm256_fmadd_ps(gathered, _mm256_loadu_ps(val + i), dot);
+	}
+	return horizontal_sum_avx2(dot) + gather_dot_scalar(dense, idx + i, val + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline double dot_avx2(const float *x, const float *y, size_t n)
+{
+	__m256 dot = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		dot = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), dot);
+	}
+	return horizontal_sum_avx2(dot) + dot_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline double intersect_dot_avx2(const uint32_t *idx1, const float *val1, size_t n1, 
+								 const uint32_t *idx2, const float *val2, size_t n2)
+{
+	const __m256i rotation = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	__m256 dot = _mm256_setzero_ps();
+	size_t i = 0;
+	size_t j = 0;
+	while (i + 8 <= n1 && j + 8 <= n2)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx1 + i));
+		__m256 a_val = _mm256_loadu_ps(val1 + i);
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx2 + j));
+		__m256 b_val = _mm256_loadu_ps(val2 + j);
+		for (size_t r = 0; r < 8; ++r)
+		{
+			__m256 match = _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b));
+			dot = _mm256_add_ps(dot, _mm256_and_ps(match, _mm256_mul_ps(a_val, b_val)));
+			b = _mm256_permutevar8x32_epi32(b, rotation);
+			b_val = _mm256_permutevar8x32_ps(b_val, rotation);
+		}
+		uint32_t a_last = idx1[i + 7];
+		uint32_t b_last = idx2[j + 7];
+		i += a_last <= b_last ? 8 : 0;
+		j += b_last <= a_last ? 8 : 0;
+	}
+	return horizontal_sum_avx2(dot) 
+		+ intersect_dot_scalar(idx1 + i, val1 + i, n1 - i, idx2 + j, val2 + j, n2 - j);
+}
+
+__attribute__((target("avx2,fma")))
+inline void intersect_moments_avx2(const uint32_t *idx1, const float *val1, size_t n1, 
+								   const uint32_t *idx2, const float *val2, size_t n2, 
+								   intersect_moments_t &moments)
+{
+	const __m256i rotation = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	const __m256 ones = _mm256_set1_ps(1);
+	__m256 count = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	__m256 sum2 = _mm256_setzero_ps();
+	__m256 dot = _mm256_setzero_ps();
+	__m256 sum_sqr1 = _mm256_setzero_ps();
+	__m256 sum_sqr2 = _mm256_setzero_ps();
+	size_t i = 0;
+	size_t j = 0;
+	while (i + 8 <= n1 && j + 8 <= n2)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx1 + i));
+		__m256 a_val = _mm256_loadu_ps(val1 + i);
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx2 + j));
+		__m256 b_val = _mm256_loadu_ps(val2 + j);
+		// every element of 'a' matches one rotation of 'b' at most
+		__m256 a_matched = _mm256_setzero_ps();
+		for (size_t r = 0; r < 8; ++r)
+		{
+			__m256 match = _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b));
+			__m256 b_common = _mm256_and_ps(match, b_val);
+			a_matched = _mm256_or_ps(a_matched, match);
+			sum2 = _mm256_add_ps(sum2, b_common);
+			dot = _mm256_fmadd_ps(a_val, b_common, dot);
+			sum_sqr2 = _mm256_fmadd_ps(b_common, b_common, sum_sqr2);
+			b = _mm256_permutevar8x32_epi32(b, rotation);
+			b_val = _mm256_permutevar8x32_ps(b_val, rotation);
+		}
+		__m256 a_common = _mm256_and_ps(a_matched, a_val);
+		count = _mm256_add_ps(count, _mm256_and_ps(a_matched, ones));
+		sum1 = _mm256_add_ps(sum1, a_common);
+		sum_sqr1 = _mm256_fmadd_ps(a_common, a_common, sum_sqr1);
+		uint32_t a_last = idx1[i + 7];
+		uint32_t b_last = idx2[j + 7];
+		i += a_last <= b_last ? 8 : 0;
+		j += b_last <= a_last ? 8 : 0;
+	}
+	moments.count += horizontal_sum_avx2(count);
+	moments.sum1 += horizontal_sum_avx2(sum1);
+	moments.sum2 += horizontal_sum_avx2(sum2);
+	moments.dot += horizontal_sum_avx2(dot);
+	moments.sum_sqr1 += horizontal_sum_avx2(sum_sqr1);
+	moments.sum_sqr2 += horizontal_sum_avx2(sum_sqr2);
+	intersect_moments_scalar(idx1 + i, val1 + i, n1 - i, idx2 + j, val2 + j, n2 - j, moments);
+}
+
+__attribute__((target("avx512f")))
+inline float horizontal_sum_avx512(__m512 v)
+{
+	float lanes[16];
+	_mm512_storeu_ps(lanes, v);
+	float sum = 0;
+	for (size_t i = 0; i < 16; ++i)
+	{
+		sum += lanes[i];
+	}
+	return sum;
+}
+
+__attribute__((target("avx512f")))
+inline void moments_avx512(const float *x, size_t n, double &sum, double &sum_sqr)
+{
+	__m512 s = _mm512_setzero_ps();
+	__m512 sq = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m512 v = _mm512_loadu_ps(x + i);
+		s = _mm512_add_ps(s, v);
+		sq = _mm512_fmadd_ps(v, v, sq);
+	}
+	double tail_sum = 0;
+	double tail_sum_sqr = 0;
+	moments_scalar(x + i, n - i, tail_sum, tail_sum_sqr);
+	sum = horizontal_sum_avx512(s) + tail_sum;
+	sum_sqr = horizontal_sum_avx512(sq) + tail_sum_sqr;
+}
+
+__attribute__((target("avx512f")))
+inline double gather_dot_avx512(const float *dense, const uint32_t *idx,
+								const float *val, size_t n)
+{
+	__m512 dot = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m512i indexes = _mm512_loadu_si512(idx + i);
+		__m512 gathered = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF,
+												   indexes, dense, 4);
+		dot = _mm512_fmadd_ps(gathered, _mm512_loadu_ps(val + i), dot);
+	}
+	return horizontal_sum_avx512(dot) + gather_dot_scalar(dense, idx + i, val + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline double dot_avx512(const float *x, const float *y, size_t n)
+{
+	__m512 dot = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		dot = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), dot);
+	}
+	return horizontal_sum_avx512(dot) + dot_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline double intersect_dot_avx512(const uint32_t *idx1, const float *val1, size_t n1, 
+								   const uint32_t *idx2, const float *val2, size_t n2)
+{
+	// full-mask permutes: the unmasked ones trip GCC's uninitialised warning
+	const __m512i rotation = _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 
+											   9, 10, 11, 12, 13, 14, 15, 0);
+	__m512 dot = _mm512_setzero_ps();
+	size_t i = 0;
+	size_t j = 0;
+	while (i + 16 <= n1 && j + 16 <= n2)
+	{
+		__m512i a = _mm512_loadu_si512(idx1 + i);
+		__m512 a_val = _mm512_loadu_ps(val1 + i);
+		__m512i b = _mm512_loadu_si512(idx2 + j);
+		__m512 b_val = _mm512_loadu_ps(val2 + j);
+		for (size_t r = 0; r < 16; ++r)
+		{
+			__mmask16 match = _mm512_cmpeq_epi32_mask(a, b);
+			dot = _mm512_mask3_fmadd_ps(a_val, b_val, dot, match);
+			b = _mm512_mask_permutexvar_epi32(b, 0xFFFF, rotation, b);
+			b_val = _mm512_mask_permutexvar_ps(b_val, 0xFFFF, rotation, b_val);
+		}
+		uint32_t a_last = idx1[i + 15];
+		uint32_t b_last = idx2[j + 15];
+		i += a_last <= b_last ? 16 : 0;
+		j += b_last <= a_last ? 16 : 0;
+	}
+	return horizontal_sum_avx512(dot) 
+		+ intersect_dot_scalar(idx1 + i, val1 + i, n1 - i, idx2 + j, val2 + j, n2 - j);
+}
+
+__attribute__((target("avx512f")))
+inline void intersect_moments_avx512(const uint32_t *idx1, const float *val1, size_t n1, 
+									 const uint32_t *idx2, const float *val2, size_t n2, 
+									 intersect_moments_t &moments)
+{
+	const __m512i rotation = _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 
+											   9, 10, 11, 12, 13, 14, 15, 0);
+	const __m512 ones = _mm512_set1_ps(1);
+	__m512 count = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	__m512 sum2 = _mm512_setzero_ps();
+	__m512 dot = _mm512_setzero_ps();
+	__m512 sum_sqr1 = _mm512_setzero_ps();
+	__m512 sum_sqr2 = _mm512_setzero_ps();
+	size_t i = 0;
+	size_t j = 0;
+	while (i + 16 <= n1 && j + 16 <= n2)
+	{
+		__m512i a = _mm512_loadu_si512(idx1 + i);
+		__m512 a_val = _mm512_loadu_ps(val1 + i);
+		__m512i b = _mm512_loadu_si512(idx2 + j);
+		__m512 b_val = _mm512_loadu_ps(val2 + j);
+		// every element of 'a' matches one rotation of 'b' at most
+		__mmask16 a_matched = 0;
+		for (size_t r = 0; r < 16; ++r)
+		{
+			__mmask16 match = _mm512_cmpeq_epi32_mask(a, b);
+			a_matched |= match;
+			sum2 = _mm512_mask_add_ps(sum2, match, sum2, b_val);
+			dot = _mm512_mask3_fmadd_ps(a_val, b_val, dot, match);
+			sum_sqr2 = _mm512_mask3_fmadd_ps(b_val, b_val, sum_sqr2, match);
+			b = _mm512_mask_permutexvar_epi32(b, 0xFFFF, rotation, b);
+			b_val = _mm512_mask_permutexvar_ps(b_val, 0xFFFF, rotation, b_val);
+		}
+		count = _mm512_mask_add_ps(count, a_matched, count, ones);
+		sum1 = _mm512_mask_add_ps(sum1, a_matched, sum1, a_val);
+		sum_sqr1 = _mm512_mask3_fmadd_ps(a_val, a_val, sum_sqr1, a_matched);
+		uint32_t a_last = idx1[i + 15];
+		uint32_t b_last = idx2[j + 15];
+		i += a_last <= b_last ? 16 : 0;
+		j += b_last <= a_last ? 16 : 0;
+	}
+	moments.count += horizontal_sum_avx512(count);
+	moments.sum1 += horizontal_sum_avx512(sum1);
+	moments.sum2 += horizontal_sum_avx512(sum2);
+	moments.dot += horizontal_sum_avx512(dot);
+	moments.sum_sqr1 += horizontal_sum_avx512(sum_sqr1);
+	moments.sum_sqr2 += horizontal_sum_avx512(sum_sqr2);
+	intersect_moments_scalar(idx1 + i, val1 + i, n1 - i, idx2 + j, val2 + j, n2 - j, moments);
+}
+
+#endif	// SIMD_KERNELS_X86
+
+/// Kernels selected for the CPU
+struct simd_kernels_t
+{
+	const char *name;	///< Instruction set name
+	void (*moments)(const float *x, size_t n, double &sum, double &sum_sqr);
+	double (*gather_dot)(const float *dense, const uint32_t *idx, const float *val, size_t n);
+	double (*dot)(const float *x, const float *y, size_t n);
+	double (*intersect_dot)(const uint32_t *idx1, const float *val1, size_t n1, 
+							const uint32_t *idx2, const float *val2, size_t n2);
+	void (*intersect_moments)(const uint32_t *idx1, const float *val1, size_t n1, 
+							  const uint32_t *idx2, const float *val2, size_t n2, 
+							  intersect_moments_t &moments);
+};
+
+inline simd_kernels_t select_simd_kernels()
+{
+#if defined(SIMD_KERNELS_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		simd_kernels_t kernels = {"avx512", moments_avx512, gather_dot_avx512, dot_avx512, 
+								  intersect_dot_avx512, intersect_moments_avx512};
+		return kernels;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		simd_kernels_t kernels = {"avx2", moments_avx2, gather_dot_avx2, dot_avx2, 
+								  intersect_dot_avx2, intersect_moments_avx2};
+		return kernels;
+	}
+#endif
+	simd_kernels_t kernels = {"scalar", moments_scalar, gather_dot_scalar, dot_scalar, 
+							  intersect_dot_scalar, intersect_moments_scalar};
+	return kernels;
+}
+
+/// Kernels for this CPU, selected on the first call
+inline const simd_kernels_t &simd_kernels()
+{
+	static const simd_kernels_t kernels = select_simd_kernels();
+	return kernels;
+}
+
+#endif	// SPBAU_RECOMMENDER_SIMD_KERNELS_HPP_
@@ -0,0 +1,277 @@
+#ifndef SPBAU_RECOMMENDER_SIMILARITY_CACHE_HPP_
+#define SPBAU_RECOMMENDER_SIMILARITY_CACHE_HPP_
+
+/// Concurrent, memory-bounded cache of the users' resemblance
+/// Coefficients are keyed by the (min, max) user pair, so a symmetric pair
+/// is stored once. The cache is split into shards, each a linear-probing
+/// table behind its own mutex: concurrent readers of different pairs
+/// rarely meet on the same shard. When a shard is full the CLOCK policy
+/// evicts a pair not looked up since the clock hand last passed it.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+
+#include "instrumentation.hpp"
+
+class similarity_cache_t
+{
+public:
+	/// \param[in] capacity Maximal number of the cached pairs
+	/// \param[in] shards Number of the shards (rounded down to a power of 2)
+	explicit similarity_cache_t(size_t capacity, size_t shards = 64)
+		:m_capacity(0)
+	{
+		capacity = std::max<size_t>(capacity, 1);
+		size_t count = 1;
+		while (count*2 <= std::min(shards, capacity) && count*2 <= max_shards)
+		{
+			count *= 2;
+		}
+		for (size_t s = 0; s < count; ++s)
+		{
+			m_shards.push_back(std::unique_ptr<shard_t>(new shard_t(capacity/count)));
+			m_capacity += m_shards.back()->capacity;
+		}
+	}
+
+	/// Capacity of the cache fitting in 'bytes' of memory
+	static size_t capacity_for(size_t bytes)
+	{
+		// a shard's table is at most 4 times its capacity (load factor 1/4..1/2)
+		return bytes/(4*sizeof(slot_t));
+	}
+
+	/// Cached resemblance of the users, counted as a hit or a miss
+	/// \return false if the pair isn't cached
+	bool find(size_t user1, size_t user2, float &resemblance)
+	{
+		uint64_t key = pair_key(user1, user2);
+		uint64_t hash = mix(key);
+		shard_t &shard = *m_shards[hash & (m_shards.size() - 1)];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		size_t slot = shard.find(key, hash);
+		if (slot == shard.slots.size())
+		{
+			++shard.misses;
+			return false;
+		}
+		shard.slots[slot].referenced = 1;
+		resemblance = shard.slots[slot].value;
+		++shard.hits;
+		return true;
+	}
+
+	/// Cache the resemblance of the users, evicting a pair if the shard is full
+	/// A pair inserted concurrently by another thread is overwritten.
+	void insert(size_t user1, size_t user2, float resemblance)
+	{
+		uint64_t key = pair_key(user1, user2);
+		uint64_t hash = mix(key);
+		shard_t &shard = *m_shards[hash & (m_shards.size() - 1)];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		size_t slot = shard.find(key, hash);
+		if (slot == shard.slots.size())
+		{
+			if (shard.size == shard.capacity)
+			{
+				shard.evict();
+				static instrumentation_counter_t &evictions =
+					instrumentation_t::instance().counter("resemblance cache evictions");
+				instrumentation_count(evictions);
+			}
+			slot = shard.place(key, hash);
+		}
+		shard.slots[slot].value = resemblance;
+		shard.slots[slot].referenced = 1;
+	}
+
+	/// Maximal number of the cached pairs
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+	/// Number of the cached pairs
+	size_t size() const
+	{
+		return sum(&shard_t::size);
+	}
+	uint64_t hits() const
+	{
+		return sum(&shard_t::hits);
+	}
+	uint64_t misses() const
+	{
+		return sum(&shard_t::misses);
+	}
+	uint64_t evictions() const
+	{
+		return sum(&shard_t::evictions);
+	}
+
+private:
+	similarity_cache_t(const similarity_cache_t &);
+	similarity_cache_t &operator=(const similarity_cache_t &);
+
+	static const size_t max_shards = 1 << 16;
+	static const uint64_t empty_key = ~uint64_t(0);
+
+	struct slot_t
+	{
+		uint64_t key;	///< Pair key, empty_key if the slot is free
+		float value;	///< Resemblance
+		uint32_t referenced;	///< Looked up since the clock hand passed
+	};
+
+	struct shard_t
+	{
+		explicit shard_t(size_t shard_capacity)
+			:capacity(std::max<size_t>(shard_capacity, 1)), size(0), hand(0),
+			hits(0), misses(0), evictions(0)
+		{
+			size_t table = 2;
+			while (table < 2*capacity)
+			{
+				table *= 2;
+			}
+			slot_t free_slot = {empty_key, 0, 0};
+			slots.assign(table, free_slot);
+		}
+
+		/// Slot of the key, slots.size() if there is none
+		size_t find(uint64_t key, uint64_t hash) const
+		{
+			size_t mask = slots.size() - 1;
+			for (size_t slot = home(hash, mask); slots[slot].key != empty_key;
+				 slot = (slot + 1) & mask)
+			{
+				if (slots[slot].key == key)
+				{
+					return slot;
+				}
+			}
+			return slots.size();
+		}
+
+		/// Take a free slot for the key (not in the table)
+		size_t place(uint64_t key, uint64_t hash)
+		{
+			size_t mask = slots.size() - 1;
+			size_t slot = home(hash, mask);
+			while (slots[slot].key != empty_key)
+			{
+				slot = (slot + 1) & mask;
+			}
+			slots[slot].key = key;
+			++size;
+			return slot;
+		}
+
+		/// CLOCK: clear the referenced pairs under the hand until a
+		/// non-referenced one is found, and erase it
+		void evict()
+		{
+			size_t mask = slots.size() - 1;
+			for (;; hand = (hand + 1) & mask)
+			{
+				if (slots[hand].key == empty_key)
+				{
+					continue;
+				}
+				if (slots[hand].referenced != 0)
+				{
+					slots[hand].referenced = 0;
+					continue;
+				}
+				erase(hand);
+				++evictions;
+				return;
+			}
+		}
+
+		/// Erase the slot, the following pairs of the probe run are shifted
+		/// back (no tombstones)
+		void erase(size_t slot)
+		{
+			size_t mask = slots.size() - 1;
+			size_t next = slot;
+			for (;;)
+			{
+				next = (next + 1) & mask;
+				if (slots[next].key == empty_key)
+				{
+					break;
+				}
+				// the pair stays if its home is cyclically in (slot, next]
+				size_t next_home = home(mix(slots[next].key), mask);
+				bool stays = slot <= next ? (slot < next_home && next_home <= next)
+										  : (slot < next_home || next_home <= next);
+				if (!stays)
+				{
+					slots[slot] = slots[next];
+					slot = next;
+				}
+			}
+			slots[slot].key = empty_key;
+			slots[slot].referenced = 0;
+			--size;
+		}
+
+		/// Home slot of the hash, the shard is chosen by its low bits
+		static size_t home(uint64_t hash, size_t mask)
+		{
+			return (hash >> 16) & mask;
+		}
+
+		std::mutex mutex;	///< Guards the shard
+		std::vector<slot_t> slots;	///< Linear-probing table, power of 2 size
+		size_t capacity;	///< Maximal number of the pairs
+		size_t size;	///< Number of the pairs
+		size_t hand;	///< CLOCK hand (slot)
+		uint64_t hits;	///< Pairs found
+		uint64_t misses;	///< Pairs not found
+		uint64_t evictions;	///< Pairs evicted
+	};
+
+	/// Key of the symmetric pair
+	static uint64_t pair_key(size_t user1, size_t user2)
+	{
+		if (user2 < user1)
+		{
+			std::swap(user1, user2);
+		}
+		return (uint64_t(user1) << 32) | uint64_t(user2);
+	}
+
+	/// 64-bit finalizer of MurmurHash3
+	static uint64_t mix(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	template <class T>
+	T sum(T shard_t::*field) const
+	{
+		T total = 0;
+		for (size_t s = 0; s < m_shards.size(); ++s)
+		{
+			std::lock_guard<std::mutex> lock(m_shards[s]->mutex);
+			total += (*m_shards[s]).*field;
+		}
+		return total;
+	}
+
+	std::vector<std::unique_ptr<shard_t> > m_shards;	///< Shards, power of 2 count
+	size_t m_capacity;	///< Maximal number of the pairs
+};
+
+#endif	// SPBAU_RECOMMENDER_SIMILARITY_CACHE_HPP_
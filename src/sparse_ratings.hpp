@@ -0,0 +1,383 @@
+#ifndef SPBAU_RECOMMENDER_SPARSE_RATINGS_HPP_
+#define SPBAU_RECOMMENDER_SPARSE_RATINGS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "parallel.hpp"
+#include "simd_kernels.hpp"
+
+/// Read-only view of one sparse row (user's ratings) or column (product's ratings)
+/// Behaves like a dense vector of length size() whose unset elements are zeros.
+class sparse_vector_view_t
+{
+public:
+	typedef float value_type;
+	typedef uint32_t index_type;
+
+	sparse_vector_view_t(const index_type *idx, const value_type *val,
+						 size_t nonzeros, int size)
+		:m_idx(idx), m_val(val), m_nonzeros(nonzeros), m_size(size)
+	{}
+
+	/// Logical (dense) length of the vector
+	int size() const
+	{
+		return m_size;
+	}
+	/// Number of stored elements
+	size_t nonzeros() const
+	{
+		return m_nonzeros;
+	}
+	/// Dense index of the k-th stored element
+	index_type index(size_t k) const
+	{
+		return m_idx[k];
+	}
+	/// Value of the k-th stored element
+	value_type value(size_t k) const
+	{
+		return m_val[k];
+	}
+	/// Dense indexes of the stored elements (contiguous)
+	const index_type *indexes() const
+	{
+		return m_idx;
+	}
+	/// Values of the stored elements (contiguous)
+	const value_type *values() const
+	{
+		return m_val;
+	}
+	/// Element lookup, O(log(nonzeros))
+	/// \return Stored value or 0 if the element is not set
+	value_type operator[](int i) const
+	{
+		const index_type *it = std::lower_bound(m_idx, m_idx + m_nonzeros,
+												static_cast<index_type>(i));
+		return (it != m_idx + m_nonzeros && *it == static_cast<index_type>(i))
+				? m_val[it - m_idx] : 0;
+	}
+	bool contains(int i) const
+	{
+		return std::binary_search(m_idx, m_idx + m_nonzeros,
+								  static_cast<index_type>(i));
+	}
+private:
+	const index_type *m_idx;	///< Sorted dense indexes of the stored elements
+	const value_type *m_val;	///< Stored values
+	size_t m_nonzeros;	///< Number of stored elements
+	int m_size;	///< Logical length
+};
+
+inline std::ostream &operator<<(std::ostream &os, const sparse_vector_view_t &v)
+{
+	os << "[";
+	for (size_t k = 0; k < v.nonzeros(); ++k)
+	{
+		os << (k == 0 ? "" : " ") << v.index(k) << ":" << v.value(k);
+	}
+	return os << "]";
+}
+
+/// Sum of the elements
+inline double sum(const sparse_vector_view_t &v)
+{
+	double result = 0;
+	for (size_t k = 0; k < v.nonzeros(); ++k)
+	{
+		result += v.value(k);
+	}
+	return result;
+}
+
+/// Mean of the elements (unset elements are zeros)
+inline double mean(const sparse_vector_view_t &v)
+{
+	return v.size() > 0 ? sum(v)/v.size() : 0;
+}
+
+/// Sum of the squared elements
+inline double sum_sqr(const sparse_vector_view_t &v)
+{
+	double result = 0;
+	for (size_t k = 0; k < v.nonzeros(); ++k)
+	{
+		result += v.value(k) * v.value(k);
+	}
+	return result;
+}
+
+/// Element-wise multiplication followed by summation (dot product)
+/// Only the elements set in both vectors are visited.
+inline double elem_mult_sum(const sparse_vector_view_t &v1, 
+							const sparse_vector_view_t &v2)
+{
+	return simd_kernels().intersect_dot(v1.indexes(), v1.values(), v1.nonzeros(), 
+										v2.indexes(), v2.values(), v2.nonzeros());
+}
+
+/// Sparse user-product ratings matrix
+/// Ratings are stored both in compressed sparse row (per-user) and
+/// compressed sparse column (per-product) order, so memory is proportional
+/// to the number of ratings. The set of stored cells (the pattern) is fixed
+/// by assign(), values of the stored cells can be changed with set().
+/// Interface mimics itpp::Mat where it is used by the algorithms
+/// (rows(), cols(), operator()(i,j), get_row(i), get_col(j)).
+class sparse_ratings_t
+{
+public:
+	typedef sparse_vector_view_t::value_type value_type;
+	typedef sparse_vector_view_t::index_type index_type;
+	typedef sparse_vector_view_t vector_view_type;
+
+	/// Matrix element (compacted indexes)
+	struct entry_t
+	{
+		index_type row;	///< User index
+		index_type col;	///< Product index
+		value_type value;	///< Rating
+	};
+
+	sparse_ratings_t()
+		:m_rows(0), m_cols(0), m_row_ptr(1, 0), m_col_ptr(1, 0)
+	{}
+
+	/// Build the matrix from its elements
+	/// Elements are sorted by (row, col) by the parallel LSD radix sort of 
+	/// the cell's number, the sort is stable, so duplicate cells are resolved 
+	/// in favour of the latest one in 'entries' whatever the number of threads.
+	/// \param[in] rows Number of rows (users)
+	/// \param[in] cols Number of columns (products)
+	/// \param[in,out] entries Matrix elements, reordered by the call
+	void assign(int rows, int cols, std::vector<entry_t> &entries)
+	{
+		const size_t radix_bits = 11;
+		uint64_t cells = uint64_t(rows)*uint64_t(cols);
+		std::vector<entry_t> sorted;
+		for (size_t shift = 0; shift < 64 && cells > (uint64_t(1) << shift); shift += radix_bits)
+		{
+			parallel_counting_sort(entries, sorted, size_t(1) << radix_bits, 
+								   [cols, shift](const entry_t &entry) {
+									   uint64_t cell = uint64_t(entry.row)*cols + entry.col;
+									   return size_t(cell >> shift) & ((size_t(1) << radix_bits) - 1);
+								   });
+			entries.swap(sorted);
+		}
+		// keep the last of the equal cells
+		size_t unique = 0;
+		for (size_t k = 0; k < entries.size(); ++k)
+		{
+			assert(entries[k].row < static_cast<index_type>(rows)
+				   && entries[k].col < static_cast<index_type>(cols));
+			if (unique > 0 && entries[unique-1].row == entries[k].row
+				&& entries[unique-1].col == entries[k].col)
+			{
+				entries[unique-1] = entries[k];
+			}
+			else
+			{
+				entries[unique++] = entries[k];
+			}
+		}
+		entries.resize(unique);
+		build_from_sorted(rows, cols, entries);
+	}
+
+	int rows() const
+	{
+		return m_rows;
+	}
+	int cols() const
+	{
+		return m_cols;
+	}
+	/// Number of stored ratings
+	size_t nonzeros() const
+	{
+		return m_row_val.size();
+	}
+
+	/// Rating of the product 'j' by the user 'i' or 0 if it is not set
+	value_type operator()(int i, int j) const
+	{
+		return get_row(i)[j];
+	}
+	bool contains(int i, int j) const
+	{
+		return get_row(i).contains(j);
+	}
+	/// Change the value of the stored cell
+	void set(int i, int j, value_type value)
+	{
+		m_row_val[find(m_row_idx, m_row_ptr, i, j)] = value;
+		m_col_val[find(m_col_idx, m_col_ptr, j, i)] = value;
+	}
+	/// Reset values of all the stored cells, pattern is preserved
+	void zeros()
+	{
+		std::fill(m_row_val.begin(), m_row_val.end(), value_type(0));
+		std::fill(m_col_val.begin(), m_col_val.end(), value_type(0));
+	}
+	/// Extend the matrix with empty rows and columns
+	void resize(int rows, int cols)
+	{
+		assert(rows >= m_rows && cols >= m_cols);
+		m_row_ptr.resize(rows+1, m_row_ptr.back());
+		m_col_ptr.resize(cols+1, m_col_ptr.back());
+		m_rows = rows;
+		m_cols = cols;
+	}
+
+	/// User's ratings
+	vector_view_type get_row(int i) const
+	{
+		assert(i >= 0 && i < m_rows);
+		return vector_view_type(m_row_idx.data() + m_row_ptr[i],
+								m_row_val.data() + m_row_ptr[i],
+								m_row_ptr[i+1] - m_row_ptr[i], m_cols);
+	}
+	/// Product's ratings
+	vector_view_type get_col(int j) const
+	{
+		assert(j >= 0 && j < m_cols);
+		return vector_view_type(m_col_idx.data() + m_col_ptr[j],
+								m_col_val.data() + m_col_ptr[j],
+								m_col_ptr[j+1] - m_col_ptr[j], m_rows);
+	}
+
+	/// Apply 'f(i, j, value)' to every stored cell in row-major order
+	template <class F>
+	void for_each(F f) const
+	{
+		for (int i = 0; i < m_rows; ++i)
+		{
+			for (size_t k = m_row_ptr[i]; k < m_row_ptr[i+1]; ++k)
+			{
+				f(i, static_cast<int>(m_row_idx[k]), m_row_val[k]);
+			}
+		}
+	}
+
+private:
+	/// Fill both compressed orders from elements sorted by (row, col) without duplicates
+	void build_from_sorted(int rows, int cols, const std::vector<entry_t> &entries)
+	{
+		m_rows = rows;
+		m_cols = cols;
+		size_t nonzeros = entries.size();
+
+		m_row_ptr.assign(rows+1, 0);
+		m_col_ptr.assign(cols+1, 0);
+		m_row_idx.resize(nonzeros);
+		m_row_val.resize(nonzeros);
+		m_col_idx.resize(nonzeros);
+		m_col_val.resize(nonzeros);
+
+		for (size_t k = 0; k < nonzeros; ++k)
+		{
+			++m_row_ptr[entries[k].row + 1];
+			++m_col_ptr[entries[k].col + 1];
+		}
+		for (int i = 0; i < rows; ++i)
+		{
+			m_row_ptr[i+1] += m_row_ptr[i];
+		}
+		for (int j = 0; j < cols; ++j)
+		{
+			m_col_ptr[j+1] += m_col_ptr[j];
+		}
+		// stable counting sort by column keeps rows ordered inside each column
+		std::vector<entry_t> by_col;
+		parallel_counting_sort(entries, by_col, cols, 
+							   [](const entry_t &entry) { return size_t(entry.col); });
+		parallel_for(0, nonzeros, [&](size_t k) {
+			m_row_idx[k] = entries[k].col;
+			m_row_val[k] = entries[k].value;
+			m_col_idx[k] = by_col[k].row;
+			m_col_val[k] = by_col[k].value;
+		});
+	}
+
+	static size_t find(const std::vector<index_type> &idx,
+					   const std::vector<size_t> &ptr, int major, int minor)
+	{
+		std::vector<index_type>::const_iterator begin = idx.begin() + ptr[major];
+		std::vector<index_type>::const_iterator end = idx.begin() + ptr[major+1];
+		std::vector<index_type>::const_iterator it =
+				std::lower_bound(begin, end, static_cast<index_type>(minor));
+		assert(it != end && *it == static_cast<index_type>(minor));
+		return it - idx.begin();
+	}
+
+	int m_rows;	///< Number of users
+	int m_cols;	///< Number of products
+	std::vector<size_t> m_row_ptr;	///< Row 'i' occupies [m_row_ptr[i], m_row_ptr[i+1])
+	std::vector<index_type> m_row_idx;	///< Product indexes in row-major order
+	std::vector<value_type> m_row_val;	///< Ratings in row-major order
+	std::vector<size_t> m_col_ptr;	///< Column 'j' occupies [m_col_ptr[j], m_col_ptr[j+1])
+	std::vector<index_type> m_col_idx;	///< User indexes in column-major order
+	std::vector<value_type> m_col_val;	///< Ratings in column-major order
+};
+
+inline std::ostream &operator<<(std::ostream &os, const sparse_ratings_t &m)
+{
+	for (int i = 0; i < m.rows(); ++i)
+	{
+		os << i << ": " << m.get_row(i) << "\n";
+	}
+	return os;
+}
+
+/// Mask of the sparse ratings matrix: cell is set iff the rating is stored
+class sparse_ratings_mask_t
+{
+public:
+	sparse_ratings_mask_t()
+		:m_ratings(0)
+	{}
+	explicit sparse_ratings_mask_t(const sparse_ratings_t &ratings)
+		:m_ratings(&ratings)
+	{}
+
+	int rows() const
+	{
+		return m_ratings->rows();
+	}
+	int cols() const
+	{
+		return m_ratings->cols();
+	}
+	bool operator()(int i, int j) const
+	{
+		return m_ratings->contains(i, j);
+	}
+	const sparse_ratings_t &ratings() const
+	{
+		return *m_ratings;
+	}
+private:
+	const sparse_ratings_t *m_ratings;	///< Masked matrix
+};
+
+inline std::ostream &operator<<(std::ostream &os, const sparse_ratings_mask_t &m)
+{
+	for (int i = 0; i < m.rows(); ++i)
+	{
+		sparse_vector_view_t row = m.ratings().get_row(i);
+		os << i << ":";
+		for (size_t k = 0; k < row.nonzeros(); ++k)
+		{
+			os << " " << row.index(k);
+		}
+		os << "\n";
+	}
+	return os;
+}
+
+#endif	// SPBAU_RECOMMENDER_SPARSE_RATINGS_HPP_
@@ -0,0 +1,197 @@
+#ifndef SPBAU_RECOMMENDER_SYMMETRIC_MATRIX_HPP_
+#define SPBAU_RECOMMENDER_SYMMETRIC_MATRIX_HPP_
+
+/// Packed storage of the symmetric square matrices (users' resemblance)
+/// Only the upper triangle is stored, by rows: (i, j) and (j, i) are the same
+/// element. symmetric_matrix_t keeps the values, symmetric_bit_matrix_t the
+/// bit-packed flags (validity mask). Interface mimics itpp::Mat where it is
+/// used by user_resemblance_t and user_resembl() (constructor, operator()(i,j),
+/// rows(), cols(), zeros()), so they are drop-in replacements of itpp::mat and
+/// itpp::bmat: float values and 1-bit flags of half of the matrix take about
+/// 1/4 of the memory of the square double matrix and byte mask.
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+/// Index of (i, j) in the upper triangle stored by rows
+/// \param[in] n Matrix size
+inline size_t symmetric_matrix_index(size_t i, size_t j, size_t n)
+{
+	if (j < i)
+	{
+		std::swap(i, j);
+	}
+	return i*n - (i > 0 ? i*(i - 1)/2 : 0) + (j - i);
+}
+
+/// Number of the elements of the upper triangle (diagonal included)
+inline size_t symmetric_matrix_size(size_t n)
+{
+	return n*(n + 1)/2;
+}
+
+/// Symmetric matrix of the values, upper triangle packed by rows
+template <class T>
+class symmetric_matrix_t
+{
+public:
+	typedef T value_type;
+
+	symmetric_matrix_t()
+		:m_size(0)
+	{}
+	/// \param[in] rows,cols Matrix size, must be square
+	symmetric_matrix_t(int rows, int cols)
+		:m_size(0)
+	{
+		set_size(rows, cols);
+	}
+
+	/// Resize the matrix, values are reset
+	void set_size(int rows, int cols)
+	{
+		assert(rows == cols);
+		(void)cols;
+		m_size = rows;
+		m_values.assign(symmetric_matrix_size(m_size), T(0));
+	}
+
+	T &operator()(size_t i, size_t j)
+	{
+		return m_values[symmetric_matrix_index(i, j, m_size)];
+	}
+	const T &operator()(size_t i, size_t j) const
+	{
+		return m_values[symmetric_matrix_index(i, j, m_size)];
+	}
+
+	int rows() const
+	{
+		return m_size;
+	}
+	int cols() const
+	{
+		return m_size;
+	}
+	void zeros()
+	{
+		std::fill(m_values.begin(), m_values.end(), T(0));
+	}
+	/// Memory taken by the values (bytes)
+	size_t memory() const
+	{
+		return m_values.size()*sizeof(T);
+	}
+
+private:
+	size_t m_size;	///< Number of rows (and columns)
+	std::vector<T> m_values;	///< Upper triangle by rows
+};
+
+/// Symmetric matrix of the bit flags, upper triangle packed by rows
+/// Flags are set and read atomically: the tiles of the all-pairs user_resembl()
+/// set flags of the same words concurrently.
+class symmetric_bit_matrix_t
+{
+public:
+	/// Flag of the element, assignable from and convertible to bool
+	class reference
+	{
+	public:
+		reference(std::atomic<uint64_t> &word, uint64_t bit)
+			:m_word(word), m_bit(bit)
+		{}
+		operator bool() const
+		{
+			return (m_word.load(std::memory_order_acquire) & m_bit) != 0;
+		}
+		reference &operator=(bool flag)
+		{
+			if (flag)
+			{
+				m_word.fetch_or(m_bit, std::memory_order_release);
+			}
+			else
+			{
+				m_word.fetch_and(~m_bit, std::memory_order_release);
+			}
+			return *this;
+		}
+		reference &operator=(const reference &other)
+		{
+			return *this = bool(other);
+		}
+	private:
+		std::atomic<uint64_t> &m_word;	///< Word of the flag
+		uint64_t m_bit;	///< Flag's bit in the word
+	};
+
+	symmetric_bit_matrix_t()
+		:m_size(0), m_words(0)
+	{}
+	/// \param[in] rows,cols Matrix size, must be square
+	symmetric_bit_matrix_t(int rows, int cols)
+		:m_size(0), m_words(0)
+	{
+		set_size(rows, cols);
+	}
+
+	/// Resize the matrix, flags are reset
+	void set_size(int rows, int cols)
+	{
+		assert(rows == cols);
+		(void)cols;
+		m_size = rows;
+		m_words = (symmetric_matrix_size(m_size) + 63)/64;
+		m_bits.reset(new std::atomic<uint64_t>[m_words]);
+		zeros();
+	}
+
+	reference operator()(size_t i, size_t j)
+	{
+		size_t index = symmetric_matrix_index(i, j, m_size);
+		return reference(m_bits[index/64], uint64_t(1) << (index%64));
+	}
+	bool operator()(size_t i, size_t j) const
+	{
+		size_t index = symmetric_matrix_index(i, j, m_size);
+		return (m_bits[index/64].load(std::memory_order_acquire)
+				& (uint64_t(1) << (index%64))) != 0;
+	}
+
+	int rows() const
+	{
+		return m_size;
+	}
+	int cols() const
+	{
+		return m_size;
+	}
+	void zeros()
+	{
+		for (size_t w = 0; w < m_words; ++w)
+		{
+			m_bits[w].store(0, std::memory_order_relaxed);
+		}
+	}
+	/// Memory taken by the flags (bytes)
+	size_t memory() const
+	{
+		return m_words*sizeof(uint64_t);
+	}
+
+private:
+	symmetric_bit_matrix_t(const symmetric_bit_matrix_t &);
+	symmetric_bit_matrix_t &operator=(const symmetric_bit_matrix_t &);
+
+	size_t m_size;	///< Number of rows (and columns)
+	size_t m_words;	///< Number of the words of the flags
+	std::unique_ptr<std::atomic<uint64_t>[]> m_bits;	///< Upper triangle by rows, 64 flags per word
+};
+
+#endif	// SPBAU_RECOMMENDER_SYMMETRIC_MATRIX_HPP_
@@ -7,10 +7,25 @@
 
 #include <cstddef>
 #include <cmath>
+#include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <iostream>
 
 #include <itpp/itbase.h>
 #include <itpp/stat/misc_stat.h>
 
+#include "sparse_ratings.hpp"
+#include "resemblance_cache.hpp"
+#include "similarity_cache.hpp"
+#include "symmetric_matrix.hpp"
+#include "parallel.hpp"
+#include "simd_kernels.hpp"
+#include "instrumentation.hpp"
+
 /// Pearson Correlation (PC) (p.125)
 /// \tparam R User's ratings of products - vector type (R[i] - rating of a product i)
 /// \tparam P Average ratings for products - vector type (P[i] - average rating of product i)
@@ -20,39 +35,86 @@
 template <class R>
 float correlation_coeff(const R &user1, const R &user2)
 {
-	float numer = 0;
-	float denom = 0;
-
-	float user1r_sq_sum = 0;
-	float user2r_sq_sum = 0;
+	// centred sums are expanded into raw sums: one pass, no temporaries
+	double n = user1.size();
+	double user1_sum = 0;
+	double user2_sum = 0;
+	double numer = 0;
+	double user1r_sq_sum = 0;
+	double user2r_sq_sum = 0;
 	
 #if defined(ALG_REF_IMPL)
 	//for each product
 	for (int i = 0; i < user1.size(); ++i)
 	{
-		float user1r = user1[i] - mean(user1);
-		float user2r = user2[i] - mean(user2);
-		numer += user1r * user2r;
+		user1_sum += user1[i];
+		user2_sum += user2[i];
+		numer += user1[i] * user2[i];
 
-		user1r_sq_sum += user1r * user1r;
-		user2r_sq_sum += user2r * user2r;
+		user1r_sq_sum += user1[i] * user1[i];
+		user2r_sq_sum += user2[i] * user2[i];
 	}
 #else	//ALG_ITPP_IMPL
-	R user1r = user1 - mean(user1);
-	R user2r = user2 - mean(user2);
-	//element-wise multiplication of user1r and user2r followed by summation of resultant elements
-	numer = elem_mult_sum(user1r, user2r);
-	//element-wise square of user1r followed by summation of resultant elements
-	user1r_sq_sum = sum_sqr(user1r);
-	//element-wise square of user2r followed by summation of resultant elements
-	user2r_sq_sum = sum_sqr(user2r);
+	user1_sum = sum(user1);
+	user2_sum = sum(user2);
+	//element-wise multiplication of user1 and user2 followed by summation of resultant elements
+	numer = elem_mult_sum(user1, user2);
+	//element-wise square of user1 followed by summation of resultant elements
+	user1r_sq_sum = sum_sqr(user1);
+	//element-wise square of user2 followed by summation of resultant elements
+	user2r_sq_sum = sum_sqr(user2);
 #endif
-	denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
+	numer -= user1_sum*user2_sum/n;
+	user1r_sq_sum -= user1_sum*user1_sum/n;
+	user2r_sq_sum -= user2_sum*user2_sum/n;
+	double denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
 	//denom = std::sqrt(user1r_sq_sum * user2r_sq_sum); //in Recommender Systems Handbook
 
 	return numer/denom;
 }
 
+/// Pearson Correlation (PC) of sparse rating vectors
+/// Unset ratings are zeros as in the dense version, but only the set ones 
+/// are visited: the centred sums are expanded into raw sums.
+inline float correlation_coeff(const sparse_vector_view_t &user1, 
+							   const sparse_vector_view_t &user2)
+{
+	assert(user1.size() == user2.size());
+	double n = user1.size();
+	double user1_sum = 0;
+	double user2_sum = 0;
+	double user1_sq_sum = 0;
+	double user2_sq_sum = 0;
+	simd_kernels().moments(user1.values(), user1.nonzeros(), user1_sum, user1_sq_sum);
+	simd_kernels().moments(user2.values(), user2.nonzeros(), user2_sum, user2_sq_sum);
+
+	double numer = elem_mult_sum(user1, user2) - user1_sum*user2_sum/n;
+	double user1r_sq_sum = user1_sq_sum - user1_sum*user1_sum/n;
+	double user2r_sq_sum = user2_sq_sum - user2_sum*user2_sum/n;
+	double denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
+
+	return numer/denom;
+}
+
+/// Pearson Correlation (PC) over co-rated products (p.125)
+/// Means are taken over the products rated by both users, only those
+/// are visited (one merge pass).
+inline float correlation_coeff_corated(const sparse_vector_view_t &user1, 
+									   const sparse_vector_view_t &user2)
+{
+	intersect_moments_t common = {0, 0, 0, 0, 0, 0};
+	simd_kernels().intersect_moments(user1.indexes(), user1.values(), user1.nonzeros(), 
+									 user2.indexes(), user2.values(), user2.nonzeros(), 
+									 common);
+	double n = common.count;
+	double numer = common.dot - common.sum1*common.sum2/n;
+	double user1r_sq_sum = common.sum_sqr1 - common.sum1*common.sum1/n;
+	double user2r_sq_sum = common.sum_sqr2 - common.sum2*common.sum2/n;
+	double denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
+
+	return numer/denom;
+}
+
 /// Cosine Vector (CV) (or Vector Space)
 /// p.124
 template <class R>
@@ -79,6 +141,36 @@ float cosine_angle(const R &user1, const R &user2)
 	return numer/denom;
 }
 
+/// Cosine Vector (CV) of sparse rating vectors
+inline float cosine_angle(const sparse_vector_view_t &user1, 
+						  const sparse_vector_view_t &user2)
+{
+	double user1_sum = 0;
+	double user2_sum = 0;
+	double user1_sq_sum = 0;
+	double user2_sq_sum = 0;
+	simd_kernels().moments(user1.values(), user1.nonzeros(), user1_sum, user1_sq_sum);
+	simd_kernels().moments(user2.values(), user2.nonzeros(), user2_sum, user2_sq_sum);
+
+	double numer = elem_mult_sum(user1, user2);
+	double denom = std::sqrt(user1_sq_sum) * std::sqrt(user2_sq_sum);
+
+	return numer/denom;
+}
+
+/// Cosine Vector (CV) over co-rated products
+inline float cosine_angle_corated(const sparse_vector_view_t &user1, 
+								  const sparse_vector_view_t &user2)
+{
+	intersect_moments_t common = {0, 0, 0, 0, 0, 0};
+	simd_kernels().intersect_moments(user1.indexes(), user1.values(), user1.nonzeros(), 
+									 user2.indexes(), user2.values(), user2.nonzeros(), 
+									 common);
+	double denom = std::sqrt(common.sum_sqr1) * std::sqrt(common.sum_sqr2);
+
+	return common.dot/denom;
+}
+
 /// Frequency-Weighted Pearson Correlation (FWPC)
 /// Recommender Systems Handbook By Francesco Ricci, Lior Rokach, Paul B. Kantor, p.129
 /// \tparam R User's ratings of products - vector type (R[i] - rating of a product i)
@@ -90,29 +182,101 @@ float cosine_angle(const R &user1, const R &user2)
 template <class R, class M>
 float correlation_coeff_idf(const R &user1, const R &user2, const M &metric)
 {
-	float numer = 0;
-	float denom = 0;
-
-	float user1r_sq_sum = 0;
-	float user2r_sq_sum = 0;
+	// means are computed in the same pass: centred sums are expanded into raw sums
+	double n = user1.size();
+	double user1_sum = 0;
+	double user2_sum = 0;
+	double weight_sum = 0;
+	double user1_weighted_sum = 0;
+	double user2_weighted_sum = 0;
+	double numer = 0;
+	double user1r_sq_sum = 0;
+	double user2r_sq_sum = 0;
 	
 	//for each product
 	for (int i = 0; i < user1.size(); ++i)
 	{
-		float user1r = user1[i] - mean(user1);
-		float user2r = user2[i] - mean(user2);
-		numer += metric(i) * user1r * user2r;
+		double weight = metric(i);
+		double user1r = user1[i];
+		double user2r = user2[i];
+		user1_sum += user1r;
+		user2_sum += user2r;
+		weight_sum += weight;
+		user1_weighted_sum += weight * user1r;
+		user2_weighted_sum += weight * user2r;
+		numer += weight * user1r * user2r;
 
-		user1r_sq_sum += metric(i) * user1r * user1r;
-		user2r_sq_sum += metric(i) * user2r * user2r;
+		user1r_sq_sum += weight * user1r * user1r;
+		user2r_sq_sum += weight * user2r * user2r;
 	}
+	double user1_mean = user1_sum/n;
+	double user2_mean = user2_sum/n;
+	numer += - user2_mean*user1_weighted_sum - user1_mean*user2_weighted_sum 
+			 + user1_mean*user2_mean*weight_sum;
+	user1r_sq_sum += - 2*user1_mean*user1_weighted_sum + user1_mean*user1_mean*weight_sum;
+	user2r_sq_sum += - 2*user2_mean*user2_weighted_sum + user2_mean*user2_mean*weight_sum;
 	
-	denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
+	double denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
 	//denom = std::sqrt(user1r_sq_sum * user2r_sq_sum); //in Recommender Systems Handbook
 
 	return numer/denom;
 }
 
+/// Frequency-Weighted Pearson Correlation (FWPC) over co-rated products
+/// Means are taken over the products rated by both users, only those
+/// are visited (one merge pass).
+template <class M>
+float correlation_coeff_idf_corated(const sparse_vector_view_t &user1, 
+									const sparse_vector_view_t &user2, const M &metric)
+{
+	double n = 0;
+	double user1_sum = 0;
+	double user2_sum = 0;
+	double weight_sum = 0;
+	double user1_weighted_sum = 0;
+	double user2_weighted_sum = 0;
+	double numer = 0;
+	double user1r_sq_sum = 0;
+	double user2r_sq_sum = 0;
+	size_t k1 = 0;
+	size_t k2 = 0;
+	while (k1 < user1.nonzeros() && k2 < user2.nonzeros())
+	{
+		if (user1.index(k1) < user2.index(k2))
+		{
+			++k1;
+		}
+		else if (user2.index(k2) < user1.index(k1))
+		{
+			++k2;
+		}
+		else
+		{
+			double weight = metric(user1.index(k1));
+			double user1r = user1.value(k1++);
+			double user2r = user2.value(k2++);
+			n += 1;
+			user1_sum += user1r;
+			user2_sum += user2r;
+			weight_sum += weight;
+			user1_weighted_sum += weight * user1r;
+			user2_weighted_sum += weight * user2r;
+			numer += weight * user1r * user2r;
+			user1r_sq_sum += weight * user1r * user1r;
+			user2r_sq_sum += weight * user2r * user2r;
+		}
+	}
+	double user1_mean = user1_sum/n;
+	double user2_mean = user2_sum/n;
+	numer += - user2_mean*user1_weighted_sum - user1_mean*user2_weighted_sum 
+			 + user1_mean*user2_mean*weight_sum;
+	user1r_sq_sum += - 2*user1_mean*user1_weighted_sum + user1_mean*user1_mean*weight_sum;
+	user2r_sq_sum += - 2*user2_mean*user2_weighted_sum + user2_mean*user2_mean*weight_sum;
+	double denom = std::sqrt(user1r_sq_sum) * std::sqrt(user2r_sq_sum);
+
+	return numer/denom;
+}
+
 class correlation_coeff_resembl_metric_t
 {
 public:
@@ -123,9 +287,103 @@ public:
 	{
 		return correlation_coeff(user1, user2);
 	}
+	static const char *name()
+	{
+		return "pearson";
+	}
+	
+	/// User's statistics for the all-pairs computation: ratings are centred
+	/// by 'offset' and normalised by 'scale' (unset ratings are zeros)
+	static void prepare(const sparse_vector_view_t &user, double &offset, double &scale)
+	{
+		double n = user.size();
+		double user_sum = 0;
+		double user_sq_sum = 0;
+		simd_kernels().moments(user.values(), user.nonzeros(), user_sum, user_sq_sum);
+		offset = user_sum/n;
+		scale = std::sqrt(user_sq_sum - user_sum*user_sum/n);
+	}
+	/// Resemblance from the raw dot product of the users' ratings
+	static float from_dot(double dot, size_t n, 
+						  double offset1, double scale1, double offset2, double scale2)
+	{
+		return (dot - n*offset1*offset2)/(scale1*scale2);
+	}
+};
+
+class cosine_angle_resembl_metric_t
+{
+public:
+	cosine_angle_resembl_metric_t()
+	{}
+	template <class U>
+	float operator()(const U &user1, const U &user2) const
+	{
+		return cosine_angle(user1, user2);
+	}
+	static const char *name()
+	{
+		return "cosine";
+	}
+	
+	/// \see correlation_coeff_resembl_metric_t::prepare
+	static void prepare(const sparse_vector_view_t &user, double &offset, double &scale)
+	{
+		double user_sum = 0;
+		double user_sq_sum = 0;
+		simd_kernels().moments(user.values(), user.nonzeros(), user_sum, user_sq_sum);
+		offset = 0;
+		scale = std::sqrt(user_sq_sum);
+	}
+	/// \see correlation_coeff_resembl_metric_t::from_dot
+	static float from_dot(double dot, size_t /*n*/, 
+						  double /*offset1*/, double scale1, double /*offset2*/, double scale2)
+	{
+		return dot/(scale1*scale2);
+	}
+};
+
+/// Pearson Correlation over co-rated products
+/// Can't be computed by the all-pairs user_resembl (no prepare()/from_dot()).
+class corated_correlation_coeff_resembl_metric_t
+{
+public:
+	corated_correlation_coeff_resembl_metric_t()
+	{}
+	float operator()(const sparse_vector_view_t &user1, 
+					 const sparse_vector_view_t &user2) const
+	{
+		return correlation_coeff_corated(user1, user2);
+	}
+	static const char *name()
+	{
+		return "pearson-co";
+	}
+};
+
+/// Cosine Vector over co-rated products
+class corated_cosine_angle_resembl_metric_t
+{
+public:
+	corated_cosine_angle_resembl_metric_t()
+	{}
+	float operator()(const sparse_vector_view_t &user1, 
+					 const sparse_vector_view_t &user2) const
+	{
+		return cosine_angle_corated(user1, user2);
+	}
+	static const char *name()
+	{
+		return "cosine-co";
+	}
 };
 
 /// User resemblance caching functor
+/// Computed coefficients are kept in the dense resemblance matrix, or in the
+/// memory-bounded similarity cache if one is used (use_cache()): the matrices
+/// are then not accessed (and may be empty) and every lookup is thread-safe.
+/// Empty matrices without a cache keep nothing: the persisted coefficients
+/// are looked up and the others are computed on every lookup.
 /// \tparam RatingsT Type of the Ratings matrix
 /// \tparam ResemblanceT Type of the Resemblance matrix
 /// \tparam ResemblanceMaskT Type of the Resemblance matrix mask matrix
@@ -136,6 +394,8 @@ class user_resemblance_t
 {
 public:
 	typedef MetricT metric_type;
+	typedef ResemblanceT resemblance_type;
+	typedef ResemblanceMaskT resemblance_mask_type;
 
 	/// Constructor
 	/// \param[in] ratings Ratings matrix
@@ -146,9 +406,28 @@ public:
 					   ResemblanceMaskT &resemblance_mask, 
 					   const MetricT &metric = MetricT())
 		:m_ratings(ratings), m_metric(metric), m_resemblance(resemblance), 
-		m_resemblance_mask(resemblance_mask)
+		m_resemblance_mask(resemblance_mask), m_persisted(0), m_cache(0), m_computed(0)
 	{}
 	
+	/// Use persisted resemblance before computing it
+	/// \param[in] persisted Resemblance persisted for the same ratings and metric
+	void use_persisted(const resemblance_cache_t &persisted)
+	{
+		m_persisted = persisted.is_open() ? &persisted : 0;
+	}
+	
+	/// Keep the computed resemblance in the cache instead of the matrix
+	/// \param[in] cache Similarity cache, must outlive the functor
+	void use_cache(similarity_cache_t &cache)
+	{
+		m_cache = &cache;
+	}
+	/// Similarity cache in use, 0 if the matrix is used
+	similarity_cache_t *cache() const
+	{
+		return m_cache;
+	}
+	
 	/// Resemblance coefficient for users
 	/// \param[in] user1 First user index in the Rating matrix
 	/// \param[in] user2 Second user index in the Rating matrix
@@ -156,28 +435,148 @@ public:
 	float operator()(size_t user1, size_t user2)
 	{
 		//std::clog << "user_resemblance_t::operator()(user1 = " << user1 << ", user2 = " << user2 << ")" << std::endl;
+		if (!uses_matrix())
+		{
+			float known = 0;
+			if (cached(user1, user2, known))
+			{
+				count_lookup(true);
+				return known;
+			}
+			++m_computed;
+			count_lookup(false);
+			return compute(user1, user2);
+		}
 		if (bool(m_resemblance_mask(user1, user2)) == false)
 		{
+			float persisted = 0;
 			//Note: m_resemblance matrix is symmetric - 
 			// we can even store only upper triangle
-			m_resemblance(user1, user2) = m_metric(m_ratings.get_row(user1), 
-												   m_ratings.get_row(user2));
+			if (m_persisted != 0 && m_persisted->find(user1, user2, persisted))
+			{
+				m_resemblance(user1, user2) = persisted;
+				count_lookup(true);
+			}
+			else
+			{
+				m_resemblance(user1, user2) = m_metric(m_ratings.get_row(user1), 
+													   m_ratings.get_row(user2));
+				++m_computed;
+				count_lookup(false);
+			}
 			m_resemblance(user2, user1) = m_resemblance(user1, user2);
 			m_resemblance_mask(user1, user2) = true;
 			m_resemblance_mask(user2, user1) = true;
 		}
+		else
+		{
+			count_lookup(true);
+		}
 		return m_resemblance(user1, user2);
 	}
 	
+	/// Already known resemblance coefficient, nothing is computed
+	/// \return false if the resemblance is not known yet
+	bool cached(size_t user1, size_t user2, float &resemblance) const
+	{
+		if (m_cache != 0)
+		{
+			if (m_cache->find(user1, user2, resemblance))
+			{
+				return true;
+			}
+			// persisted coefficient is cached on the first lookup
+			if (m_persisted != 0 && m_persisted->find(user1, user2, resemblance))
+			{
+				m_cache->insert(user1, user2, resemblance);
+				return true;
+			}
+			return false;
+		}
+		if (uses_matrix() && bool(m_resemblance_mask(user1, user2)) == true)
+		{
+			resemblance = m_resemblance(user1, user2);
+			return true;
+		}
+		return m_persisted != 0 && m_persisted->find(user1, user2, resemblance);
+	}
+	
+	/// Resemblance coefficient for users, stored in the similarity cache only
+	/// Known coefficient is returned as is, unknown one is computed; can be
+	/// called concurrently.
+	float resemblance(size_t user1, size_t user2) const
+	{
+		float known = 0;
+		if (cached(user1, user2, known))
+		{
+			count_lookup(true);
+			return known;
+		}
+		count_lookup(false);
+		return compute(user1, user2);
+	}
+	
+	/// Number of users
+	size_t users() const
+	{
+		return m_ratings.rows();
+	}
+	/// Name of the resemblance metric (persisted resemblance key)
+	const char *metric_name() const
+	{
+		return MetricT::name();
+	}
+	/// Number of the resemblance coefficients computed (not found in the persisted ones)
+	size_t computed() const
+	{
+		return m_computed;
+	}
+	
 private:
+	/// Computed coefficients are kept in the matrix
+	bool uses_matrix() const
+	{
+		return m_cache == 0 && m_resemblance_mask.rows() > 0;
+	}
+
+	/// Compute the coefficient, cache it if the similarity cache is used
+	float compute(size_t user1, size_t user2) const
+	{
+		float resemblance = m_metric(m_ratings.get_row(user1), m_ratings.get_row(user2));
+		if (m_cache != 0)
+		{
+			m_cache->insert(user1, user2, resemblance);
+		}
+		return resemblance;
+	}
+
+	/// Count the coefficient found (cached or persisted) or computed
+	static void count_lookup(bool found)
+	{
+		if (instrumentation_enabled())
+		{
+			static instrumentation_counter_t &hits = 
+				instrumentation_t::instance().counter("resemblance cache hits");
+			static instrumentation_counter_t &misses = 
+				instrumentation_t::instance().counter("resemblance cache misses");
+			(found ? hits : misses).add(1);
+		}
+	}
+
 	const RatingsT &m_ratings;	///< Ratings matrix
-	const MetricT &m_metric;	///< User resemblance metric
+	const MetricT m_metric;	///< User resemblance metric
 	ResemblanceT &m_resemblance;	///< Resemblance matrix
 	ResemblanceMaskT &m_resemblance_mask;	///< Resemblance matrix mask matrix
+	const resemblance_cache_t *m_persisted;	///< Persisted resemblance, if any
+	similarity_cache_t *m_cache;	///< Similarity cache, if used instead of the matrix
+	size_t m_computed;	///< Number of computed coefficients
 };
 
 typedef user_resemblance_t<itpp::mat, itpp::mat, itpp::bmat, 
 							   correlation_coeff_resembl_metric_t> user_resemblance_itpp_t;
+/// Resemblance of the sparse ratings is kept as packed floats and flags
+typedef user_resemblance_t<sparse_ratings_t, symmetric_matrix_t<float>, symmetric_bit_matrix_t, 
+							   correlation_coeff_resembl_metric_t> user_resemblance_sparse_t;
 
 template <class R, class M>
 void user_resembl(const R &users_ratings, R &user_resemblance, const M &user_resemblance_metric)
@@ -188,9 +587,123 @@ void user_resembl(const R &users_ratings, R &user_resemblance, const M &user_res
 		{
 			user_resemblance(i,j) = user_resemblance_metric(users_ratings.get_row(i), users_ratings.get_row(j));
 			user_resemblance(j,i) = user_resemblance(i,j);
-			std::cout << "(" << i << "," << j << ") -> " << user_resemblance(i,j) << std::endl;
 		}
 	}
 }
 
+/// All-pairs users' resemblance
+/// \return Number of the computed pairs
+template <class D, class R, class B, class M>
+size_t user_resembl(const D &users_ratings, 
+					R &user_resemblance, B &user_resemblance_mask, 
+					const M &user_resemblance_metric, 
+					size_t /*block_size*/ = 0, size_t /*verbosity*/ = 0)
+{
+	user_resembl(users_ratings, user_resemblance, user_resemblance_metric);
+	for (int i=0; i<user_resemblance.rows(); ++i)
+	{
+		for (int j=0; j<user_resemblance.cols(); ++j)
+		{
+			user_resemblance_mask(i,j) = true;
+		}
+	}
+	return user_resemblance.rows()*(user_resemblance.rows() + 1)/2;
+}
+
+/// All-pairs users' resemblance of the sparse ratings
+/// Every user's ratings are centred and normalised once (as the metric's 
+/// offset and scale, so the rows stay sparse); the pairs are computed as 
+/// the blocked product of the ratings matrix by its transpose. Tiles of the
+/// upper triangle are computed concurrently, every pair once, and both 
+/// symmetric cells of the resemblance matrix are written. Pairs already set
+/// in the mask (e.g. copied from the persisted resemblance) are kept.
+/// \tparam R Type of the Resemblance matrix
+/// \tparam B Type of the Resemblance matrix mask matrix
+/// \tparam M Type of the user resemblance metric
+/// \param[in] users_ratings Ratings matrix
+/// \param[in,out] user_resemblance Resemblance matrix
+/// \param[in,out] user_resemblance_mask Resemblance matrix mask matrix
+/// \param[in] block_size Tile size (users)
+/// \return Number of the computed pairs
+template <class R, class B, class M>
+size_t user_resembl(const sparse_ratings_t &users_ratings, 
+					R &user_resemblance, B &user_resemblance_mask, 
+					const M &/*user_resemblance_metric*/, 
+					size_t block_size = 256, size_t verbosity = 0)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t users = users_ratings.rows();
+	size_t products = users_ratings.cols();
+	
+	std::vector<double> offset(users);
+	std::vector<double> scale(users);
+	parallel_for(0, users, [&](size_t i) {
+		M::prepare(users_ratings.get_row(i), offset[i], scale[i]);
+	});
+	
+	size_t blocks = (users + block_size - 1)/block_size;
+	std::vector<std::pair<size_t, size_t> > tiles;
+	tiles.reserve(blocks*(blocks + 1)/2);
+	for (size_t bi = 0; bi < blocks; ++bi)
+	{
+		for (size_t bj = bi; bj < blocks; ++bj)
+		{
+			tiles.push_back(std::make_pair(bi, bj));
+		}
+	}
+	
+	// user1's row scattered to the thread's dense buffer, user2's rows 
+	// gathered from it; the buffer is zeroed back after every row
+	parallel_scratch_t<std::vector<float> > dense_rows((std::vector<float>(products, 0)));
+	std::atomic<size_t> computed(0);
+	parallel_for(0, tiles.size(), [&](size_t t) {
+		size_t tile_computed = 0;
+		size_t i_begin = tiles[t].first*block_size;
+		size_t i_end = std::min(users, i_begin + block_size);
+		size_t j_begin = tiles[t].second*block_size;
+		size_t j_end = std::min(users, j_begin + block_size);
+		std::vector<float> &dense = dense_rows.local();
+		for (size_t i = i_begin; i < i_end; ++i)
+		{
+			sparse_vector_view_t user1 = users_ratings.get_row(i);
+			for (size_t k = 0; k < user1.nonzeros(); ++k)
+			{
+				dense[user1.index(k)] = user1.value(k);
+			}
+			for (size_t j = std::max(i, j_begin); j < j_end; ++j)
+			{
+				if (bool(user_resemblance_mask(i, j)) == true)
+				{
+					continue;
+				}
+				sparse_vector_view_t user2 = users_ratings.get_row(j);
+				double dot = simd_kernels().gather_dot(dense.data(), user2.indexes(), 
+													  user2.values(), user2.nonzeros());
+				float resemblance = M::from_dot(dot, products, offset[i], scale[i], 
+												offset[j], scale[j]);
+				user_resemblance(i, j) = resemblance;
+				user_resemblance(j, i) = resemblance;
+				user_resemblance_mask(i, j) = true;
+				user_resemblance_mask(j, i) = true;
+				++tile_computed;
+			}
+			for (size_t k = 0; k < user1.nonzeros(); ++k)
+			{
+				dense[user1.index(k)] = 0;
+			}
+		}
+		computed += tile_computed;
+	});
+	
+	size_t pairs = computed.load();
+	if (verbosity >= 1)
+	{
+		double seconds = std::chrono::duration<double>(
+							std::chrono::steady_clock::now() - start).count();
+		std::cout << "(" << pairs << " pairs, " 
+				  << (seconds > 0 ? pairs/seconds : 0) << " pairs/sec) ";
+	}
+	return pairs;
+}
+
 #endif	// SPBAU_RECOMMENDER_USER_RESEMBLANCE_HPP_